@@ -37,11 +37,16 @@
 #include <sys/_libevent_time.h>
 #endif
 #include <sys/queue.h>
+#include <sys/socket.h>
 #include <sys/epoll.h>
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #ifdef HAVE_FCNTL_H
@@ -51,22 +56,59 @@
 #include "event.h"
 #include "event-internal.h"
 #include "evsignal.h"
+#include "evthread-internal.h"
 #include "log.h"
 
 /* due to limitations in the epoll interface, we need to keep track of
  * all file descriptors outself.
  */
 struct evepoll {
-	struct event *evread;
-	struct event *evwrite;
+	/* the I/O events on the fd, linked by ev_io_next */
+	struct event_list events;
+	/* how many of them wait for each kind of event, and how many are
+	 * edge-triggered; the fd is registered for the union */
+	int nread;
+	int nwrite;
+	int nclosed;
+	int net;
+	int nexclusive;
+	/* the events the kernel has for the fd; 0 if it is not in the set */
+	int registered;
+	/* set while the fd is on the changelist */
+	int changed;
+	/* set if the fd lost all its events since the last flush; it may
+	 * have been closed and reopened behind our back */
+	int dropped;
+	/* one-shot mode: events activated by the last wakeup that have not
+	 * run yet; the fd stays disarmed until this drops to 0 */
+	int claimed;
 };
 
 struct epollop {
-	struct evepoll *fds;
-	int nfds;
+	/* see epoll_fd_lookup() */
+	struct evepoll ***fdmap;
+	int nfdmap;
 	struct epoll_event *events;
 	int nevents;
+	/* bounds of nevents, and the most events a wait returned since the
+	 * array last changed size or the window last ended */
+	int nevents_min;
+	int nevents_max;
+	int window_peak;
+	int window_dispatches;
 	int epfd;
+	/* armed for the next timeout if we need precise timers, else -1 */
+	int timerfd;
+	/* set if several threads dispatch; fds are added with EPOLLONESHOT */
+	int oneshot;
+	/* set once the kernel refused EPOLLEXCLUSIVE */
+	int no_exclusive;
+	/* SO_BUSY_POLL for the sockets that we register, or 0 */
+	int busy_poll_sockets;
+	/* fds whose events changed since the last epoll_wait() */
+	int *changes;
+	int nchanges;
+	int changes_size;
 };
 
 static void *epoll_init	(struct event_base *);
@@ -74,6 +116,7 @@ static int epoll_add	(void *, struct event *);
 static int epoll_del	(void *, struct event *);
 static int epoll_dispatch	(struct event_base *, void *, struct timeval *);
 static void epoll_dealloc	(struct event_base *, void *);
+static void epoll_release	(struct event_base *, void *, int);
 
 const struct eventop epollops = {
 	"epoll",
@@ -82,7 +125,10 @@ const struct eventop epollops = {
 	epoll_del,
 	epoll_dispatch,
 	epoll_dealloc,
-	1 /* need reinit */
+	1, /* need reinit */
+	1, /* thread safe */
+	epoll_release,
+	EV_FEATURE_ET|EV_FEATURE_O1|EV_FEATURE_EARLY_CLOSE|EV_FEATURE_EXCLUSIVE
 };
 
 #ifdef HAVE_SETFD
@@ -102,9 +148,16 @@ const struct eventop epollops = {
  */
 #define MAX_EPOLL_TIMEOUT_MSEC (35*60*1000)
 
+/* Linux 4.5 and later; older kernels ignore or refuse it */
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1U << 28)
+#endif
+
 #define INITIAL_NFILES 32
 #define INITIAL_NEVENTS 32
 #define MAX_NEVENTS 4096
+/* waits after which an array that is mostly unused shrinks */
+#define NEVENTS_WINDOW 64
 
 static void *
 epoll_init(struct event_base *base)
@@ -126,78 +179,534 @@ epoll_init(struct event_base *base)
 
 	FD_CLOSEONEXEC(epfd);
 
-	if (!(bv  = calloc(1, sizeof(struct epollop))))
+	if (!(epollop = calloc(1, sizeof(struct epollop)))) {
+		close(epfd);
 		return (NULL);
+	}
 
 	epollop->epfd = epfd;
+	epollop->timerfd = -1;
+	epollop->oneshot =
+	    (base->flags & EVENT_BASE_FLAG_MULTI_DISPATCH) != 0;
+	if (base->busy_poll_flags & EVENT_BUSY_POLL_SOCKETS)
+		epollop->busy_poll_sockets = base->busy_poll_max;
 
 	/* Initalize fields */
-	epollop->events = malloc(INITIAL_NEVENTS * sizeof(struct epoll_event));
+	epollop->nevents_min = base->batch_min ? base->batch_min : INITIAL_NEVENTS;
+	epollop->nevents_max = base->batch_max ? base->batch_max : MAX_NEVENTS;
+    /* 初始化事件数量 */
+	epollop->nevents = INITIAL_NEVENTS;
+	if (epollop->nevents < epollop->nevents_min)
+		epollop->nevents = epollop->nevents_min;
+	if (epollop->nevents > epollop->nevents_max)
+		epollop->nevents = epollop->nevents_max;
+	epollop->events = malloc(epollop->nevents * sizeof(struct epoll_event));
 	if (epollop->events == NULL) {
 		free(epollop);
 		return (NULL);
 	}
-    /* 初始化事件数量 */
-	epollop->nevents = INITIAL_NEVENTS;
 
-	epollop->fds = calloc(INITIAL_NFILES, sizeof(struct evepoll));
-	if (epollop->fds == NULL) {
-		free(epollop->events);
-		free(epollop);
-		return (NULL);
+#ifdef HAVE_SYS_TIMERFD_H
+	/*
+	 * epoll_wait() only takes a timeout in milliseconds.  For precise
+	 * timers, we sleep on a timerfd instead; if we cannot get one, we
+	 * just fall back to the millisecond timeout.  Threads that share
+	 * the epoll set cannot share a timerfd.
+	 */
+	if (!epollop->oneshot &&
+	    ((base->flags & EVENT_BASE_FLAG_PRECISE_TIMER) ||
+		evutil_getenv("EVENT_PRECISE_TIMER"))) {
+		struct epoll_event epev = {0, {0}};
+		int fd;
+
+		if ((fd = timerfd_create(CLOCK_MONOTONIC, 0)) != -1) {
+			FD_CLOSEONEXEC(fd);
+			epev.data.fd = fd;
+			epev.events = EPOLLIN;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &epev) == 0)
+				epollop->timerfd = fd;
+			else {
+				event_warn("epoll_ctl(timerfd)");
+				close(fd);
+			}
+		} else if (errno != EINVAL && errno != ENOSYS)
+			event_warn("timerfd_create");
 	}
-	epollop->nfds = INITIAL_NFILES;
+#endif
 
 	evsignal_init(base);
 
 	return (epollop);
 }
 
+/*
+ * The evepoll of an fd lives in a radix tree of three levels.  The top
+ * level grows with the highest fd, one pointer for every 256K fds; the
+ * middle and leaf pages are allocated when an fd in their range is first
+ * added.  A stray high fd costs one page of each, not an array up to it.
+ */
+#define FDMAP_LEAF_BITS	8
+#define FDMAP_MID_BITS	10
+#define FDMAP_LEAF_SIZE	(1 << FDMAP_LEAF_BITS)
+#define FDMAP_MID_SIZE	(1 << FDMAP_MID_BITS)
+#define FDMAP_TOP(fd)	((fd) >> (FDMAP_LEAF_BITS + FDMAP_MID_BITS))
+#define FDMAP_MID(fd)	(((fd) >> FDMAP_LEAF_BITS) & (FDMAP_MID_SIZE - 1))
+#define FDMAP_LEAF(fd)	((fd) & (FDMAP_LEAF_SIZE - 1))
+
+/* Returns the evepoll of fd, or NULL if no event on its page was added */
+static struct evepoll *
+epoll_fd_lookup(struct epollop *epollop, int fd)
+{
+	struct evepoll **mid, *leaf;
+
+	if (fd < 0 || FDMAP_TOP(fd) >= epollop->nfdmap)
+		return (NULL);
+	if ((mid = epollop->fdmap[FDMAP_TOP(fd)]) == NULL)
+		return (NULL);
+	if ((leaf = mid[FDMAP_MID(fd)]) == NULL)
+		return (NULL);
+	return (&leaf[FDMAP_LEAF(fd)]);
+}
+
+/* Like epoll_fd_lookup(), but allocates the pages that fd needs */
+static struct evepoll *
+epoll_fd_get(struct epollop *epollop, int fd)
+{
+	struct evepoll **mid, *leaf;
+	int i, top = FDMAP_TOP(fd);
+
+	if (fd < 0)
+		return (NULL);
+
+	if (top >= epollop->nfdmap) {
+		struct evepoll ***fdmap;
+		int nfdmap = epollop->nfdmap ? epollop->nfdmap : 1;
+
+		while (nfdmap <= top)
+			nfdmap <<= 1;
+		fdmap = realloc(epollop->fdmap, nfdmap * sizeof(*fdmap));
+		if (fdmap == NULL) {
+			event_warn("realloc");
+			return (NULL);
+		}
+		memset(fdmap + epollop->nfdmap, 0,
+		    (nfdmap - epollop->nfdmap) * sizeof(*fdmap));
+		epollop->fdmap = fdmap;
+		epollop->nfdmap = nfdmap;
+	}
+
+	if ((mid = epollop->fdmap[top]) == NULL) {
+		if ((mid = calloc(FDMAP_MID_SIZE, sizeof(*mid))) == NULL) {
+			event_warn("calloc");
+			return (NULL);
+		}
+		epollop->fdmap[top] = mid;
+	}
+
+	if ((leaf = mid[FDMAP_MID(fd)]) == NULL) {
+		if ((leaf = calloc(FDMAP_LEAF_SIZE, sizeof(*leaf))) == NULL) {
+			event_warn("calloc");
+			return (NULL);
+		}
+		for (i = 0; i < FDMAP_LEAF_SIZE; ++i)
+			TAILQ_INIT(&leaf[i].events);
+		mid[FDMAP_MID(fd)] = leaf;
+	}
+
+	return (&leaf[FDMAP_LEAF(fd)]);
+}
+
+static void
+epoll_fdmap_free(struct epollop *epollop)
+{
+	struct evepoll **mid;
+	int i, j;
+
+	for (i = 0; i < epollop->nfdmap; ++i) {
+		if ((mid = epollop->fdmap[i]) == NULL)
+			continue;
+		for (j = 0; j < FDMAP_MID_SIZE; ++j)
+			if (mid[j] != NULL)
+				free(mid[j]);
+		free(mid);
+	}
+	if (epollop->fdmap)
+		free(epollop->fdmap);
+}
+
+/*
+ * In one-shot mode, epoll reports a ready fd to a single thread and then
+ * disarms it.  The events that the wakeup activates are marked as claimed,
+ * which keeps them on a queue that only this thread runs; once all of
+ * them have run (or left the queue), epoll_release() arms the fd again
+ * with whatever events it has by then.  Other threads may wait in
+ * epoll_wait() meanwhile, so changes go to the kernel at once.
+ */
+static void
+epoll_claim(struct evepoll *evep, struct event *ev)
+{
+	if (ev == NULL || (ev->ev_flags & EVLIST_X_CLAIMED))
+		return;
+	ev->ev_flags |= EVLIST_X_CLAIMED;
+	evep->claimed++;
+}
+
+#define EPOLL_IS_ET(ev)	(((ev)->ev_events & EV_ET) != 0)
+#define EPOLL_IS_EXCLUSIVE(ev)	(((ev)->ev_events & EV_EXCLUSIVE) != 0)
+
+/*
+ * Brings the kernel registration of an unclaimed fd in line with its
+ * events, with at most one epoll_ctl() call.
+ */
 static int
-epoll_recalc(struct event_base *base, void *arg, int max)
+epoll_apply(struct epollop *epollop, int fd)
 {
-	struct epollop *epollop = arg;
+	struct evepoll *evep = epoll_fd_lookup(epollop, fd);
+	struct epoll_event epev = {0, {0}};
+	int op, dropped = evep->dropped;
+
+	if (evep->claimed)
+		return (0);
+	evep->dropped = 0;
+
+	if (evep->nread)
+		epev.events |= EPOLLIN;
+	if (evep->nwrite)
+		epev.events |= EPOLLOUT;
+	if (evep->nclosed)
+		epev.events |= EPOLLRDHUP;
+	epev.data.fd = fd;
 
-	if (max >= epollop->nfds) {
-		struct evepoll *fds;
-		int nfds;
+	if (epev.events == 0) {
+		if (!evep->registered)
+			return (0);
+		evep->registered = 0;
+		/* the fd may have been closed already */
+		if (epoll_ctl(epollop->epfd, EPOLL_CTL_DEL, fd, &epev) == -1 &&
+		    errno != EBADF && errno != ENOENT)
+			return (-1);
+		return (0);
+	}
 
-		nfds = epollop->nfds;
-		while (nfds <= max)
-			nfds <<= 1;
+	/* epoll_add() made sure that all events agree */
+	if (evep->net)
+		epev.events |= EPOLLET;
+	/* a one-shot fd already wakes up a single thread */
+	if (epollop->oneshot)
+		epev.events |= EPOLLONESHOT;	/* re-arms it, too */
+	else if (evep->nexclusive && !epollop->no_exclusive)
+		epev.events |= EPOLLEXCLUSIVE;
+	if (!epollop->oneshot &&
+	    (int)epev.events == evep->registered && !dropped)
+		return (0);
 
-		fds = realloc(epollop->fds, nfds * sizeof(struct evepoll));
-		if (fds == NULL) {
+	op = evep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	/* the kernel cannot modify an exclusive registration in place */
+	if (op == EPOLL_CTL_MOD &&
+	    ((evep->registered | epev.events) & EPOLLEXCLUSIVE)) {
+		(void)epoll_ctl(epollop->epfd, EPOLL_CTL_DEL, fd, &epev);
+		op = EPOLL_CTL_ADD;
+	}
+	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1) {
+		/* a closed and reopened fd is no longer in the set, or a
+		 * new one still is */
+		if (op == EPOLL_CTL_MOD && errno == ENOENT)
+			op = EPOLL_CTL_ADD;
+		else if (op == EPOLL_CTL_ADD && errno == EEXIST)
+			op = EPOLL_CTL_MOD;
+		else if (errno == EINVAL && (epev.events & EPOLLEXCLUSIVE)) {
+			/* the kernel is too old; share the wakeups */
+			epollop->no_exclusive = 1;
+			epev.events &= ~EPOLLEXCLUSIVE;
+		} else
+			return (-1);
+		if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
+			return (-1);
+	}
+	evep->registered = epev.events;
+#ifdef SO_BUSY_POLL
+	/* the fd is new to the set; it may not be a socket, or raising
+	 * the value may need privileges */
+	if (op == EPOLL_CTL_ADD && epollop->busy_poll_sockets)
+		(void)setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+		    (void *)&epollop->busy_poll_sockets, sizeof(int));
+#endif
+	return (0);
+}
+
+/* Remembers that the events of fd changed; returns -1 if we are out of
+ * memory */
+static int
+epoll_queue_change(struct epollop *epollop, int fd)
+{
+	struct evepoll *evep = epoll_fd_lookup(epollop, fd);
+
+	if (evep->changed)
+		return (0);
+	if (epollop->nchanges == epollop->changes_size) {
+		int size = epollop->changes_size ? epollop->changes_size * 2 :
+		    INITIAL_NFILES;
+		int *changes = realloc(epollop->changes, size * sizeof(int));
+		if (changes == NULL) {
 			event_warn("realloc");
 			return (-1);
 		}
-		epollop->fds = fds;
-		memset(fds + epollop->nfds, 0,
-		    (nfds - epollop->nfds) * sizeof(struct evepoll));
-		epollop->nfds = nfds;
+		epollop->changes = changes;
+		epollop->changes_size = size;
 	}
-
+	epollop->changes[epollop->nchanges++] = fd;
+	evep->changed = 1;
 	return (0);
 }
 
+/*
+ * Hands the net changes since the last call to the kernel.  An event that
+ * was deleted and added again, as bufferevents do all the time, costs no
+ * system call at all.
+ */
+static void
+epoll_flush_changes(struct epollop *epollop)
+{
+	int i, fd;
+
+	for (i = 0; i < epollop->nchanges; ++i) {
+		fd = epollop->changes[i];
+		epoll_fd_lookup(epollop, fd)->changed = 0;
+		if (epoll_apply(epollop, fd) == -1)
+			event_warn("%s: epoll_ctl on %d", __func__, fd);
+	}
+	epollop->nchanges = 0;
+}
+
+static void
+epoll_release(struct event_base *base, void *arg, int fd)
+{
+	struct epollop *epollop = arg;
+	struct evepoll *evep;
+
+	if ((evep = epoll_fd_lookup(epollop, fd)) == NULL)
+		return;
+	if (evep->claimed > 0 && --evep->claimed == 0 &&
+	    epoll_apply(epollop, fd) == -1)
+		event_warn("%s: epoll_ctl on %d", __func__, fd);
+}
+
+/*
+ * Busy polling.  Before epoll_wait() puts us to sleep, we poll without a
+ * timeout for up to the spin budget; events that arrive meanwhile are
+ * handled without two context switches.  The budget follows the average
+ * time that we waited for events: twice that, so that most arrivals are
+ * caught while spinning, but no more than the maximum.  Once events come
+ * further apart than the maximum, spinning rarely catches one, and we
+ * only spin for a sixteenth of it.
+ */
+static ev_int64_t
+epoll_now_usec(void)
+{
+	struct timeval tv;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return ((ev_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+	gettimeofday(&tv, NULL);
+	return ((ev_int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+/* Spins until epoll reports something or the budget runs out; returns
+ * the result of the last poll */
+static int
+epoll_spin(struct epollop *epollop, struct epoll_event *events, int nevents,
+    ev_int64_t start, long budget, int *polls)
+{
+	int res;
+
+	do {
+		res = epoll_wait(epollop->epfd, events, nevents, 0);
+		++*polls;
+	} while (res == 0 && epoll_now_usec() - start < budget);
+	return (res);
+}
+
+/* Counts what the spinning did and adapts the budget to the wait */
+static void
+epoll_busy_poll_update(struct event_base *base, int spun, int polls,
+    ev_int64_t waited)
+{
+	struct event_busy_poll_stats *stats = &base->busy_poll;
+	long max = base->busy_poll_max;
+	long min = max / 16 ? max / 16 : 1;
+
+	if (spun)
+		stats->spins++;
+	else
+		stats->blocks++;
+	stats->polls += polls;
+
+	/* a long sleep counts no more than a few maximums, so that the
+	 * average comes back soon once events get frequent again */
+	if (waited > 4 * max)
+		waited = 4 * max;
+	stats->avg_wait_usec += ((long)waited - stats->avg_wait_usec) / 8;
+
+	if (stats->avg_wait_usec > max)
+		stats->budget_usec = min;
+	else if (2 * stats->avg_wait_usec > max)
+		stats->budget_usec = max;
+	else if (2 * stats->avg_wait_usec < min)
+		stats->budget_usec = min;
+	else
+		stats->budget_usec = 2 * stats->avg_wait_usec;
+}
+
+static void
+epoll_resize(struct epollop *epollop, int nevents)
+{
+	struct epoll_event *new_events;
+
+	new_events = realloc(epollop->events,
+	    nevents * sizeof(struct epoll_event));
+	if (new_events) {
+		epollop->events = new_events;
+		epollop->nevents = nevents;
+	}
+}
+
+/* Counts the events that a wait returned and sizes the array for the
+ * next one: it doubles when a wait fills it, and halves when no wait in a
+ * window used more than a quarter of it, so that it does not flap. */
+static void
+epoll_batch_update(struct event_base *base, struct epollop *epollop,
+    int res, int nevents)
+{
+	struct event_batch_stats *stats = &base->batch;
+	int n = epollop->nevents;
+
+	stats->dispatches++;
+	stats->events += res;
+	stats->last = res;
+	if (res > stats->peak)
+		stats->peak = res;
+	if (res > epollop->window_peak)
+		epollop->window_peak = res;
+
+	/* threads that share the set use a fixed array each */
+	if (epollop->oneshot) {
+		stats->size = nevents;
+		return;
+	}
+
+	if (res == n && n < epollop->nevents_max) {
+		/* We used all of the event space this time.  We should
+		   be ready for more events next time. */
+        /* 如果这次返回的事件数量占满了所有的事件空间，则扩容 */
+		n = n > epollop->nevents_max / 2 ? epollop->nevents_max : n * 2;
+		stats->grows++;
+	} else if (++epollop->window_dispatches >= NEVENTS_WINDOW) {
+        /* 一段时间内返回的事件都不到四分之一时缩容 */
+		if (epollop->window_peak * 4 <= n && n > epollop->nevents_min) {
+			n = n / 2 < epollop->nevents_min ?
+			    epollop->nevents_min : n / 2;
+			stats->shrinks++;
+		}
+		epollop->window_dispatches = 0;
+		epollop->window_peak = 0;
+	}
+
+	if (n != epollop->nevents) {
+		epoll_resize(epollop, n);
+		epollop->window_dispatches = 0;
+		epollop->window_peak = 0;
+	}
+	stats->size = epollop->nevents;
+}
+
 static int
 epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 {
 	struct epollop *epollop = arg;
 	struct epoll_event *events = epollop->events;
+	struct epoll_event oneshot_events[INITIAL_NEVENTS];
 	struct evepoll *evep;
-	int i, res, timeout = -1;
+	struct event *ev;
+	int i, res, nevents = epollop->nevents, timeout = -1;
+	int spun = 0, polls = 0;
+	/* the timeout in microseconds if epoll_wait() has to keep it */
+	ev_int64_t start = 0, wait_usec = -1;
+	long budget = 0;
+
+	/* other threads wait on the same set; each needs its own array.
+	 * A small batch leaves the other ready fds to idle threads. */
+	if (epollop->oneshot) {
+		events = oneshot_events;
+		nevents = INITIAL_NEVENTS;
+		if (nevents > epollop->nevents_max)
+			nevents = epollop->nevents_max;
+	}
+
+	epoll_flush_changes(epollop);
 
-	if (tv != NULL)
+#ifdef HAVE_SYS_TIMERFD_H
+	if (epollop->timerfd >= 0) {
+		struct itimerspec is;
+
+		/* a zero it_value disarms the timer */
+		memset(&is, 0, sizeof(is));
+		if (tv != NULL) {
+			/* the timerfd cannot return right away */
+			if (!evutil_timerisset(tv))
+				timeout = 0;
+			is.it_value.tv_sec = tv->tv_sec;
+			is.it_value.tv_nsec = tv->tv_usec * 1000;
+		}
+		/* this also clears an expiry that we did not read */
+		if (timerfd_settime(epollop->timerfd, 0, &is, NULL) == -1)
+			event_warn("timerfd_settime");
+	} else
+#endif
+	if (tv != NULL) {
+		wait_usec = (ev_int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
 		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+	}
 
 	if (timeout > MAX_EPOLL_TIMEOUT_MSEC) {
 		/* Linux kernels can wait forever if the timeout is too big;
 		 * see comment on MAX_EPOLL_TIMEOUT_MSEC. */
 		timeout = MAX_EPOLL_TIMEOUT_MSEC;
+		wait_usec = (ev_int64_t)MAX_EPOLL_TIMEOUT_MSEC * 1000;
 	}
 
-	res = epoll_wait(epollop->epfd, events, epollop->nevents, timeout);
+	/* no spinning if we must not wait at all, nor past the timeout; a
+	 * timerfd ends the spinning by itself */
+	if (base->busy_poll_max && timeout != 0) {
+		budget = base->busy_poll.budget_usec;
+		if (wait_usec >= 0 && budget > wait_usec)
+			budget = (long)wait_usec;
+	}
+
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	if (budget > 0) {
+		start = epoll_now_usec();
+		res = epoll_spin(epollop, events, nevents, start, budget,
+		    &polls);
+		spun = res != 0;
+		/* only block for what the spinning left of the timeout */
+		if (!spun && wait_usec >= 0) {
+			wait_usec -= epoll_now_usec() - start;
+			timeout = wait_usec > 0 ?
+			    (int)((wait_usec + 999) / 1000) : 0;
+		}
+	}
+	if (!spun)
+		res = epoll_wait(epollop->epfd, events, nevents, timeout);
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+
+	if (budget > 0)
+		epoll_busy_poll_update(base, spun, polls,
+		    epoll_now_usec() - start);
 
 	if (res == -1) {
 		if (errno != EINTR) {
@@ -214,105 +723,113 @@ epoll_dispatch(struct event_base *base, void *arg, struct timeval *tv)
 	event_debug(("%s: epoll_wait reports %d", __func__, res));
 
 	for (i = 0; i < res; i++) {
-		int what = events[i].events;
-		struct event *evread = NULL, *evwrite = NULL;
+		int what = events[i].events, ready = 0;
 		int fd = events[i].data.fd;
 
-		if (fd < 0 || fd >= epollop->nfds)
+		/* the timerfd only has to wake us up */
+		if (fd == epollop->timerfd ||
+		    (evep = epoll_fd_lookup(epollop, fd)) == NULL)
 			continue;
-		evep = &epollop->fds[fd];
 
 		if (what & (EPOLLHUP|EPOLLERR)) {
-			evread = evep->evread;
-			evwrite = evep->evwrite;
+			ready = EV_READ|EV_WRITE|EV_CLOSED;
 		} else {
-			if (what & EPOLLIN) {
-				evread = evep->evread;
-			}
-
-			if (what & EPOLLOUT) {
-				evwrite = evep->evwrite;
-			}
+			if (what & EPOLLIN)
+				ready |= EV_READ;
+			if (what & EPOLLOUT)
+				ready |= EV_WRITE;
+			if (what & EPOLLRDHUP)
+				ready |= EV_CLOSED;
 		}
 
-		if (!(evread||evwrite))
-			continue;
-
-		if (evread != NULL)
-			event_active(evread, EV_READ, 1);
-		if (evwrite != NULL)
-			event_active(evwrite, EV_WRITE, 1);
-	}
+		/* this thread owns the fd until the callbacks of the
+		 * events that it activates ran */
+		TAILQ_FOREACH(ev, &evep->events, ev_io_next) {
+			if (epollop->oneshot && (ev->ev_events & ready))
+				epoll_claim(evep, ev);
+		}
+		if (epollop->oneshot && !evep->claimed)
+			epoll_apply(epollop, fd);
 
-	if (res == epollop->nevents && epollop->nevents < MAX_NEVENTS) {
-		/* We used all of the event space this time.  We should
-		   be ready for more events next time. */
-        /* 如果这次返回的事件数量占满了所有的事件空间，则扩容 */
-		int new_nevents = epollop->nevents * 2;
-		struct epoll_event *new_events;
-
-		new_events = realloc(epollop->events,
-		    new_nevents * sizeof(struct epoll_event));
-		if (new_events) {
-			epollop->events = new_events;
-			epollop->nevents = new_nevents;
+		TAILQ_FOREACH(ev, &evep->events, ev_io_next) {
+			if (ev->ev_events & ready)
+				event_active(ev, ev->ev_events & ready, 1);
 		}
 	}
 
+	epoll_batch_update(base, epollop, res, nevents);
+
 	return (0);
 }
 
 
+/* Adds ev to the events of the fd, or takes it away if delta is -1 */
+static void
+epoll_count_events(struct evepoll *evep, struct event *ev, int delta)
+{
+	if (ev->ev_events & EV_READ)
+		evep->nread += delta;
+	if (ev->ev_events & EV_WRITE)
+		evep->nwrite += delta;
+	if (ev->ev_events & EV_CLOSED)
+		evep->nclosed += delta;
+	if (EPOLL_IS_ET(ev))
+		evep->net += delta;
+	if (EPOLL_IS_EXCLUSIVE(ev))
+		evep->nexclusive += delta;
+}
+
 static int
 epoll_add(void *arg, struct event *ev)
 {
 	struct epollop *epollop = arg;
-	struct epoll_event epev = {0, {0}};
 	struct evepoll *evep;
-	int fd, op, events;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
 		return (evsignal_add(ev));
 
     // 监听事件的文件描述符
 	fd = ev->ev_fd;
-    // 如果文件描述符大于当前的就扩容这个数组
-	if (fd >= epollop->nfds) {
-		/* Extent the file descriptor array as necessary */
-		if (epoll_recalc(ev->ev_base, epollop, fd) == -1)
-			return (-1);
-	}
-    // 获取这个文件描述上读写描述文件
-	evep = &epollop->fds[fd];
-    // 默认为添加事件类型
-	op = EPOLL_CTL_ADD;
-	events = 0;
-    // 如果这个文件描述符已经有注册过的事件，将操作更新为修改
-	if (evep->evread != NULL) {
-		events |= EPOLLIN;
-		op = EPOLL_CTL_MOD;
+    // 获取这个文件描述上的事件，需要时分配所在的页
+	if ((evep = epoll_fd_get(epollop, fd)) == NULL)
+		return (-1);
+
+	/* the kernel triggers an fd either by edge or by level */
+	if (!TAILQ_EMPTY(&evep->events) &&
+	    (evep->net != 0) != EPOLL_IS_ET(ev)) {
+		event_warnx("%s: cannot mix edge- and level-triggered "
+		    "events on fd %d", __func__, fd);
+		return (-1);
 	}
-	if (evep->evwrite != NULL) {
-		events |= EPOLLOUT;
-		op = EPOLL_CTL_MOD;
+	/* nor be exclusive for some events only, and exclusive
+	 * registrations cannot ask for EPOLLRDHUP */
+	if ((!TAILQ_EMPTY(&evep->events) &&
+		(evep->nexclusive != 0) != EPOLL_IS_EXCLUSIVE(ev)) ||
+	    (EPOLL_IS_EXCLUSIVE(ev) && (ev->ev_events & EV_CLOSED))) {
+		event_warnx("%s: cannot mix exclusive and shared events, "
+		    "or EV_EXCLUSIVE and EV_CLOSED, on fd %d", __func__, fd);
+		return (-1);
 	}
-    // 将传入事件更新
-	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
 
-	epev.data.fd = fd;
-	epev.events = events;
-	if (epoll_ctl(epollop->epfd, op, ev->ev_fd, &epev) == -1)
+	if (epollop->oneshot) {
+		TAILQ_INSERT_TAIL(&evep->events, ev, ev_io_next);
+		epoll_count_events(evep, ev, 1);
+		if (epoll_apply(epollop, fd) == -1) {
+			TAILQ_REMOVE(&evep->events, ev, ev_io_next);
+			epoll_count_events(evep, ev, -1);
 			return (-1);
+		}
+		return (0);
+	}
 
-	/* Update events responsible */
-    /* 更新这个文件描述符的上的事件 */
-	if (ev->ev_events & EV_READ)
-		evep->evread = ev;
-	if (ev->ev_events & EV_WRITE)
-		evep->evwrite = ev;
+	/* the kernel learns about it before the next epoll_wait() */
+	if (epoll_queue_change(epollop, fd) == -1)
+		return (-1);
+
+    /* 把事件加入这个文件描述符的事件链表 */
+	TAILQ_INSERT_TAIL(&evep->events, ev, ev_io_next);
+	epoll_count_events(evep, ev, 1);
 
 	return (0);
 }
@@ -321,51 +838,25 @@ static int
 epoll_del(void *arg, struct event *ev)
 {
 	struct epollop *epollop = arg;
-	struct epoll_event epev = {0, {0}};
 	struct evepoll *evep;
-	int fd, events, op;
-	int needwritedelete = 1, needreaddelete = 1;
+	int fd;
 
 	if (ev->ev_events & EV_SIGNAL)
 		return (evsignal_del(ev));
 
 	fd = ev->ev_fd;
-	if (fd >= epollop->nfds)
+	if ((evep = epoll_fd_lookup(epollop, fd)) == NULL)
 		return (0);
-	evep = &epollop->fds[fd];
 
-	op = EPOLL_CTL_DEL;
-	events = 0;
+	TAILQ_REMOVE(&evep->events, ev, ev_io_next);
+	epoll_count_events(evep, ev, -1);
 
-	if (ev->ev_events & EV_READ)
-		events |= EPOLLIN;
-	if (ev->ev_events & EV_WRITE)
-		events |= EPOLLOUT;
+	if (epollop->oneshot)
+		return (epoll_apply(epollop, fd));
 
-	if ((events & (EPOLLIN|EPOLLOUT)) != (EPOLLIN|EPOLLOUT)) {
-		if ((events & EPOLLIN) && evep->evwrite != NULL) {
-			needwritedelete = 0;
-			events = EPOLLOUT;
-			op = EPOLL_CTL_MOD;
-		} else if ((events & EPOLLOUT) && evep->evread != NULL) {
-			needreaddelete = 0;
-			events = EPOLLIN;
-			op = EPOLL_CTL_MOD;
-		}
-	}
-
-	epev.events = events;
-	epev.data.fd = fd;
-
-	if (needreaddelete)
-		evep->evread = NULL;
-	if (needwritedelete)
-		evep->evwrite = NULL;
-
-	if (epoll_ctl(epollop->epfd, op, fd, &epev) == -1)
-		return (-1);
-
-	return (0);
+	if (TAILQ_EMPTY(&evep->events))
+		evep->dropped = 1;
+	return (epoll_queue_change(epollop, fd));
 }
 
 static void
@@ -374,12 +865,15 @@ epoll_dealloc(struct event_base *base, void *arg)
 	struct epollop *epollop = arg;
 
 	evsignal_dealloc(base);
-	if (epollop->fds)
-		free(epollop->fds);
+	epoll_fdmap_free(epollop);
 	if (epollop->events)
 		free(epollop->events);
+	if (epollop->changes)
+		free(epollop->changes);
 	if (epollop->epfd >= 0)
 		close(epollop->epfd);
+	if (epollop->timerfd >= 0)
+		close(epollop->timerfd);
 
 	memset(epollop, 0, sizeof(struct epollop));
 	free(epollop);
@@ -35,6 +35,10 @@
 #include <sys/time.h>
 #endif
 
+#ifdef HAVE_IO_URING_BUF_RING
+#include <sys/queue.h>
+#include <signal.h>
+#endif
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,11 +53,40 @@
 
 #include "evutil.h"
 #include "event.h"
+#ifdef HAVE_IO_URING_BUF_RING
+#include "event-internal.h"
+#endif
 
 /* prototypes */
 
 void bufferevent_read_pressure_cb(struct evbuffer *, size_t, size_t, void *);
 
+#ifdef HAVE_IO_URING_BUF_RING
+/*
+ * A completion mode bufferevent.  The recv stays posted while reading is
+ * enabled and appends what it gets to the input buffer; ev_read and
+ * ev_write carry no I/O events and only run the callbacks, either when a
+ * request completes or when its timeout expires.
+ */
+struct bufferevent_uring {
+	struct evuring_req rreq;
+	struct evuring_req wreq;
+	/* the data of the send in flight; it must not move */
+	struct evbuffer *sending;
+	/* set if the input got data since the read callback last ran */
+	int rgot;
+	/* EVBUFFER_EOF or EVBUFFER_ERROR once reading came to an end */
+	short rwhat;
+	int rerrno;
+	/* the result of the last send */
+	int wres;
+	/* bufferevent_free() waits for the kernel to drop the requests */
+	int freeing;
+};
+
+static void bufferevent_uring_start_read(struct bufferevent *);
+#endif
+
 static int
 bufferevent_add(struct event *ev, int timeout)
 {
@@ -84,6 +117,12 @@ bufferevent_read_pressure_cb(struct evbuffer *buf, size_t old, size_t now,
 	if (bufev->wm_read.high == 0 || now < bufev->wm_read.high) {
 		evbuffer_setcb(buf, NULL, NULL);
 
+#ifdef HAVE_IO_URING_BUF_RING
+		if (bufev->uring != NULL) {
+			bufferevent_uring_start_read(bufev);
+			return;
+		}
+#endif
 		if (bufev->enabled & EV_READ)
 			bufferevent_add(&bufev->ev_read, bufev->timeout_read);
 	}
@@ -219,6 +258,233 @@ bufferevent_writecb(int fd, short event, void *arg)
 	(*bufev->errorcb)(bufev, what, bufev->cbarg);
 }
 
+#ifdef HAVE_IO_URING_BUF_RING
+/* Releases the bufferevent once the kernel is done with its requests */
+static void
+bufferevent_uring_reap(struct bufferevent *bufev)
+{
+	struct bufferevent_uring *bu = bufev->uring;
+
+	if (bu->rreq.inflight || bu->wreq.inflight)
+		return;
+
+	evbuffer_free(bu->sending);
+	free(bu);
+
+	evbuffer_free(bufev->input);
+	evbuffer_free(bufev->output);
+	free(bufev);
+}
+
+/* The base went away with the request in flight */
+static void
+bufferevent_uring_dropcb(struct evuring_req *req)
+{
+	struct bufferevent *bufev = req->arg;
+
+	if (bufev->uring->freeing)
+		bufferevent_uring_reap(bufev);
+}
+
+/* Called inside dispatch; the read callback does the rest */
+static void
+bufferevent_uring_recvcb(struct evuring_req *req, int res, const char *data,
+    int more)
+{
+	struct bufferevent *bufev = req->arg;
+	struct bufferevent_uring *bu = bufev->uring;
+
+	if (bu->freeing) {
+		bufferevent_uring_reap(bufev);
+		return;
+	}
+
+	if (res > 0) {
+		if (evbuffer_add(bufev->input, data, res) == 0)
+			bu->rgot = 1;
+		else if (!bu->rwhat) {
+			bu->rwhat = EVBUFFER_ERROR;
+			bu->rerrno = ENOMEM;
+		}
+	} else if (res == 0) {
+		/* eof case */
+		bu->rwhat = EVBUFFER_EOF;
+	} else if (res != -ECANCELED && res != -ENOBUFS) {
+		/* error case; we post a new recv after running out of
+		 * buffers or after a cancel */
+		bu->rwhat = EVBUFFER_ERROR;
+		bu->rerrno = -res;
+	}
+
+	event_active(&bufev->ev_read, EV_READ, 1);
+}
+
+static void
+bufferevent_uring_sendcb(struct evuring_req *req, int res, const char *data,
+    int more)
+{
+	struct bufferevent *bufev = req->arg;
+	struct bufferevent_uring *bu = bufev->uring;
+
+	if (bu->freeing) {
+		bufferevent_uring_reap(bufev);
+		return;
+	}
+
+	bu->wres = res;
+	event_active(&bufev->ev_write, EV_WRITE, 1);
+}
+
+/* Posts a recv unless one is in flight or reading has to pause */
+static void
+bufferevent_uring_start_read(struct bufferevent *bufev)
+{
+	struct bufferevent_uring *bu = bufev->uring;
+
+	if (!(bufev->enabled & EV_READ) || bu->rwhat)
+		return;
+	if (bufev->wm_read.high != 0 &&
+	    EVBUFFER_LENGTH(bufev->input) >= bufev->wm_read.high)
+		return;
+
+	if (!bu->rreq.inflight &&
+	    evuring_recv(bufev->ev_base, &bu->rreq) == -1) {
+		bu->rwhat = EVBUFFER_ERROR;
+		bu->rerrno = EAGAIN;
+		event_active(&bufev->ev_read, EV_READ, 1);
+		return;
+	}
+	bufferevent_add(&bufev->ev_read, bufev->timeout_read);
+}
+
+/* Posts a send of the output buffer unless one is in flight */
+static int
+bufferevent_uring_start_write(struct bufferevent *bufev)
+{
+	struct bufferevent_uring *bu = bufev->uring;
+
+	if (bu->wreq.inflight || !(bufev->enabled & EV_WRITE))
+		return (0);
+
+	if (EVBUFFER_LENGTH(bu->sending) == 0) {
+		if (EVBUFFER_LENGTH(bufev->output) == 0)
+			return (0);
+		/* swaps the buffers if nothing is left from the last send */
+		if (evbuffer_add_buffer(bu->sending, bufev->output) == -1)
+			return (-1);
+	}
+
+	if (evuring_send(bufev->ev_base, &bu->wreq,
+		EVBUFFER_DATA(bu->sending), EVBUFFER_LENGTH(bu->sending)) == -1) {
+		errno = EAGAIN;
+		return (-1);
+	}
+	bufferevent_add(&bufev->ev_write, bufev->timeout_write);
+	return (0);
+}
+
+static void
+bufferevent_uring_readcb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_uring *bu = bufev->uring;
+	short what = EVBUFFER_READ;
+	int got = bu->rgot;
+	size_t len;
+
+	if (event == EV_TIMEOUT) {
+		what |= EVBUFFER_TIMEOUT;
+		goto error;
+	}
+
+	if (!(bufev->enabled & EV_READ))
+		return;
+	bu->rgot = 0;
+
+	if (got) {
+		/* See if this callbacks meets the water marks */
+		len = EVBUFFER_LENGTH(bufev->input);
+		if (bufev->wm_read.high != 0 && len >= bufev->wm_read.high) {
+			/* stop the recv; we post a new one once the
+			 * buffer was drained */
+			evuring_cancel(bufev->ev_base, &bu->rreq);
+			event_del(&bufev->ev_read);
+			evbuffer_setcb(bufev->input,
+			    bufferevent_read_pressure_cb, bufev);
+		} else
+			bufferevent_uring_start_read(bufev);
+
+		if (bufev->wm_read.low == 0 || len >= bufev->wm_read.low) {
+			/* report the end of the data in the next round */
+			if (bu->rwhat)
+				event_active(&bufev->ev_read, EV_READ, 1);
+			/* Invoke the user callback - must always be called
+			 * last */
+			if (bufev->readcb != NULL)
+				(*bufev->readcb)(bufev, bufev->cbarg);
+			return;
+		}
+	}
+
+	if (bu->rwhat) {
+		what |= bu->rwhat;
+		errno = bu->rerrno;
+		goto error;
+	}
+
+	bufferevent_uring_start_read(bufev);
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+
+static void
+bufferevent_uring_writecb(int fd, short event, void *arg)
+{
+	struct bufferevent *bufev = arg;
+	struct bufferevent_uring *bu = bufev->uring;
+	short what = EVBUFFER_WRITE;
+	int res = bu->wres;
+
+	if (event == EV_TIMEOUT) {
+		what |= EVBUFFER_TIMEOUT;
+		goto error;
+	}
+
+	bu->wres = 0;
+	if (res > 0) {
+		evbuffer_drain(bu->sending, res);
+	} else if (res < 0 && res != -EAGAIN && res != -EINTR &&
+	    res != -ECANCELED) {
+		/* error case */
+		errno = -res;
+		what |= EVBUFFER_ERROR;
+		goto error;
+	}
+
+	if (!(bufev->enabled & EV_WRITE))
+		return;
+	if (bufferevent_uring_start_write(bufev) == -1) {
+		what |= EVBUFFER_ERROR;
+		goto error;
+	}
+
+	/*
+	 * Invoke the user callback if our buffer is drained or below the
+	 * low watermark.
+	 */
+	if (bufev->writecb != NULL &&
+	    EVBUFFER_LENGTH(bufev->output) + EVBUFFER_LENGTH(bu->sending) <=
+	    bufev->wm_write.low)
+		(*bufev->writecb)(bufev, bufev->cbarg);
+	return;
+
+ error:
+	(*bufev->errorcb)(bufev, what, bufev->cbarg);
+}
+#endif
+
 /*
  * Create a new buffered event object.
  *
@@ -268,6 +534,57 @@ bufferevent_new(int fd, evbuffercb readcb, evbuffercb writecb,
 	return (bufev);
 }
 
+struct bufferevent *
+bufferevent_uring_new(struct event_base *base, int fd, evbuffercb readcb,
+    evbuffercb writecb, everrorcb errorcb, void *cbarg)
+{
+	struct bufferevent *bufev;
+#ifdef HAVE_IO_URING_BUF_RING
+	struct bufferevent_uring *bu;
+#endif
+
+	bufev = bufferevent_new(fd, readcb, writecb, errorcb, cbarg);
+	if (bufev == NULL)
+		return (NULL);
+	if (bufferevent_base_set(base, bufev) == -1) {
+		bufferevent_free(bufev);
+		return (NULL);
+	}
+
+#ifdef HAVE_IO_URING_BUF_RING
+	/* without io_uring we wait for readiness as usual */
+	if (!evuring_available(base))
+		return (bufev);
+
+	if ((bu = calloc(1, sizeof(struct bufferevent_uring))) == NULL) {
+		bufferevent_free(bufev);
+		return (NULL);
+	}
+	if ((bu->sending = evbuffer_new()) == NULL) {
+		free(bu);
+		bufferevent_free(bufev);
+		return (NULL);
+	}
+	bu->rreq.cb = bufferevent_uring_recvcb;
+	bu->rreq.drop = bufferevent_uring_dropcb;
+	bu->rreq.arg = bufev;
+	bu->rreq.fd = fd;
+	bu->wreq.cb = bufferevent_uring_sendcb;
+	bu->wreq.drop = bufferevent_uring_dropcb;
+	bu->wreq.arg = bufev;
+	bu->wreq.fd = fd;
+
+	/* the events only run the callbacks and time out */
+	event_set(&bufev->ev_read, fd, 0, bufferevent_uring_readcb, bufev);
+	event_set(&bufev->ev_write, fd, 0, bufferevent_uring_writecb, bufev);
+	event_base_set(base, &bufev->ev_read);
+	event_base_set(base, &bufev->ev_write);
+	bufev->uring = bu;
+#endif
+
+	return (bufev);
+}
+
 void
 bufferevent_setcb(struct bufferevent *bufev,
     evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg)
@@ -285,6 +602,22 @@ bufferevent_setfd(struct bufferevent *bufev, int fd)
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
 
+#ifdef HAVE_IO_URING_BUF_RING
+	if (bufev->uring != NULL) {
+		struct bufferevent_uring *bu = bufev->uring;
+
+		/* the requests on the old fd come back cancelled and the
+		 * callbacks post them again on the new one */
+		evuring_cancel(bufev->ev_base, &bu->rreq);
+		evuring_cancel(bufev->ev_base, &bu->wreq);
+		bu->rreq.fd = bu->wreq.fd = fd;
+		bufev->ev_read.ev_fd = bufev->ev_write.ev_fd = fd;
+		bufferevent_uring_start_read(bufev);
+		bufferevent_uring_start_write(bufev);
+		return;
+	}
+#endif
+
 	event_set(&bufev->ev_read, fd, EV_READ, bufferevent_readcb, bufev);
 	event_set(&bufev->ev_write, fd, EV_WRITE, bufferevent_writecb, bufev);
 	if (bufev->ev_base != NULL) {
@@ -314,6 +647,16 @@ bufferevent_free(struct bufferevent *bufev)
 	event_del(&bufev->ev_read);
 	event_del(&bufev->ev_write);
 
+#ifdef HAVE_IO_URING_BUF_RING
+	if (bufev->uring != NULL) {
+		bufev->uring->freeing = 1;
+		evuring_cancel(bufev->ev_base, &bufev->uring->rreq);
+		evuring_cancel(bufev->ev_base, &bufev->uring->wreq);
+		bufferevent_uring_reap(bufev);
+		return;
+	}
+#endif
+
 	evbuffer_free(bufev->input);
 	evbuffer_free(bufev->output);
 
@@ -336,6 +679,10 @@ bufferevent_write(struct bufferevent *bufev, const void *data, size_t size)
 		return (res);
 
 	/* If everything is okay, we need to schedule a write */
+#ifdef HAVE_IO_URING_BUF_RING
+	if (bufev->uring != NULL)
+		return (bufferevent_uring_start_write(bufev));
+#endif
 	if (size > 0 && (bufev->enabled & EV_WRITE))
 		bufferevent_add(&bufev->ev_write, bufev->timeout_write);
 
@@ -374,6 +721,28 @@ bufferevent_read(struct bufferevent *bufev, void *data, size_t size)
 int
 bufferevent_enable(struct bufferevent *bufev, short event)
 {
+#ifdef HAVE_IO_URING_BUF_RING
+	if (bufev->uring != NULL) {
+		struct bufferevent_uring *bu = bufev->uring;
+
+		bufev->enabled |= event;
+		if (event & EV_READ) {
+			/* data or an end that came in while disabled */
+			if (bu->rgot || bu->rwhat)
+				event_active(&bufev->ev_read, EV_READ, 1);
+			bufferevent_uring_start_read(bufev);
+		}
+		if (event & EV_WRITE) {
+			if (bufferevent_uring_start_write(bufev) == -1)
+				return (-1);
+			/* like a writable socket, run the write callback
+			 * if there is nothing to send */
+			if (!bu->wreq.inflight)
+				event_active(&bufev->ev_write, EV_WRITE, 1);
+		}
+		return (0);
+	}
+#endif
 	if (event & EV_READ) {
 		if (bufferevent_add(&bufev->ev_read, bufev->timeout_read) == -1)
 			return (-1);
@@ -390,6 +759,11 @@ bufferevent_enable(struct bufferevent *bufev, short event)
 int
 bufferevent_disable(struct bufferevent *bufev, short event)
 {
+#ifdef HAVE_IO_URING_BUF_RING
+	/* a send in flight goes on; we only stop posting new ones */
+	if (bufev->uring != NULL && (event & EV_READ))
+		evuring_cancel(bufev->ev_base, &bufev->uring->rreq);
+#endif
 	if (event & EV_READ) {
 		if (event_del(&bufev->ev_read) == -1)
 			return (-1);
@@ -413,6 +787,16 @@ bufferevent_settimeout(struct bufferevent *bufev,
 	bufev->timeout_read = timeout_read;
 	bufev->timeout_write = timeout_write;
 
+#ifdef HAVE_IO_URING_BUF_RING
+	if (bufev->uring != NULL) {
+		if (bufev->uring->rreq.inflight)
+			bufferevent_add(&bufev->ev_read, timeout_read);
+		if (bufev->uring->wreq.inflight)
+			bufferevent_add(&bufev->ev_write, timeout_write);
+		return;
+	}
+#endif
+
 	if (event_pending(&bufev->ev_read, EV_READ, NULL))
 		bufferevent_add(&bufev->ev_read, timeout_read);
 	if (event_pending(&bufev->ev_write, EV_WRITE, NULL))
@@ -447,6 +831,11 @@ bufferevent_base_set(struct event_base *base, struct bufferevent *bufev)
 {
 	int res;
 
+#ifdef HAVE_IO_URING_BUF_RING
+	/* the requests in flight belong to the ring of the old base */
+	if (bufev->uring != NULL && base != bufev->ev_base)
+		return (-1);
+#endif
 	bufev->ev_base = base;
 
 	res = event_base_set(base, &bufev->ev_read);
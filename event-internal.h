@@ -35,6 +35,7 @@ extern "C" {
 
 #include "config.h"
 #include "min_heap.h"
+#include "timer_wheel.h"
 #include "evsignal.h"
 
 /* eventop 是多种 IO 多路复用的一个句柄，在 eventop 中有
@@ -52,6 +53,46 @@ struct eventop {
 	void (*dealloc)(struct event_base *, void *);
 	/* set if we need to reinitialize the event base */
 	int need_reinit;
+	/* set if dispatch releases the base lock while it waits */
+	int thread_safe;
+	/* called once a claimed event of fd has run, for backends that
+	 * support EVENT_BASE_FLAG_MULTI_DISPATCH */
+	void (*release)(struct event_base *, void *, int);
+	/* EV_FEATURE_* flags of the backend */
+	int features;
+};
+
+/* set by the backend on events that a multi-dispatch wakeup activated */
+#define EVLIST_X_CLAIMED	0x1000
+/* set while an active event waits on a claim queue, not an active queue */
+#define EVLIST_X_CLAIMQ		0x2000
+
+/* EVENT_BASE_FLAG_MULTI_DISPATCH 时每个运行事件循环的线程有一个，
+** 该线程的唤醒认领的激活事件只放在它自己的队列里，只由它执行 */
+struct event_claimer {
+	unsigned long id;
+	/* the claimed events, ordered by priority */
+	struct event_list claimed;
+	TAILQ_ENTRY(event_claimer) next;
+};
+
+/* 所有超时时长相同的事件按到期顺序保存在同一个链表中，
+** 只有链表头部的事件需要通过 timeout_event 放入 timeheap */
+struct common_timeout_list {
+	/* events with this duration, ordered by expiry */
+	struct event_list events;
+	/* the duration, with the magic bits returned to the user */
+	struct timeval duration;
+	/* internal timer for the event at the head of the list */
+	struct event timeout_event;
+	struct event_base *base;
+};
+
+/* 通过 event_base_post 投递给事件循环的回调 */
+struct event_post {
+	struct event_post *next;
+	void (*cb)(void *);
+	void *arg;
 };
 
 struct event_base {
@@ -67,6 +108,10 @@ struct event_base {
 	int event_count;		/* counts number of total events */
     /* event base 上被激活的事件的数量 */
 	int event_count_active;	/* counts number of active events */
+    /* 其中在认领队列里的事件数，它们只能由认领的线程执行 */
+	int event_count_claimed;
+    /* 后端代替事件在等待的请求数，比如 io_uring 上的 recv，不为 0 时事件循环不退出 */
+	int virtual_event_count;
 
 	int event_gotterm;		/* Set to terminate loop */
 	int event_break;		/* Set to terminate loop immediately */
@@ -78,6 +123,28 @@ struct event_base {
 	struct event_list **activequeues;
     /* 事件可以设定的最大优先级 */
 	int nactivequeues;
+    /* 每个优先级占一位，对应的激活队列非空时置 1，用来快速找到最高优先级的激活队列 */
+	ev_uint64_t *activemap;
+    /* 正在运行事件循环的线程的认领队列；退出的线程没执行完的认领事件
+    ** 放进 orphans，由下一个醒来的线程接管 */
+	TAILQ_HEAD(event_claimerq, event_claimer) claimers;
+	struct event_list orphans;
+    /* 激活事件的调度策略 EVENT_PRIORITY_*，以及轮转调度时每个优先级的权重和欠额 */
+	int priority_policy;
+	int *priority_weights;
+	int *priority_deficits;
+    /* 每次循环最多执行的回调数和时长，超出后重新 poll，剩下的激活事件留到下一次循环 */
+	int max_dispatch_callbacks;
+	struct timeval max_dispatch_time;
+	int limit_callbacks_after_prio;
+    /* 阻塞之前最多忙轮询的微秒数，0 表示不忙轮询；EVENT_BUSY_POLL_* 标志和统计 */
+	int busy_poll_max;
+	int busy_poll_flags;
+	struct event_busy_poll_stats busy_poll;
+    /* 每次等待最多取回的事件数的上下限，0 表示用后端的默认值；后端更新的统计 */
+	int batch_min;
+	int batch_max;
+	struct event_batch_stats batch;
 
 	/* signal handling info */
 	struct evsignal_info sig;
@@ -86,9 +153,66 @@ struct event_base {
     /* 上一次进行事件循环的时间 */
 	struct timeval event_tv;
     /* 管理时间事件的小顶堆 */
-	struct min_heap timeheap;
+	struct min_dheap timeheap;
+    /* 如果设置了 EVENT_BASE_FLAG_TIMER_WHEEL，时间事件改由时间轮管理，timeheap 不再使用 */
+	struct timer_wheel *timewheel;
+
+    /* 通过 event_base_init_common_timeout 注册的相同超时时长的事件队列 */
+	struct common_timeout_list **common_timeout_queues;
+	int n_common_timeouts;
+	int n_common_timeouts_allocated;
+
+    /* 时间事件默认的 slack，单位为微秒 */
+	int timer_slack;
+    /* 创建时通过 event_config 设置的 EVENT_BASE_FLAG_* 标志 */
+	int flags;
+
+    /* 获取当前时间使用的时钟，EVENT_CLOCK_* 或用户提供的函数 */
+	int clock_source;
+	int (*clock_fn)(struct timeval *, void *);
+	void *clock_arg;
+    /* 时钟单调递增时不会回退，不需要 timeout_correct */
+	int clock_monotonic;
 
 	struct timeval tv_cache;
+
+    /* EVENT_BASE_FLAG_THREADSAFE 时保护整个 event base 的锁，否则为 NULL */
+	void *th_base_lock;
+    /* 正在运行事件循环的线程 */
+	unsigned long th_owner_id;
+	int running_loop;
+    /* 其他线程修改了 event base 后，通过 eventfd（或者 socketpair）唤醒事件循环，
+    ** 在事件循环处理通知之前，多次修改只需要写一次 */
+	int th_notify_fd[2];
+	struct event th_notify;
+	int is_notify_pending;
+    /* 其他线程投递的回调，是一个无锁的栈，事件循环每次迭代整个取走后按投递顺序执行，
+    ** 栈由空变为非空时投递者写一次 eventfd 唤醒事件循环 */
+	struct event_post *volatile posted;
+};
+
+/* 创建 event_base 时使用的配置 */
+struct event_config_entry {
+	TAILQ_ENTRY(event_config_entry) next;
+	const char *avoid_method;
+};
+
+struct event_config {
+	TAILQ_HEAD(event_configq, event_config_entry) entries;
+	int flags;
+	int timer_slack;
+	int clock_source;
+	int (*clock_fn)(struct timeval *, void *);
+	void *clock_arg;
+	int max_dispatch_callbacks;
+	struct timeval max_dispatch_time;
+	int limit_callbacks_after_prio;
+	int busy_poll_max;
+	int busy_poll_flags;
+	int batch_min;
+	int batch_max;
+	/* EV_FEATURE_* flags that the backend must have */
+	int require_features;
 };
 
 /* Internal use only: Functions that might be missing from <sys/queue.h> */
@@ -108,6 +232,40 @@ struct event_base {
 } while (0)
 #endif /* TAILQ_FOREACH */
 
+#ifdef HAVE_IO_URING
+/* in event.c; a request in flight keeps the loop running like an event */
+void event_base_add_virtual(struct event_base *);
+void event_base_del_virtual(struct event_base *);
+/* wakes up the loop if another thread runs it, e.g. to submit requests */
+void event_base_notify_loop(struct event_base *);
+#endif
+
+#ifdef HAVE_IO_URING_BUF_RING
+/*
+ * A recv or send that the io_uring backend completes for a completion
+ * mode bufferevent.  cb runs inside dispatch with the base locked and may
+ * only record the result and activate events.  more is set if the request
+ * stays in flight; data holds what a recv got and is only valid during
+ * the callback.  If the base is freed first, drop runs instead.
+ */
+struct evuring_req {
+	TAILQ_ENTRY(evuring_req) next;
+	void (*cb)(struct evuring_req *, int res, const char *data, int more);
+	void (*drop)(struct evuring_req *);
+	void *arg;
+	int fd;
+	int inflight;		/* the kernel still owns the request */
+	int multishot;
+};
+
+/* in iouring.c; the requests fail if the base does not use io_uring */
+int evuring_available(struct event_base *);
+int evuring_recv(struct event_base *, struct evuring_req *);
+int evuring_send(struct event_base *, struct evuring_req *,
+    const void *, size_t);
+void evuring_cancel(struct event_base *, struct evuring_req *);
+#endif
+
 int _evsignal_set_handler(struct event_base *base, int evsignal,
 			  void (*fn)(int));
 int _evsignal_restore_handler(struct event_base *base, int evsignal);
@@ -49,13 +49,25 @@
 #include <signal.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 #include <time.h>
 
 #include "event.h"
 #include "event-internal.h"
 #include "evutil.h"
+#include "evthread-internal.h"
 #include "log.h"
 
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #ifdef HAVE_EVENT_PORTS
 extern const struct eventop evportops;
 #endif
@@ -68,6 +80,9 @@ extern const struct eventop pollops;
 #ifdef HAVE_EPOLL
 extern const struct eventop epollops;
 #endif
+#ifdef HAVE_IO_URING
+extern const struct eventop iouringops;
+#endif
 #ifdef HAVE_WORKING_KQUEUE
 extern const struct eventop kqops;
 #endif
@@ -89,6 +104,9 @@ static const struct eventop *eventops[] = {
 #ifdef HAVE_EPOLL
 	&epollops,
 #endif
+#ifdef HAVE_IO_URING
+	&iouringops,
+#endif
 #ifdef HAVE_DEVPOLL
 	&devpollops,
 #endif
@@ -117,12 +135,51 @@ volatile sig_atomic_t event_gotsig;	/* Set in signal handler */
 static void	event_queue_insert(struct event_base *, struct event *, int);
 static void	event_queue_remove(struct event_base *, struct event *, int);
 static int	event_haveevents(struct event_base *);
-
-static void	event_process_active(struct event_base *);
+static void	event_active_link(struct event_base *, struct event *);
+static void	event_active_unlink(struct event_base *, struct event *);
+static void	event_claim_move(struct event_list *, struct event_list *);
+static int	event_have_active(struct event_base *,
+		    struct event_claimer *);
+
+static void	event_process_active(struct event_base *,
+		    struct event_claimer *);
+
+static int	event_add_internal(struct event *, const struct timeval *);
+static int	event_del_internal(struct event *);
+static void	event_active_internal(struct event *, int, short);
+static int	evthread_make_base_notifiable(struct event_base *);
+static void	evthread_notify_base(struct event_base *);
+static void	evthread_notify_write(struct event_base *);
+static int	event_base_run_posted(struct event_base *);
 
 static int	timeout_next(struct event_base *, struct timeval **);
 static void	timeout_process(struct event_base *);
 static void	timeout_correct(struct event_base *, struct timeval *);
+static struct event *timeout_any(struct event_base *);
+
+static int	is_common_timeout(const struct timeval *,
+		    const struct event_base *);
+static void	common_timeout_schedule(struct common_timeout_list *,
+		    struct event *);
+static void	insert_common_timeout_inorder(struct common_timeout_list *,
+		    struct event *);
+static int	timeout_is_periodic(const struct event *);
+static void	timeout_advance(struct event *, const struct timeval *);
+static ev_uint64_t timeout_key(struct event_base *, const struct event *);
+
+#ifdef HAVE_SETFD
+#define FD_CLOSEONEXEC(x) do { \
+        if (fcntl(x, F_SETFD, 1) == -1) \
+                event_warn("fcntl(%d, F_SETFD)", x); \
+} while (0)
+#else
+#define FD_CLOSEONEXEC(x)
+#endif
+
+/* base->activemap has one bit per priority, set while its queue is not empty */
+#define ACTIVEMAP_WORDS(n)	(((n) + 63) / 64)
+#define ACTIVEMAP_WORD(pri)	((pri) / 64)
+#define ACTIVEMAP_BIT(pri)	((ev_uint64_t)1 << ((pri) % 64))
 
 static void
 detect_monotonic(void)
@@ -135,19 +192,23 @@ detect_monotonic(void)
 #endif
 }
 
+/* Reads the clock of the base, bypassing the time cache */
 static int
-gettime(struct event_base *base, struct timeval *tp)
+clock_read(struct event_base *base, struct timeval *tp)
 {
-	if (base->tv_cache.tv_sec) {
-		*tp = base->tv_cache;
-		return (0);
-	}
+	if (base->clock_fn != NULL)
+		return (base->clock_fn(tp, base->clock_arg));
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
-	if (use_monotonic) {
+	if (base->clock_monotonic) {
 		struct timespec	ts;
+		clockid_t id = CLOCK_MONOTONIC;
 
-		if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+#ifdef CLOCK_MONOTONIC_COARSE
+		if (base->clock_source == EVENT_CLOCK_MONOTONIC_COARSE)
+			id = CLOCK_MONOTONIC_COARSE;
+#endif
+		if (clock_gettime(id, &ts) == -1)
 			return (-1);
 
 		tp->tv_sec = ts.tv_sec;
@@ -159,6 +220,17 @@ gettime(struct event_base *base, struct timeval *tp)
 	return (evutil_gettimeofday(tp, NULL));
 }
 
+static int
+gettime(struct event_base *base, struct timeval *tp)
+{
+	if (base->tv_cache.tv_sec) {
+		*tp = base->tv_cache;
+		return (0);
+	}
+
+	return (clock_read(base, tp));
+}
+
 /* 初始化 event base */
 struct event_base *
 event_init(void)
@@ -175,8 +247,231 @@ event_init(void)
 struct event_base *
 event_base_new(void)
 {
-	int i;
+	return (event_base_new_with_config(NULL));
+}
+
+struct event_config *
+event_config_new(void)
+{
+	struct event_config *cfg = calloc(1, sizeof(struct event_config));
+
+	if (cfg != NULL) {
+		TAILQ_INIT(&cfg->entries);
+		cfg->max_dispatch_callbacks = -1;
+	}
+	return (cfg);
+}
+
+void
+event_config_free(struct event_config *cfg)
+{
+	struct event_config_entry *entry;
+
+	if (cfg == NULL)
+		return;
+	while ((entry = TAILQ_FIRST(&cfg->entries)) != NULL) {
+		TAILQ_REMOVE(&cfg->entries, entry, next);
+		free((char *)entry->avoid_method);
+		free(entry);
+	}
+	free(cfg);
+}
+
+int
+event_config_avoid_method(struct event_config *cfg, const char *method)
+{
+	struct event_config_entry *entry;
+
+	if (cfg == NULL || method == NULL)
+		return (-1);
+	if ((entry = malloc(sizeof(*entry))) == NULL)
+		return (-1);
+	if ((entry->avoid_method = strdup(method)) == NULL) {
+		free(entry);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&cfg->entries, entry, next);
+	return (0);
+}
+
+static int
+event_config_is_avoided_method(const struct event_config *cfg,
+    const char *method)
+{
+	struct event_config_entry *entry;
+
+	if (cfg == NULL)
+		return (0);
+	TAILQ_FOREACH(entry, &cfg->entries, next) {
+		if (strcmp(entry->avoid_method, method) == 0)
+			return (1);
+	}
+	return (0);
+}
+
+int
+event_config_set_flag(struct event_config *cfg, int flag)
+{
+	int supported = EVENT_BASE_FLAG_TIMER_WHEEL|
+	    EVENT_BASE_FLAG_PRECISE_TIMER;
+
+#ifdef EVTHREAD_AVAILABLE
+	supported |= EVENT_BASE_FLAG_THREADSAFE|
+	    EVENT_BASE_FLAG_MULTI_DISPATCH;
+#endif
+	if (cfg == NULL || (flag & ~supported))
+		return (-1);
+	cfg->flags |= flag;
+	return (0);
+}
+
+int
+event_config_require_features(struct event_config *cfg, int features)
+{
+	if (cfg == NULL)
+		return (-1);
+	cfg->require_features = features;
+	return (0);
+}
+
+/* Converts a slack into microseconds; returns -1 if it does not fit */
+static int
+timeout_slack_usec(const struct timeval *slack)
+{
+	if (slack->tv_sec < 0 || slack->tv_usec < 0 ||
+	    slack->tv_usec >= 1000000 || slack->tv_sec >= INT_MAX / 1000000)
+		return (-1);
+	return ((int)slack->tv_sec * 1000000 + (int)slack->tv_usec);
+}
+
+int
+event_config_set_timer_slack(struct event_config *cfg,
+    const struct timeval *slack)
+{
+	int us = 0;
+
+	if (cfg == NULL)
+		return (-1);
+	if (slack != NULL && (us = timeout_slack_usec(slack)) == -1)
+		return (-1);
+	cfg->timer_slack = us;
+	return (0);
+}
+
+int
+event_config_set_clock(struct event_config *cfg, int clock)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clockid_t id;
+#endif
+
+	if (cfg == NULL)
+		return (-1);
+	switch (clock) {
+	case EVENT_CLOCK_DEFAULT:
+		break;
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	case EVENT_CLOCK_MONOTONIC:
+		id = CLOCK_MONOTONIC;
+		if (clock_gettime(id, &ts) == -1)
+			return (-1);
+		break;
+#ifdef CLOCK_MONOTONIC_COARSE
+	case EVENT_CLOCK_MONOTONIC_COARSE:
+		id = CLOCK_MONOTONIC_COARSE;
+		if (clock_gettime(id, &ts) == -1)
+			return (-1);
+		break;
+#endif
+#endif
+	default:
+		return (-1);
+	}
+	cfg->clock_source = clock;
+	cfg->clock_fn = NULL;
+	cfg->clock_arg = NULL;
+	return (0);
+}
+
+int
+event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority)
+{
+	if (cfg == NULL || min_priority < 0)
+		return (-1);
+	if (max_interval != NULL && (max_interval->tv_sec < 0 ||
+		max_interval->tv_usec < 0 || max_interval->tv_usec >= 1000000))
+		return (-1);
+
+	if (max_interval != NULL)
+		cfg->max_dispatch_time = *max_interval;
+	else
+		evutil_timerclear(&cfg->max_dispatch_time);
+	cfg->max_dispatch_callbacks = max_callbacks < 0 ? -1 :
+	    max_callbacks > 0 ? max_callbacks : 1;
+	cfg->limit_callbacks_after_prio = min_priority;
+	return (0);
+}
+
+int
+event_config_set_busy_poll(struct event_config *cfg,
+    const struct timeval *max_spin, int flags)
+{
+	if (cfg == NULL)
+		return (-1);
+	if (max_spin != NULL && (max_spin->tv_sec != 0 ||
+		max_spin->tv_usec < 0 || max_spin->tv_usec >= 1000000))
+		return (-1);
+
+	cfg->busy_poll_max = max_spin != NULL ? max_spin->tv_usec : 0;
+	cfg->busy_poll_flags = cfg->busy_poll_max ? flags : 0;
+	return (0);
+}
+
+int
+event_config_set_batch_size(struct event_config *cfg,
+    int min_events, int max_events)
+{
+	if (cfg == NULL || min_events < 1 || max_events < min_events ||
+	    max_events > EVENT_MAX_BATCH_SIZE)
+		return (-1);
+
+	cfg->batch_min = min_events;
+	cfg->batch_max = max_events;
+	return (0);
+}
+
+int
+event_config_set_clock_fn(struct event_config *cfg,
+    int (*fn)(struct timeval *, void *), void *arg)
+{
+	if (cfg == NULL)
+		return (-1);
+	cfg->clock_source = EVENT_CLOCK_DEFAULT;
+	cfg->clock_fn = fn;
+	cfg->clock_arg = fn != NULL ? arg : NULL;
+	return (0);
+}
+
+struct event_base *
+event_base_new_with_config(const struct event_config *cfg)
+{
+	int i, features = cfg != NULL ? cfg->require_features : 0;
 	struct event_base *base;
+
+	/* not having a feature is no reason to give up the process */
+	for (i = 0; eventops[i]; i++) {
+		if ((eventops[i]->features & features) == features &&
+		    !event_config_is_avoided_method(cfg, eventops[i]->name))
+			break;
+	}
+	if (eventops[i] == NULL) {
+		event_warnx("%s: no allowed event mechanism has features %x",
+		    __func__, features);
+		return (NULL);
+	}
+
     /* 堆上分配内存，calloc 与 malloc 相比会分配内存并初始化为 0 */
 	if ((base = calloc(1, sizeof(struct event_base))) == NULL)
 		event_err(1, "%s: calloc", __func__);
@@ -185,17 +480,63 @@ event_base_new(void)
 	event_gotsig = 0;
 
 	detect_monotonic();
+	if (cfg != NULL) {
+		base->flags = cfg->flags;
+		if (base->flags & EVENT_BASE_FLAG_MULTI_DISPATCH)
+			base->flags |= EVENT_BASE_FLAG_THREADSAFE;
+		base->timer_slack = cfg->timer_slack;
+		base->clock_source = cfg->clock_source;
+		base->clock_fn = cfg->clock_fn;
+		base->clock_arg = cfg->clock_arg;
+		base->max_dispatch_callbacks = cfg->max_dispatch_callbacks;
+		base->max_dispatch_time = cfg->max_dispatch_time;
+		base->limit_callbacks_after_prio =
+		    cfg->limit_callbacks_after_prio;
+		base->busy_poll_max = cfg->busy_poll_max;
+		base->busy_poll_flags = cfg->busy_poll_flags;
+		base->busy_poll.budget_usec = cfg->busy_poll_max;
+		base->batch_min = cfg->batch_min;
+		base->batch_max = cfg->batch_max;
+	} else
+		base->max_dispatch_callbacks = -1;
+	/* event_config_set_clock() made sure that the clock works */
+	base->clock_monotonic = base->clock_fn != NULL ||
+	    base->clock_source != EVENT_CLOCK_DEFAULT || use_monotonic;
 	gettime(base, &base->event_tv);
 	
     // 初始化最小堆
-	min_heap_ctor(&base->timeheap);
+	min_dheap_ctor(&base->timeheap);
+	if (cfg != NULL && (cfg->flags & EVENT_BASE_FLAG_TIMER_WHEEL)) {
+		base->timewheel = malloc(sizeof(struct timer_wheel));
+		if (base->timewheel == NULL)
+			event_err(1, "%s: malloc", __func__);
+		timer_wheel_ctor(base->timewheel,
+		    timer_wheel_tick(&base->event_tv));
+		base->timewheel->slack = base->timer_slack;
+	}
     // 初始化链表
 	TAILQ_INIT(&base->eventqueue);
+	TAILQ_INIT(&base->claimers);
+	TAILQ_INIT(&base->orphans);
 	base->sig.ev_signal_pair[0] = -1;
 	base->sig.ev_signal_pair[1] = -1;
 	
+	base->th_notify_fd[0] = -1;
+	base->th_notify_fd[1] = -1;
+	
 	base->evbase = NULL;
 	for (i = 0; eventops[i] && !base->evbase; i++) {
+		/* a thread-safe base must not hold its lock while it waits */
+		if ((base->flags & EVENT_BASE_FLAG_THREADSAFE) &&
+		    !eventops[i]->thread_safe)
+			continue;
+		if ((base->flags & EVENT_BASE_FLAG_MULTI_DISPATCH) &&
+		    eventops[i]->release == NULL)
+			continue;
+		if ((eventops[i]->features & features) != features)
+			continue;
+		if (event_config_is_avoided_method(cfg, eventops[i]->name))
+			continue;
 		base->evsel = eventops[i];
 
 		base->evbase = base->evsel->init(base);
@@ -211,6 +552,14 @@ event_base_new(void)
 	/* allocate a single active event queue */
 	event_base_priority_init(base, 1);
 
+	if (base->flags & EVENT_BASE_FLAG_THREADSAFE) {
+		if ((base->th_base_lock = EVTHREAD_ALLOC_LOCK()) == NULL)
+			event_err(1, "%s: could not allocate lock", __func__);
+		if (evthread_make_base_notifiable(base) == -1)
+			event_err(1, "%s: could not create notify fd",
+			    __func__);
+	}
+
 	return (base);
 }
 
@@ -236,10 +585,35 @@ event_base_free(struct event_base *base)
 		}
 		ev = next;
 	}
-	while ((ev = min_heap_top(&base->timeheap)) != NULL) {
+	while ((ev = timeout_any(base)) != NULL) {
 		event_del(ev);
 		++n_deleted;
 	}
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		event_del(&ctl->timeout_event); /* Internal; doesn't count */
+		while ((ev = TAILQ_FIRST(&ctl->events)) != NULL) {
+			event_del(ev);
+			++n_deleted;
+		}
+		free(ctl);
+	}
+	if (base->common_timeout_queues)
+		free(base->common_timeout_queues);
+
+	while (base->posted != NULL) {
+		struct event_post *post = base->posted;
+		base->posted = post->next;
+		free(post);
+	}
+
+	if (base->th_notify_fd[0] != -1) {
+		event_del(&base->th_notify); /* Internal; doesn't count */
+		EVUTIL_CLOSESOCKET(base->th_notify_fd[0]);
+		if (base->th_notify_fd[1] != -1)
+			EVUTIL_CLOSESOCKET(base->th_notify_fd[1]);
+	}
 
 	for (i = 0; i < base->nactivequeues; ++i) {
 		for (ev = TAILQ_FIRST(base->activequeues[i]); ev; ) {
@@ -251,6 +625,15 @@ event_base_free(struct event_base *base)
 			ev = next;
 		}
 	}
+	/* claimed events that no thread ran before the loops ended */
+	for (ev = TAILQ_FIRST(&base->orphans); ev; ) {
+		struct event *next = TAILQ_NEXT(ev, ev_active_next);
+		if (!(ev->ev_flags & EVLIST_INTERNAL)) {
+			event_del(ev);
+			++n_deleted;
+		}
+		ev = next;
+	}
 
 	if (n_deleted)
 		event_debug(("%s: %d events were still set in base",
@@ -262,15 +645,23 @@ event_base_free(struct event_base *base)
 	for (i = 0; i < base->nactivequeues; ++i)
 		assert(TAILQ_EMPTY(base->activequeues[i]));
 
-	assert(min_heap_empty(&base->timeheap));
-	min_heap_dtor(&base->timeheap);
+	assert(min_dheap_empty(&base->timeheap));
+	min_dheap_dtor(&base->timeheap);
+	if (base->timewheel != NULL) {
+		assert(timer_wheel_size(base->timewheel) == 0);
+		free(base->timewheel);
+	}
 
 	for (i = 0; i < base->nactivequeues; ++i)
 		free(base->activequeues[i]);
 	free(base->activequeues);
+	free(base->activemap);
+	free(base->priority_weights);
+	free(base->priority_deficits);
 
 	assert(TAILQ_EMPTY(&base->eventqueue));
 
+	EVTHREAD_FREE_LOCK(base->th_base_lock);
 	free(base);
 }
 
@@ -283,6 +674,8 @@ event_reinit(struct event_base *base)
 	int res = 0;
 	struct event *ev;
 
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+
 #if 0
 	/* Right now, reinit always takes effect, since even if the
 	   backend doesn't require it, the signal socketpair code does.
@@ -304,6 +697,19 @@ event_reinit(struct event_base *base)
 		base->sig.ev_signal_added = 0;
 	}
 
+	/* the child must not share the notify fd with its parent */
+	if (base->th_notify_fd[0] != -1) {
+		event_queue_remove(base, &base->th_notify, EVLIST_INSERTED);
+		if (base->th_notify.ev_flags & EVLIST_ACTIVE)
+			event_queue_remove(base, &base->th_notify,
+			    EVLIST_ACTIVE);
+		EVUTIL_CLOSESOCKET(base->th_notify_fd[0]);
+		if (base->th_notify_fd[1] != -1)
+			EVUTIL_CLOSESOCKET(base->th_notify_fd[1]);
+		base->th_notify_fd[0] = -1;
+		base->th_notify_fd[1] = -1;
+	}
+
 	if (base->evsel->dealloc != NULL)
 		base->evsel->dealloc(base, base->evbase);
 	evbase = base->evbase = evsel->init(base);
@@ -316,6 +722,11 @@ event_reinit(struct event_base *base)
 			res = -1;
 	}
 
+	if (base->th_base_lock != NULL &&
+	    evthread_make_base_notifiable(base) == -1)
+		res = -1;
+
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
 	return (res);
 }
 
@@ -341,6 +752,9 @@ event_base_priority_init(struct event_base *base, int npriorities)
 			free(base->activequeues[i]);
 		}
 		free(base->activequeues);
+		free(base->activemap);
+		free(base->priority_weights);
+		free(base->priority_deficits);
 	}
 
 	/* Allocate our priority queues */
@@ -357,46 +771,148 @@ event_base_priority_init(struct event_base *base, int npriorities)
 		TAILQ_INIT(base->activequeues[i]);
 	}
 
+	base->activemap = calloc(ACTIVEMAP_WORDS(base->nactivequeues),
+	    sizeof(ev_uint64_t));
+	if (base->activemap == NULL)
+		event_err(1, "%s: calloc", __func__);
+
+	base->priority_weights = calloc(npriorities, sizeof(int));
+	base->priority_deficits = calloc(npriorities, sizeof(int));
+	if (base->priority_weights == NULL || base->priority_deficits == NULL)
+		event_err(1, "%s: calloc", __func__);
+	for (i = 0; i < npriorities; ++i)
+		base->priority_weights[i] = npriorities - i;
+
+	return (0);
+}
+
+int
+event_base_priority_set_policy(struct event_base *base, int policy,
+    const int *weights)
+{
+	int i;
+
+	if (policy != EVENT_PRIORITY_STRICT && policy != EVENT_PRIORITY_DRR)
+		return (-1);
+	if (weights != NULL) {
+		for (i = 0; i < base->nactivequeues; ++i)
+			if (weights[i] <= 0)
+				return (-1);
+	}
+
+	base->priority_policy = policy;
+	for (i = 0; i < base->nactivequeues; ++i) {
+		base->priority_weights[i] = weights != NULL ?
+		    weights[i] : base->nactivequeues - i;
+		base->priority_deficits[i] = 0;
+	}
 	return (0);
 }
 
 int
 event_haveevents(struct event_base *base)
 {
-	return (base->event_count > 0);
+	return (base->event_count > 0 || base->virtual_event_count > 0);
+}
+
+void
+event_base_add_virtual(struct event_base *base)
+{
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	base->virtual_event_count++;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+void
+event_base_del_virtual(struct event_base *base)
+{
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	base->virtual_event_count--;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+void
+event_base_notify_loop(struct event_base *base)
+{
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+/* Returns the index of the lowest set bit of a non-zero word */
+static inline int
+activemap_ffs(ev_uint64_t x)
+{
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+	return (__builtin_ctzll(x));
+#else
+	int i = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		++i;
+	}
+	return (i);
+#endif
+}
+
+/* Returns the first priority from pri on that has active events, or -1 */
+static int
+activemap_next(struct event_base *base, int pri)
+{
+	int i = ACTIVEMAP_WORD(pri);
+	ev_uint64_t word;
+
+	if (pri >= base->nactivequeues)
+		return (-1);
+	word = base->activemap[i] & (~(ev_uint64_t)0 << (pri % 64));
+	for (;;) {
+		if (word)
+			return (i * 64 + activemap_ffs(word));
+		if (++i >= ACTIVEMAP_WORDS(base->nactivequeues))
+			return (-1);
+		word = base->activemap[i];
+	}
+}
+
+/* Tells whether the time limit of a loop iteration has passed */
+static int
+dispatch_expired(struct event_base *base, const struct timeval *endtime)
+{
+	struct timeval now;
+
+	return (clock_read(base, &now) == 0 &&
+	    evutil_timercmp(&now, endtime, >=));
 }
 
 /*
- * Active events are stored in priority queues.  Lower priorities are always
- * process before higher priorities.  Low priority events can starve high
- * priority ones.
+ * Runs the events of an active queue until it is empty, until at least max
+ * callbacks have run if max is not negative, or until endtime has passed
+ * if it is not NULL.  Returns the number of callbacks that ran, or -1 if
+ * the loop has to stop right away.
  */
-/* 激活事件存储在优先队列中，低 priority 的事件总是先于高 priorities 的事件被处理，因此高 priorities 的事件可能会被饿死*/
-static void
-event_process_active(struct event_base *base)
+static int
+event_process_queue(struct event_base *base, struct event_list *activeq,
+    int max, const struct timeval *endtime)
 {
 	struct event *ev;
-	struct event_list *activeq = NULL;
-	int i;
 	short ncalls;
-
-    /* 遍历优先队列，找到第一个不为空的激活事件队列 */
-	for (i = 0; i < base->nactivequeues; ++i) {
-		if (TAILQ_FIRST(base->activequeues[i]) != NULL) {
-			activeq = base->activequeues[i];
-			break;
-		}
-	}
-
-	assert(activeq != NULL);
+	int count = 0, claimed, fd;
 
     /* 遍历这个激活的事件队列 */
-	for (ev = TAILQ_FIRST(activeq); ev; ev = TAILQ_FIRST(activeq)) {
+	for (ev = TAILQ_FIRST(activeq); ev && (max < 0 || count < max);
+	     ev = TAILQ_FIRST(activeq)) {
+		/* the backend re-arms a claimed fd once the callback ran;
+		 * the callback may free ev, so keep the fd */
+		claimed = ev->ev_flags & EVLIST_X_CLAIMED;
+		ev->ev_flags &= ~EVLIST_X_CLAIMED;
+		fd = (int)ev->ev_fd;
+
         /* 如果是个持久事件，那么就从激活队列移除。否则从所有的队列中都移除 */
 		if (ev->ev_events & EV_PERSIST)
 			event_queue_remove(base, ev, EVLIST_ACTIVE);
 		else
-			event_del(ev);
+			event_del_internal(ev);
 		
 		/* Allows deletes to work */
         // ncalls 是 callback 被调用的次数
@@ -405,8 +921,116 @@ event_process_active(struct event_base *base)
 		while (ncalls) {
 			ncalls--;
 			ev->ev_ncalls = ncalls;
+			/* other threads may use the base while the
+			 * callback runs */
+			EVBASE_RELEASE_LOCK(base, th_base_lock);
 			(*ev->ev_callback)((int)ev->ev_fd, ev->ev_res, ev->ev_arg);
-			if (event_gotsig || base->event_break)
+			EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+			++count;
+			if (event_gotsig || base->event_break) {
+				if (claimed)
+					base->evsel->release(base,
+					    base->evbase, fd);
+				return (-1);
+			}
+		}
+		if (claimed)
+			base->evsel->release(base, base->evbase, fd);
+
+		if (endtime != NULL && dispatch_expired(base, endtime))
+			break;
+	}
+	return (count);
+}
+
+/*
+ * Active events are stored in priority queues.  Lower priorities are always
+ * process before higher priorities.  Low priority events can starve high
+ * priority ones, unless the base uses EVENT_PRIORITY_DRR.
+ *
+ * If the base limits the callbacks or the time per iteration, we stop once
+ * the limit is reached; event_base_loop() then polls without blocking and
+ * comes back for the events that are left.
+ *
+ * A thread of a multi-dispatch base first runs the events that its own
+ * wakeups claimed, by priority and within the limits; the claims of other
+ * threads are not ours to run.
+ */
+/* 激活事件存储在优先队列中，低 priority 的事件总是先于高 priorities 的事件被处理，因此高 priorities 的事件可能会被饿死*/
+static void
+event_process_active(struct event_base *base, struct event_claimer *claimer)
+{
+	struct event_list *activeq;
+	struct timeval endtime, *endtime_p = NULL;
+	int budget = base->max_dispatch_callbacks;
+	int pri, n, max, limited, *deficit = NULL;
+
+	if (evutil_timerisset(&base->max_dispatch_time) &&
+	    clock_read(base, &endtime) == 0) {
+		evutil_timeradd(&endtime, &base->max_dispatch_time, &endtime);
+		endtime_p = &endtime;
+	}
+
+	if (claimer != NULL && !TAILQ_EMPTY(&claimer->claimed)) {
+		n = event_process_queue(base, &claimer->claimed, budget,
+		    endtime_p);
+		if (n == -1)
+			return;
+		if (budget >= 0 && (budget -= n) <= 0)
+			return;
+		if (endtime_p != NULL && dispatch_expired(base, endtime_p))
+			return;
+	}
+
+    /* 通过位图找到第一个不为空的激活事件队列 */
+	pri = activemap_next(base, 0);
+
+	/*
+	 * Deficit round robin: every active priority earns its weight in
+	 * callbacks per round.  What it runs over is taken from its next
+	 * round; an empty queue has nothing to save up for.
+	 */
+	for (; pri >= 0; pri = activemap_next(base, pri + 1)) {
+		activeq = base->activequeues[pri];
+		limited = pri >= base->limit_callbacks_after_prio;
+
+		max = -1;
+		if (base->priority_policy == EVENT_PRIORITY_DRR) {
+			deficit = &base->priority_deficits[pri];
+			*deficit += base->priority_weights[pri];
+			if (*deficit <= 0)
+				continue;
+			max = *deficit;
+		}
+		if (limited && budget >= 0 && (max < 0 || budget < max))
+			max = budget;
+
+		n = event_process_queue(base, activeq, max,
+		    limited ? endtime_p : NULL);
+		if (n == -1) {
+			if (deficit != NULL)
+				*deficit = 0;
+			return;
+		}
+
+		if (deficit != NULL) {
+			*deficit -= n;
+			if (TAILQ_EMPTY(activeq))
+				*deficit = 0;
+			else if (*deficit > base->priority_weights[pri]) {
+				/* cut short by the iteration limits; do not
+				 * let the credit pile up */
+				*deficit = base->priority_weights[pri];
+			}
+		}
+
+		if (base->priority_policy == EVENT_PRIORITY_STRICT)
+			return;
+		if (limited) {
+			if (budget >= 0 && (budget -= n) <= 0)
+				return;
+			if (endtime_p != NULL &&
+			    dispatch_expired(base, endtime_p))
 				return;
 		}
 	}
@@ -435,6 +1059,50 @@ event_base_get_method(struct event_base *base)
 	return (base->evsel->name);
 }
 
+int
+event_base_get_features(struct event_base *base)
+{
+	assert(base);
+	return (base->evsel->features);
+}
+
+int
+event_base_get_busy_poll_stats(struct event_base *base,
+    struct event_busy_poll_stats *stats)
+{
+	if (base == NULL || stats == NULL || !base->busy_poll_max)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	*stats = base->busy_poll;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (0);
+}
+
+int
+event_base_get_batch_stats(struct event_base *base,
+    struct event_batch_stats *stats)
+{
+	if (base == NULL || stats == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	*stats = base->batch;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (0);
+}
+
+int
+event_base_gettime_cached(struct event_base *base, struct timeval *tv)
+{
+	if (base == NULL)
+		base = current_base;
+	if (base == NULL)
+		return (-1);
+	/* gettime() prefers tv_cache while the loop is running */
+	return (gettime(base, tv));
+}
+
 static void
 event_loopexit_cb(int fd, short what, void *arg)
 {
@@ -450,28 +1118,187 @@ event_loopexit(const struct timeval *tv)
 		    current_base, tv));
 }
 
-int
-event_base_loopexit(struct event_base *event_base, const struct timeval *tv)
+int
+event_base_loopexit(struct event_base *event_base, const struct timeval *tv)
+{
+	return (event_base_once(event_base, -1, EV_TIMEOUT, event_loopexit_cb,
+		    event_base, tv));
+}
+
+/* not thread safe */
+int
+event_loopbreak(void)
+{
+	return (event_base_loopbreak(current_base));
+}
+
+int
+event_base_loopbreak(struct event_base *event_base)
+{
+	if (event_base == NULL)
+		return (-1);
+
+	EVBASE_ACQUIRE_LOCK(event_base, th_base_lock);
+	event_base->event_break = 1;
+	if (EVBASE_NEED_NOTIFY(event_base))
+		evthread_notify_base(event_base);
+	EVBASE_RELEASE_LOCK(event_base, th_base_lock);
+	return (0);
+}
+
+/*
+ * Wakes up the thread that runs the loop of a thread-safe base.  Called
+ * with the lock held; until the loop has read the notification, further
+ * calls do not write again.
+ */
+static void
+evthread_notify_base(struct event_base *base)
+{
+	if (base->is_notify_pending)
+		return;
+	base->is_notify_pending = 1;
+	evthread_notify_write(base);
+}
+
+/* Makes the notify fd readable; safe without the lock */
+static void
+evthread_notify_write(struct event_base *base)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	if (base->th_notify_fd[1] == -1) {
+		ev_uint64_t msg = 1;
+		(void)write(base->th_notify_fd[0], &msg, sizeof(msg));
+		return;
+	}
+#endif
+	{
+		char buf[1] = { 0 };
+		(void)send(base->th_notify_fd[1], buf, 1, 0);
+	}
+}
+
+static void
+evthread_notify_drain(int fd, short what, void *arg)
+{
+	struct event_base *base = arg;
+	unsigned char buf[1024];
+
+#ifdef HAVE_SYS_EVENTFD_H
+	if (base->th_notify_fd[1] == -1) {
+		ev_uint64_t msg;
+		(void)read(fd, &msg, sizeof(msg));
+	} else
+#endif
+	while (recv(fd, (char *)buf, sizeof(buf), 0) > 0)
+		;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	base->is_notify_pending = 0;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+/*
+ * Sets up the internal event through which other threads wake up the
+ * loop: an eventfd where we have one, otherwise a socketpair.
+ */
+static int
+evthread_make_base_notifiable(struct event_base *base)
 {
-	return (event_base_once(event_base, -1, EV_TIMEOUT, event_loopexit_cb,
-		    event_base, tv));
+	int fd;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	if ((fd = eventfd(0, 0)) != -1) {
+		base->th_notify_fd[0] = fd;
+		base->th_notify_fd[1] = -1;
+	} else
+#endif
+	{
+		if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0,
+			base->th_notify_fd) == -1) {
+			event_warn("%s: socketpair", __func__);
+			return (-1);
+		}
+		evutil_make_socket_nonblocking(base->th_notify_fd[1]);
+		FD_CLOSEONEXEC(base->th_notify_fd[1]);
+	}
+	evutil_make_socket_nonblocking(base->th_notify_fd[0]);
+	FD_CLOSEONEXEC(base->th_notify_fd[0]);
+
+	base->is_notify_pending = 0;
+	event_set(&base->th_notify, base->th_notify_fd[0],
+	    EV_READ|EV_PERSIST, evthread_notify_drain, base);
+	event_base_set(base, &base->th_notify);
+	base->th_notify.ev_flags |= EVLIST_INTERNAL;
+	base->th_notify.ev_pri = 0;
+
+	return (event_add_internal(&base->th_notify, NULL));
 }
 
-/* not thread safe */
 int
-event_loopbreak(void)
+event_base_post(struct event_base *base, void (*callback)(void *), void *arg)
 {
-	return (event_base_loopbreak(current_base));
+#ifdef EVTHREAD_HAVE_ATOMICS
+	struct event_post *post, *head;
+
+	/* we need the notify fd to wake up the loop */
+	if (base == NULL || base->th_notify_fd[0] == -1)
+		return (-1);
+	if ((post = malloc(sizeof(struct event_post))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	post->cb = callback;
+	post->arg = arg;
+
+	do {
+		head = base->posted;
+		post->next = head;
+	} while (!EVTHREAD_ATOMIC_CAS_PTR(&base->posted, head, post));
+
+	/* the loop takes the whole queue at once, so only the first post
+	 * after that has to wake it up */
+	if (head == NULL)
+		evthread_notify_write(base);
+	return (0);
+#else
+	return (-1);
+#endif
 }
 
-int
-event_base_loopbreak(struct event_base *event_base)
+/*
+ * Runs the callbacks posted with event_base_post() so far, oldest first.
+ * Called with the lock held.  Returns the number of callbacks that ran.
+ */
+static int
+event_base_run_posted(struct event_base *base)
 {
-	if (event_base == NULL)
-		return (-1);
+#ifdef EVTHREAD_HAVE_ATOMICS
+	struct event_post *post, *next, *fifo = NULL;
+	int count = 0;
 
-	event_base->event_break = 1;
+	if (base->posted == NULL)
+		return (0);
+	post = EVTHREAD_ATOMIC_XCHG_PTR(&base->posted, NULL);
+
+	/* the queue is a stack; reverse it into posting order */
+	for (; post != NULL; post = next) {
+		next = post->next;
+		post->next = fifo;
+		fifo = post;
+	}
+
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	for (post = fifo; post != NULL; post = next) {
+		next = post->next;
+		(*post->cb)(post->arg);
+		free(post);
+		++count;
+	}
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	return (count);
+#else
 	return (0);
+#endif
 }
 
 
@@ -489,9 +1316,31 @@ event_base_loop(struct event_base *base, int flags)
 {
 	const struct eventop *evsel = base->evsel;
 	void *evbase = base->evbase;
+	struct event_claimer claimer, *claimerp = NULL;
 	struct timeval tv;
 	struct timeval *tv_p;
-	int res, done;
+	int res, done, posted, retval = 0;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+
+	/* only one thread may run the loop of a thread-safe base, unless
+	 * it was made for several */
+	if (base->th_base_lock != NULL && base->running_loop &&
+	    !(base->flags & EVENT_BASE_FLAG_MULTI_DISPATCH)) {
+		event_warnx("%s: reentrant invocation.  Only one "
+		    "event_base_loop can run on each event_base at once.",
+		    __func__);
+		EVBASE_RELEASE_LOCK(base, th_base_lock);
+		return (-1);
+	}
+	base->running_loop++;
+	base->th_owner_id = EVTHREAD_GET_ID();
+	if (base->flags & EVENT_BASE_FLAG_MULTI_DISPATCH) {
+		claimer.id = EVTHREAD_GET_ID();
+		TAILQ_INIT(&claimer.claimed);
+		TAILQ_INSERT_TAIL(&base->claimers, &claimer, next);
+		claimerp = &claimer;
+	}
 
 	/* clear time cache */
 	base->tv_cache.tv_sec = 0;
@@ -503,16 +1352,23 @@ event_base_loop(struct event_base *base, int flags)
 		/* Terminate the loop if we have been asked to */
         /* 调用 event_loopexit_cb 跳出循环，为什么搞了两个函数？ */
 		if (base->event_gotterm) {
-			base->event_gotterm = 0;
+			/* the last thread out resets the flag */
+			if (base->running_loop == 1)
+				base->event_gotterm = 0;
 			break;
 		}
 
         /* 调用 event_base_loopbreak 函数跳出循环 */
 		if (base->event_break) {
-			base->event_break = 0;
+			if (base->running_loop == 1)
+				base->event_break = 0;
 			break;
 		}
 
+		/* take over what a thread left behind when it stopped */
+		if (claimerp != NULL && !TAILQ_EMPTY(&base->orphans))
+			event_claim_move(&claimer.claimed, &base->orphans);
+
 		/* You cannot use this interface for multi-threaded apps */
 		while (event_gotsig) {
 			event_gotsig = 0;
@@ -520,7 +1376,8 @@ event_base_loop(struct event_base *base, int flags)
 				res = (*event_sigcb)();
 				if (res == -1) {
 					errno = EINTR;
-					return (-1);
+					retval = -1;
+					goto done;
 				}
 			}
 		}
@@ -530,7 +1387,8 @@ event_base_loop(struct event_base *base, int flags)
 
 		tv_p = &tv;
         /* 如果没有激活事件，且等待方式不是非阻塞，计算当前时间距离最小堆堆顶时间事件的时间差，作为阻塞的时间 */
-		if (!base->event_count_active && !(flags & EVLOOP_NONBLOCK)) {
+		if (!event_have_active(base, claimerp) &&
+		    base->posted == NULL && !(flags & EVLOOP_NONBLOCK)) {
 			timeout_next(base, &tv_p);
 		} else {
 			/* 
@@ -543,9 +1401,11 @@ event_base_loop(struct event_base *base, int flags)
 		
 		/* If we have no events, we just exit */
         /* 如果已经没有事件了，则退出循环 */
-		if (!event_haveevents(base)) {
+		if (!event_haveevents(base) &&
+		    !(flags & EVLOOP_NO_EXIT_ON_EMPTY)) {
 			event_debug(("%s: no events registered.", __func__));
-			return (1);
+			retval = 1;
+			goto done;
 		}
 
 		/* update last old time */
@@ -558,27 +1418,55 @@ event_base_loop(struct event_base *base, int flags)
         /* 调用 IO 多路复用函数等待事件就绪，就绪的信号事件和IO事件会被插入到激活链表中 */
 		res = evsel->dispatch(base, evbase, tv_p);
 
-		if (res == -1)
-			return (-1);
+		if (res == -1) {
+			retval = -1;
+			goto done;
+		}
         /* 写时间缓存 */
 		gettime(base, &base->tv_cache);
         /* 检查heap中的时间事件，将就绪的事件从heap中删除并插入到激活队列中 */
 		timeout_process(base);
+        /* 执行其他线程通过 event_base_post 投递的回调 */
+		posted = event_base_run_posted(base);
         /* 如果有激活的信号事件和IO时间，则处理 */
-		if (base->event_count_active) {
-			event_process_active(base);
-			if (!base->event_count_active && (flags & EVLOOP_ONCE))
+		if (event_have_active(base, claimerp)) {
+			event_process_active(base, claimerp);
+			/* callbacks may have taken a while; refresh the
+			 * cache so that timeout_next() does not wait too
+			 * long for the next deadline */
+			base->tv_cache.tv_sec = 0;
+			gettime(base, &base->tv_cache);
+			if (!event_have_active(base, claimerp) &&
+			    (flags & EVLOOP_ONCE))
 				done = 1;
-		} else if (flags & EVLOOP_NONBLOCK)
+		} else if ((flags & EVLOOP_NONBLOCK) ||
+		    (posted && (flags & EVLOOP_ONCE)))
             /* 如果采用非阻塞的方式 */
 			done = 1;
 	}
 
+	event_debug(("%s: asked to terminate loop.", __func__));
+
+done:
 	/* clear time cache */
 	base->tv_cache.tv_sec = 0;
+	/* the next thread that wakes up runs what we claimed and did not
+	 * run */
+	if (claimerp != NULL) {
+		TAILQ_REMOVE(&base->claimers, claimerp, next);
+		if (!TAILQ_EMPTY(&claimer.claimed)) {
+			event_claim_move(&base->orphans, &claimer.claimed);
+			if (base->running_loop > 1)
+				evthread_notify_write(base);
+		}
+	}
+	/* pass the stop on to a thread that still waits */
+	if (--base->running_loop > 0 &&
+	    (base->event_break || base->event_gotterm))
+		evthread_notify_write(base);
 
-	event_debug(("%s: asked to terminate loop.", __func__));
-	return (0);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (retval);
 }
 
 /* Sets up an event for processing once */
@@ -656,6 +1544,176 @@ event_base_once(struct event_base *base, int fd, short events,
 	return (0);
 }
 
+/*
+ * Common timeouts.  A common timeout is handed to the user as a timeval
+ * whose tv_usec carries a magic value and the index of its queue in the
+ * bits that a valid tv_usec never uses.
+ */
+#define MICROSECONDS_MASK	0x000fffff
+#define COMMON_TIMEOUT_IDX_MASK	0x0ff00000
+#define COMMON_TIMEOUT_IDX_SHIFT 20
+#define COMMON_TIMEOUT_MASK	0xf0000000
+#define COMMON_TIMEOUT_MAGIC	0x50000000
+#define MAX_COMMON_TIMEOUTS	256
+
+#define COMMON_TIMEOUT_IDX(tv) \
+	(((tv)->tv_usec & COMMON_TIMEOUT_IDX_MASK)>>COMMON_TIMEOUT_IDX_SHIFT)
+
+static int
+is_common_timeout(const struct timeval *tv, const struct event_base *base)
+{
+	int idx;
+
+	if ((tv->tv_usec & COMMON_TIMEOUT_MASK) != COMMON_TIMEOUT_MAGIC)
+		return (0);
+	idx = COMMON_TIMEOUT_IDX(tv);
+	return (idx < base->n_common_timeouts);
+}
+
+static inline struct common_timeout_list *
+get_common_timeout_list(struct event_base *base, const struct timeval *tv)
+{
+	return (base->common_timeout_queues[COMMON_TIMEOUT_IDX(tv)]);
+}
+
+/* Puts ev into its queue.  Events are nearly always added with the
+ * current time, so the right place is almost always the tail. */
+static void
+insert_common_timeout_inorder(struct common_timeout_list *ctl,
+    struct event *ev)
+{
+	struct event *e;
+
+	for (e = TAILQ_LAST(&ctl->events, event_list); e != NULL;
+	     e = TAILQ_PREV(e, event_list, ev_timeout_pos.ev_timeout_next)) {
+		/* the magic bits are the same for all events in a queue,
+		 * so we can compare the timevals directly */
+		if (evutil_timercmp(&ev->ev_timeout, &e->ev_timeout, >=)) {
+			TAILQ_INSERT_AFTER(&ctl->events, e, ev,
+			    ev_timeout_pos.ev_timeout_next);
+			return;
+		}
+	}
+	TAILQ_INSERT_HEAD(&ctl->events, ev, ev_timeout_pos.ev_timeout_next);
+}
+
+/* Arms the internal timer of the queue for the expiry of head */
+static void
+common_timeout_schedule(struct common_timeout_list *ctl, struct event *head)
+{
+	struct event_base *base = ctl->base;
+	struct event *tev = &ctl->timeout_event;
+
+	if (tev->ev_flags & EVLIST_TIMEOUT)
+		event_queue_remove(base, tev, EVLIST_TIMEOUT);
+	tev->ev_timeout = head->ev_timeout;
+	tev->ev_timeout.tv_usec &= MICROSECONDS_MASK;
+	tev->ev_slack = head->ev_slack;
+	event_queue_insert(base, tev, EVLIST_TIMEOUT);
+}
+
+/* Activates every expired event of the queue and rearms for the rest */
+static void
+common_timeout_callback(int fd, short what, void *arg)
+{
+	struct common_timeout_list *ctl = arg;
+	struct event_base *base = ctl->base;
+	struct timeval now;
+	struct event *ev;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	gettime(base, &now);
+	while ((ev = TAILQ_FIRST(&ctl->events)) != NULL) {
+		if (ev->ev_timeout.tv_sec > now.tv_sec ||
+		    (ev->ev_timeout.tv_sec == now.tv_sec &&
+		     (ev->ev_timeout.tv_usec & MICROSECONDS_MASK) >
+		     now.tv_usec))
+			break;
+		if (timeout_is_periodic(ev)) {
+			/* goes back to the tail of the queue */
+			event_queue_remove(base, ev, EVLIST_TIMEOUT);
+			timeout_advance(ev, &now);
+			event_queue_insert(base, ev, EVLIST_TIMEOUT);
+		} else {
+			event_del_internal(ev);
+		}
+		event_active_internal(ev, EV_TIMEOUT, 1);
+	}
+	if (ev != NULL)
+		common_timeout_schedule(ctl, ev);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+const struct timeval *
+event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration)
+{
+	int i;
+	struct timeval tv;
+	struct common_timeout_list *new_ctl;
+	const struct timeval *result = NULL;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (duration->tv_usec > 1000000) {
+		tv = *duration;
+		if (is_common_timeout(duration, base))
+			tv.tv_usec &= MICROSECONDS_MASK;
+		tv.tv_sec += tv.tv_usec / 1000000;
+		tv.tv_usec %= 1000000;
+		duration = &tv;
+	}
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		if (duration->tv_sec == ctl->duration.tv_sec &&
+		    duration->tv_usec ==
+		    (ctl->duration.tv_usec & MICROSECONDS_MASK)) {
+			result = &ctl->duration;
+			goto done;
+		}
+	}
+	if (base->n_common_timeouts == MAX_COMMON_TIMEOUTS) {
+		event_warnx("%s: Too many common timeouts already in use; "
+		    "we only support %d per event_base", __func__,
+		    MAX_COMMON_TIMEOUTS);
+		goto done;
+	}
+	if (base->n_common_timeouts_allocated == base->n_common_timeouts) {
+		int n = base->n_common_timeouts < 16 ? 16 :
+		    base->n_common_timeouts*2;
+		struct common_timeout_list **newqueues =
+		    realloc(base->common_timeout_queues,
+			n*sizeof(struct common_timeout_list *));
+		if (newqueues == NULL) {
+			event_warn("%s: realloc", __func__);
+			goto done;
+		}
+		base->n_common_timeouts_allocated = n;
+		base->common_timeout_queues = newqueues;
+	}
+	new_ctl = calloc(1, sizeof(struct common_timeout_list));
+	if (new_ctl == NULL) {
+		event_warn("%s: calloc", __func__);
+		goto done;
+	}
+	TAILQ_INIT(&new_ctl->events);
+	new_ctl->duration.tv_sec = duration->tv_sec;
+	new_ctl->duration.tv_usec = duration->tv_usec | COMMON_TIMEOUT_MAGIC |
+	    (base->n_common_timeouts << COMMON_TIMEOUT_IDX_SHIFT);
+	evtimer_set(&new_ctl->timeout_event, common_timeout_callback,
+	    new_ctl);
+	event_base_set(base, &new_ctl->timeout_event);
+	new_ctl->timeout_event.ev_flags |= EVLIST_INTERNAL;
+	new_ctl->timeout_event.ev_pri = 0;
+	new_ctl->base = base;
+	base->common_timeout_queues[base->n_common_timeouts++] = new_ctl;
+	result = &new_ctl->duration;
+
+done:
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (result);
+}
+
 /* 初始化一个 event 对象 */
 void
 event_set(struct event *ev, int fd, short events,
@@ -675,6 +1733,7 @@ event_set(struct event *ev, int fd, short events,
 	ev->ev_flags = EVLIST_INIT;
 	ev->ev_ncalls = 0;
 	ev->ev_pncalls = NULL;
+	ev->ev_slack = -1;
 
 	min_heap_elem_init(ev);
 
@@ -719,6 +1778,30 @@ event_priority_set(struct event *ev, int pri)
 	return (0);
 }
 
+int
+event_set_timer_slack(struct event *ev, const struct timeval *slack)
+{
+	int us = -1;
+
+	if (slack != NULL && (us = timeout_slack_usec(slack)) == -1)
+		return (-1);
+	if (ev->ev_base == NULL) {
+		ev->ev_slack = us;
+		return (0);
+	}
+
+	EVBASE_ACQUIRE_LOCK(ev->ev_base, th_base_lock);
+	/* the position of a pending timeout depends on its slack */
+	if (ev->ev_flags & EVLIST_TIMEOUT) {
+		event_queue_remove(ev->ev_base, ev, EVLIST_TIMEOUT);
+		ev->ev_slack = us;
+		event_queue_insert(ev->ev_base, ev, EVLIST_TIMEOUT);
+	} else
+		ev->ev_slack = us;
+	EVBASE_RELEASE_LOCK(ev->ev_base, th_base_lock);
+	return (0);
+}
+
 /*
  * Checks if a specific event is pending or scheduled.
  */
@@ -729,29 +1812,50 @@ event_pending(struct event *ev, short event, struct timeval *tv)
 	struct timeval	now, res;
 	int flags = 0;
 
+	if (ev->ev_base != NULL)
+		EVBASE_ACQUIRE_LOCK(ev->ev_base, th_base_lock);
+
 	if (ev->ev_flags & EVLIST_INSERTED)
-		flags |= (ev->ev_events & (EV_READ|EV_WRITE|EV_SIGNAL));
+		flags |= (ev->ev_events &
+		    (EV_READ|EV_WRITE|EV_CLOSED|EV_SIGNAL));
 	if (ev->ev_flags & EVLIST_ACTIVE)
 		flags |= ev->ev_res;
 	if (ev->ev_flags & EVLIST_TIMEOUT)
 		flags |= EV_TIMEOUT;
 
-	event &= (EV_TIMEOUT|EV_READ|EV_WRITE|EV_SIGNAL);
+	event &= (EV_TIMEOUT|EV_READ|EV_WRITE|EV_CLOSED|EV_SIGNAL);
 
 	/* See if there is a timeout that we should report */
 	if (tv != NULL && (flags & event & EV_TIMEOUT)) {
+		struct timeval tmp = ev->ev_timeout;
+		tmp.tv_usec &= MICROSECONDS_MASK;
 		gettime(ev->ev_base, &now);
-		evutil_timersub(&ev->ev_timeout, &now, &res);
+		evutil_timersub(&tmp, &now, &res);
 		/* correctly remap to real time */
 		evutil_gettimeofday(&now, NULL);
 		evutil_timeradd(&now, &res, tv);
 	}
 
+	if (ev->ev_base != NULL)
+		EVBASE_RELEASE_LOCK(ev->ev_base, th_base_lock);
 	return (flags & event);
 }
 
 int
 event_add(struct event *ev, const struct timeval *tv)
+{
+	struct event_base *base = ev->ev_base;
+	int res;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	res = event_add_internal(ev, tv);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (res);
+}
+
+/* Does the work of event_add(); the caller holds the lock of the base */
+static int
+event_add_internal(struct event *ev, const struct timeval *tv)
 {
     // 要注册的evbase
 	struct event_base *base = ev->ev_base;
@@ -775,15 +1879,30 @@ event_add(struct event *ev, const struct timeval *tv)
 	 * failure on any step, we should not change any state.
 	 */
     // 分配最小堆插入一个元素的内存，先分配内存是为了保证时间事件
-	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT)) {
-		if (min_heap_reserve(&base->timeheap,
-			1 + min_heap_size(&base->timeheap)) == -1)
+	if (tv != NULL && !(ev->ev_flags & EVLIST_TIMEOUT) &&
+	    base->timewheel == NULL) {
+		if (min_dheap_reserve(&base->timeheap,
+			1 + min_dheap_size(&base->timeheap)) == -1)
 			return (-1);  /* ENOMEM == errno */
 	}
 
     /* ev_events 监听的事件类型为读写或者信号 而且 该事件没有被注册过，也不在激活队列里 */
-	if ((ev->ev_events & (EV_READ|EV_WRITE|EV_SIGNAL)) &&
+	if ((ev->ev_events & (EV_READ|EV_WRITE|EV_CLOSED|EV_SIGNAL)) &&
 	    !(ev->ev_flags & (EVLIST_INSERTED|EVLIST_ACTIVE))) {
+		/* level-triggered emulation would defeat the purpose */
+		if ((ev->ev_events & EV_ET) &&
+		    !(evsel->features & EV_FEATURE_ET)) {
+			event_warnx("%s: %s does not support EV_ET",
+			    __func__, evsel->name);
+			return (-1);
+		}
+		/* and so would reading to find the end of the data */
+		if ((ev->ev_events & EV_CLOSED) &&
+		    !(evsel->features & EV_FEATURE_EARLY_CLOSE)) {
+			event_warnx("%s: %s does not support EV_CLOSED",
+			    __func__, evsel->name);
+			return (-1);
+		}
         /* 将事件注册到 IO 多路复用中 */
 		res = evsel->add(evbase, ev);
 		if (res != -1)
@@ -825,7 +1944,18 @@ event_add(struct event *ev, const struct timeval *tv)
         // 将base中的缓存时间赋值到now中
 		gettime(base, &now);
         // 计算超时时间
-		evutil_timeradd(&now, tv, &ev->ev_timeout);
+		if (is_common_timeout(tv, base)) {
+			/* keep the magic bits so that we know which
+			 * queue the event belongs to */
+			struct timeval tmp = *tv;
+			tmp.tv_usec &= MICROSECONDS_MASK;
+			evutil_timeradd(&now, &tmp, &ev->ev_timeout);
+			ev->ev_timeout.tv_usec |=
+			    (tv->tv_usec & ~MICROSECONDS_MASK);
+		} else {
+			evutil_timeradd(&now, tv, &ev->ev_timeout);
+		}
+		ev->ev_interval = *tv;
 
 		event_debug((
 			 "event_add: timeout in %ld seconds, call %p",
@@ -834,26 +1964,40 @@ event_add(struct event *ev, const struct timeval *tv)
 		event_queue_insert(base, ev, EVLIST_TIMEOUT);
 	}
 
+    /* 如果事件循环在其他线程中等待，唤醒它重新计算等待的事件和超时 */
+	if (res != -1 && EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+
 	return (res);
 }
 
 int
 event_del(struct event *ev)
 {
-	struct event_base *base;
-	const struct eventop *evsel;
-	void *evbase;
-
-	event_debug(("event_del: %p, callback %p",
-		 ev, ev->ev_callback));
+	struct event_base *base = ev->ev_base;
+	int res;
 
 	/* An event without a base has not been added */
-	if (ev->ev_base == NULL)
+	if (base == NULL)
 		return (-1);
 
-	base = ev->ev_base;
-	evsel = base->evsel;
-	evbase = base->evbase;
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	res = event_del_internal(ev);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (res);
+}
+
+/* Does the work of event_del(); the caller holds the lock of the base */
+static int
+event_del_internal(struct event *ev)
+{
+	struct event_base *base = ev->ev_base;
+	const struct eventop *evsel = base->evsel;
+	void *evbase = base->evbase;
+	int res = 0;
+
+	event_debug(("event_del: %p, callback %p",
+		 ev, ev->ev_callback));
 
 	assert(!(ev->ev_flags & ~EVLIST_ALL));
 
@@ -872,39 +2016,82 @@ event_del(struct event *ev)
 	if (ev->ev_flags & EVLIST_INSERTED) {
 		event_queue_remove(base, ev, EVLIST_INSERTED);
         /* 对于注册事件，需要从 IO 多路复用中删除 */
-		return (evsel->del(evbase, ev));
+		res = evsel->del(evbase, ev);
 	}
 
-	return (0);
+	if (res != -1 && EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
+
+	return (res);
 }
 
 void
 event_active(struct event *ev, int res, short ncalls)
 {
+	struct event_base *base = ev->ev_base;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	event_active_internal(ev, res, ncalls);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+
+/* Does the work of event_active(); the caller holds the lock of the base */
+static void
+event_active_internal(struct event *ev, int res, short ncalls)
+{
+	struct event_base *base = ev->ev_base;
+
 	/* We get different kinds of events, add them together */
 	if (ev->ev_flags & EVLIST_ACTIVE) {
 		ev->ev_res |= res;
+		/* claimed while it was already active, e.g. by its
+		 * timeout; from now on only the claiming thread runs it */
+		if ((ev->ev_flags & (EVLIST_X_CLAIMED|EVLIST_X_CLAIMQ)) ==
+		    EVLIST_X_CLAIMED) {
+			event_active_unlink(base, ev);
+			event_active_link(base, ev);
+		}
 		return;
 	}
 
 	ev->ev_res = res;
 	ev->ev_ncalls = ncalls;
 	ev->ev_pncalls = NULL;
-	event_queue_insert(ev->ev_base, ev, EVLIST_ACTIVE);
+	event_queue_insert(base, ev, EVLIST_ACTIVE);
+
+	if (EVBASE_NEED_NOTIFY(base))
+		evthread_notify_base(base);
 }
 
 static int
 timeout_next(struct event_base *base, struct timeval **tv_p)
 {
-	struct timeval now;
+	struct timeval now, next;
+	const struct timeval *next_p;
 	struct event *ev;
 	struct timeval *tv = *tv_p;
 
-    /* 取堆顶最小的时间，如果不存在返回NULL */
-	if ((ev = min_heap_top(&base->timeheap)) == NULL) {
-		/* if no time-based events are active wait for I/O */
-		*tv_p = NULL;
-		return (0);
+	if (base->timewheel != NULL) {
+		ev_uint64_t tick;
+
+		if (timer_wheel_next(base->timewheel, &tick) == -1) {
+			*tv_p = NULL;
+			return (0);
+		}
+		timer_wheel_tick_to_tv(tick, &next);
+		next_p = &next;
+	} else {
+	    /* 取堆顶最小的时间，如果不存在返回NULL */
+		if ((ev = min_dheap_top(&base->timeheap)) == NULL) {
+			/* if no time-based events are active wait for I/O */
+			*tv_p = NULL;
+			return (0);
+		}
+		/* the key already includes the slack of the event */
+		next.tv_sec = (long)(base->timeheap.p[0].key / 1000000000);
+		next.tv_usec =
+		    (long)(base->timeheap.p[0].key % 1000000000) / 1000;
+		next_p = &next;
 	}
 
     /* 获取当前时间 */
@@ -912,13 +2099,13 @@ timeout_next(struct event_base *base, struct timeval **tv_p)
 		return (-1);
 
     /* 如果当前时间已经大于最小时间，返回剩余时间差为 0 */
-	if (evutil_timercmp(&ev->ev_timeout, &now, <=)) {
+	if (evutil_timercmp(next_p, &now, <=)) {
 		evutil_timerclear(tv);
 		return (0);
 	}
 
     /* 否则计算距离下一次时间事件的最小时间差 */
-	evutil_timersub(&ev->ev_timeout, &now, tv);
+	evutil_timersub(next_p, &now, tv);
 
 	assert(tv->tv_sec >= 0);
 	assert(tv->tv_usec >= 0);
@@ -936,11 +2123,14 @@ timeout_next(struct event_base *base, struct timeval **tv_p)
 static void
 timeout_correct(struct event_base *base, struct timeval *tv)
 {
-	struct event **pev;
+	struct min_dheap_entry *pent;
+	ev_uint64_t off_key;
 	unsigned int size;
 	struct timeval off;
+	int i;
 
-	if (use_monotonic)
+	/* a monotonic clock never runs backwards */
+	if (base->clock_monotonic)
 		return;
 
 	/* Check if time is running backwards */
@@ -954,15 +2144,59 @@ timeout_correct(struct event_base *base, struct timeval *tv)
 		    __func__));
 	evutil_timersub(&base->event_tv, tv, &off);
 
+	/* Events on the common timeout queues are not in the heap */
+	for (i = 0; i < base->n_common_timeouts; ++i) {
+		struct common_timeout_list *ctl =
+		    base->common_timeout_queues[i];
+		struct event *ev;
+
+		TAILQ_FOREACH(ev, &ctl->events,
+		    ev_timeout_pos.ev_timeout_next) {
+			struct timeval *ev_tv = &ev->ev_timeout;
+			int bits = ev_tv->tv_usec & ~MICROSECONDS_MASK;
+
+			ev_tv->tv_usec &= MICROSECONDS_MASK;
+			evutil_timersub(ev_tv, &off, ev_tv);
+			ev_tv->tv_usec |= bits;
+		}
+	}
+
+	if (base->timewheel != NULL) {
+		/*
+		 * The position of an event in the wheel depends on its
+		 * timeout, so pull everything out and put it back in.
+		 */
+		struct timer_wheel *w = base->timewheel;
+		struct event_list tmp;
+		struct event *ev;
+
+		TAILQ_INIT(&tmp);
+		while ((ev = timer_wheel_any(w)) != NULL) {
+			timer_wheel_erase(w, ev);
+			TAILQ_INSERT_TAIL(&tmp, ev,
+			    ev_timeout_pos.ev_timeout_next);
+		}
+		w->cur = timer_wheel_tick(tv);
+		while ((ev = TAILQ_FIRST(&tmp)) != NULL) {
+			TAILQ_REMOVE(&tmp, ev, ev_timeout_pos.ev_timeout_next);
+			evutil_timersub(&ev->ev_timeout, &off, &ev->ev_timeout);
+			timer_wheel_insert(w, ev);
+		}
+		base->event_tv = *tv;
+		return;
+	}
+
 	/*
 	 * We can modify the key element of the node without destroying
 	 * the key, beause we apply it to all in the right order.
 	 */
-	pev = base->timeheap.p;
+	off_key = min_dheap_key(&off);
+	pent = base->timeheap.p;
 	size = base->timeheap.n;
-	for (; size-- > 0; ++pev) {
-		struct timeval *ev_tv = &(**pev).ev_timeout;
+	for (; size-- > 0; ++pent) {
+		struct timeval *ev_tv = &pent->e->ev_timeout;
 		evutil_timersub(ev_tv, &off, ev_tv);
+		pent->key -= off_key;
 	}
 	/* Now remember what the new time turned out to be. */
 	base->event_tv = *tv;
@@ -975,29 +2209,243 @@ timeout_process(struct event_base *base)
 	struct event *ev;
 
     /* 最小堆为空直接返回 */
-	if (min_heap_empty(&base->timeheap))
+	if (timeout_any(base) == NULL)
 		return;
 
     /* 获取当前时间 */
 	gettime(base, &now);
 
+	if (base->timewheel != NULL) {
+		struct event_list *slot;
+		ev_uint64_t tick;
+
+		/* only ticks that have completely passed are expired */
+		tick = (ev_uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+		while ((slot = timer_wheel_expire(base->timewheel, tick))) {
+			while ((ev = TAILQ_FIRST(slot)) != NULL) {
+				if (timeout_is_periodic(ev)) {
+					timer_wheel_erase(base->timewheel, ev);
+					timeout_advance(ev, &now);
+					timer_wheel_insert(base->timewheel, ev);
+				} else {
+					event_del_internal(ev);
+				}
+				event_active_internal(ev, EV_TIMEOUT, 1);
+			}
+		}
+		return;
+	}
+
+	/*
+	 * The heap is ordered by the latest time each event may fire.  We
+	 * stop at the first event that is not due yet, even if a later one
+	 * could run already; it will still run before its slack runs out.
+	 */
     /* 堆顶的值不为空就循环 */
-	while ((ev = min_heap_top(&base->timeheap))) {
+	while ((ev = min_dheap_top(&base->timeheap))) {
         /* 如果最小堆堆顶的时间都未到激活事件，则退出循环 */
 		if (evutil_timercmp(&ev->ev_timeout, &now, >))
 			break;
 
+		if (timeout_is_periodic(ev)) {
+			/* reschedule in place: the deadline only grows,
+			 * so this is a single sift-down from the top */
+			timeout_advance(ev, &now);
+			min_dheap_adjust(&base->timeheap, ev,
+			    timeout_key(base, ev));
+			event_active_internal(ev, EV_TIMEOUT, 1);
+			continue;
+		}
+
 		/* delete this event from the I/O queues */
         /* 从注册的时间事件队列中删除该事件 */
-		event_del(ev);
+		event_del_internal(ev);
 
 		event_debug(("timeout_process: call %p",
 			 ev->ev_callback));
         /* 加入到激活事件队列中 */
-		event_active(ev, EV_TIMEOUT, 1);
+		event_active_internal(ev, EV_TIMEOUT, 1);
+	}
+}
+
+/*
+ * Returns the heap key of ev: the latest time at which it may fire.  With
+ * a slack, the deadline plus the slack is rounded down to a multiple of
+ * the largest power of two not above the slack, so that timers with nearby
+ * deadlines get the same key and are handled in one wakeup.
+ */
+static ev_uint64_t
+timeout_key(struct event_base *base, const struct event *ev)
+{
+	ev_uint64_t key = min_dheap_key(&ev->ev_timeout);
+	ev_uint64_t slack, grain;
+	int us = ev->ev_slack >= 0 ? ev->ev_slack : base->timer_slack;
+
+	if (us <= 0)
+		return (key);
+	slack = grain = (ev_uint64_t)us * 1000;
+	while (grain & (grain - 1))
+		grain &= grain - 1;
+	return ((key + slack) / grain * grain);
+}
+
+/* Periodic timers are pure timers with EV_PERSIST and a non-zero interval */
+static int
+timeout_is_periodic(const struct event *ev)
+{
+	return ((ev->ev_events & EV_PERSIST) &&
+	    !(ev->ev_events & (EV_READ|EV_WRITE|EV_CLOSED|EV_SIGNAL)) &&
+	    (ev->ev_interval.tv_sec ||
+	     (ev->ev_interval.tv_usec & MICROSECONDS_MASK)));
+}
+
+/*
+ * Moves the deadline of a periodic timer forward by its interval.  The new
+ * deadline is computed from the previous one, not from the current time,
+ * so that the timer stays aligned.  If we fell behind by more than one
+ * interval, whole intervals are skipped until the deadline is in the future.
+ */
+static void
+timeout_advance(struct event *ev, const struct timeval *now)
+{
+	struct timeval interval = ev->ev_interval;
+	struct timeval *deadline = &ev->ev_timeout;
+	int bits = deadline->tv_usec & ~MICROSECONDS_MASK;
+
+	interval.tv_usec &= MICROSECONDS_MASK;
+	deadline->tv_usec &= MICROSECONDS_MASK;
+	evutil_timeradd(deadline, &interval, deadline);
+	if (evutil_timercmp(deadline, now, <=)) {
+		struct timeval behind;
+		ev_uint64_t usec, n;
+
+		evutil_timersub(now, deadline, &behind);
+		usec = (ev_uint64_t)interval.tv_sec * 1000000 +
+		    interval.tv_usec;
+		n = ((ev_uint64_t)behind.tv_sec * 1000000 +
+		    behind.tv_usec) / usec + 1;
+		usec *= n;
+		interval.tv_sec = (long)(usec / 1000000);
+		interval.tv_usec = (long)(usec % 1000000);
+		evutil_timeradd(deadline, &interval, deadline);
+	}
+	deadline->tv_usec |= bits;
+}
+
+/* Returns any event that has a pending timeout, or NULL if there is none */
+static struct event *
+timeout_any(struct event_base *base)
+{
+	if (base->timewheel != NULL)
+		return (timer_wheel_any(base->timewheel));
+	return (min_dheap_top(&base->timeheap));
+}
+
+/*
+ * With EVENT_BASE_FLAG_MULTI_DISPATCH, the events that a wakeup claimed
+ * wait on the claim queue of the thread that got the wakeup, so that the
+ * callbacks of one ready fd never run in two threads at once.
+ */
+
+/* The claim queue of the calling thread, or the orphans if it does not
+ * run the loop */
+static struct event_list *
+event_claim_queue(struct event_base *base)
+{
+	struct event_claimer *claimer;
+	unsigned long id = EVTHREAD_GET_ID();
+
+	TAILQ_FOREACH(claimer, &base->claimers, next) {
+		if (claimer->id == id)
+			return (&claimer->claimed);
+	}
+	return (&base->orphans);
+}
+
+/* The claim queue that holds ev; a wakeup only claims a few events */
+static struct event_list *
+event_claim_queue_of(struct event_base *base, struct event *ev)
+{
+	struct event_claimer *claimer;
+	struct event *tmp;
+
+	TAILQ_FOREACH(claimer, &base->claimers, next) {
+		TAILQ_FOREACH(tmp, &claimer->claimed, ev_active_next) {
+			if (tmp == ev)
+				return (&claimer->claimed);
+		}
+	}
+	return (&base->orphans);
+}
+
+/* Puts ev behind the events of its priority on a claim queue */
+static void
+event_claim_insert(struct event_list *claimed, struct event *ev)
+{
+	struct event *next;
+
+	TAILQ_FOREACH(next, claimed, ev_active_next) {
+		if (next->ev_pri > ev->ev_pri)
+			break;
+	}
+	if (next != NULL)
+		TAILQ_INSERT_BEFORE(next, ev, ev_active_next);
+	else
+		TAILQ_INSERT_TAIL(claimed, ev, ev_active_next);
+}
+
+/* Links an active event into the queue it runs from */
+static void
+event_active_link(struct event_base *base, struct event *ev)
+{
+	if (ev->ev_flags & EVLIST_X_CLAIMED) {
+		ev->ev_flags |= EVLIST_X_CLAIMQ;
+		base->event_count_claimed++;
+		event_claim_insert(event_claim_queue(base), ev);
+		return;
+	}
+	TAILQ_INSERT_TAIL(base->activequeues[ev->ev_pri], ev, ev_active_next);
+	base->activemap[ACTIVEMAP_WORD(ev->ev_pri)] |=
+	    ACTIVEMAP_BIT(ev->ev_pri);
+}
+
+static void
+event_active_unlink(struct event_base *base, struct event *ev)
+{
+	if (ev->ev_flags & EVLIST_X_CLAIMQ) {
+		ev->ev_flags &= ~EVLIST_X_CLAIMQ;
+		base->event_count_claimed--;
+		TAILQ_REMOVE(event_claim_queue_of(base, ev), ev,
+		    ev_active_next);
+		return;
+	}
+	TAILQ_REMOVE(base->activequeues[ev->ev_pri], ev, ev_active_next);
+	if (TAILQ_EMPTY(base->activequeues[ev->ev_pri]))
+		base->activemap[ACTIVEMAP_WORD(ev->ev_pri)] &=
+		    ~ACTIVEMAP_BIT(ev->ev_pri);
+}
+
+/* Hands the claimed events of src over to dst */
+static void
+event_claim_move(struct event_list *dst, struct event_list *src)
+{
+	struct event *ev;
+
+	while ((ev = TAILQ_FIRST(src)) != NULL) {
+		TAILQ_REMOVE(src, ev, ev_active_next);
+		event_claim_insert(dst, ev);
 	}
 }
 
+/* Tells whether the calling thread has active events that it may run */
+static int
+event_have_active(struct event_base *base, struct event_claimer *claimer)
+{
+	if (base->event_count_active > base->event_count_claimed)
+		return (1);
+	return (claimer != NULL && !TAILQ_EMPTY(&claimer->claimed));
+}
+
 void
 event_queue_remove(struct event_base *base, struct event *ev, int queue)
 {
@@ -1015,11 +2463,24 @@ event_queue_remove(struct event_base *base, struct event *ev, int queue)
 		break;
 	case EVLIST_ACTIVE:
 		base->event_count_active--;
-		TAILQ_REMOVE(base->activequeues[ev->ev_pri],
-		    ev, ev_active_next);
+		event_active_unlink(base, ev);
+		/* deleted before it ran; the backend can re-arm its fd */
+		if (ev->ev_flags & EVLIST_X_CLAIMED) {
+			ev->ev_flags &= ~EVLIST_X_CLAIMED;
+			base->evsel->release(base, base->evbase,
+			    (int)ev->ev_fd);
+		}
 		break;
 	case EVLIST_TIMEOUT:
-		min_heap_erase(&base->timeheap, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    get_common_timeout_list(base, &ev->ev_timeout);
+			TAILQ_REMOVE(&ctl->events, ev,
+			    ev_timeout_pos.ev_timeout_next);
+		} else if (base->timewheel != NULL)
+			timer_wheel_erase(base->timewheel, ev);
+		else
+			min_dheap_erase(&base->timeheap, ev);
 		break;
 	default:
 		event_errx(1, "%s: unknown queue %x", __func__, queue);
@@ -1055,12 +2516,21 @@ event_queue_insert(struct event_base *base, struct event *ev, int queue)
 	case EVLIST_ACTIVE:
         /* 加入到激活事件队列中 */
 		base->event_count_active++;
-		TAILQ_INSERT_TAIL(base->activequeues[ev->ev_pri],
-		    ev,ev_active_next);
+		event_active_link(base, ev);
 		break;
 	case EVLIST_TIMEOUT: {
         /* 定时时间通过最小堆来保存，将时间事件压入到最小堆中 */
-		min_heap_push(&base->timeheap, ev);
+		if (is_common_timeout(&ev->ev_timeout, base)) {
+			struct common_timeout_list *ctl =
+			    get_common_timeout_list(base, &ev->ev_timeout);
+			insert_common_timeout_inorder(ctl, ev);
+			if (ev == TAILQ_FIRST(&ctl->events))
+				common_timeout_schedule(ctl, ev);
+		} else if (base->timewheel != NULL)
+			timer_wheel_insert(base->timewheel, ev);
+		else
+			min_dheap_push(&base->timeheap, ev,
+			    timeout_key(base, ev));
 		break;
 	}
 	default:
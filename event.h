@@ -212,6 +212,12 @@ typedef unsigned short u_short;
 #define EV_SIGNAL	0x08
 // 标识是否为永久事件
 #define EV_PERSIST	0x10	/* Persistant event */
+// 边沿触发，只在状态变化时通知
+#define EV_ET		0x20	/* Edge-triggered; needs EV_FEATURE_ET */
+// 多个 event_base 监听同一个 fd 时，每次只唤醒其中一个
+#define EV_EXCLUSIVE	0x40	/* Wake one of the bases; see EV_FEATURE_EXCLUSIVE */
+// 对端关闭了连接，无需读完数据
+#define EV_CLOSED	0x80	/* Peer closed; needs EV_FEATURE_EARLY_CLOSE */
 
 /* Fix so that ppl dont have to run with <sys/queue.h> */
 #ifndef TAILQ_ENTRY
@@ -233,12 +239,18 @@ struct event {
     ** 另外，libevent 还用另一个链表来存储激活的事件，通过遍历激活的事件链表来分发任务
     ** ev_active_next 存储了该事件在激活事件链表中的位置
     ** 类似，ev_signal_next 就是该事件在信号事件链表中的位置
+    ** ev_io_next 是 IO 事件在后端为每个文件描述符维护的事件链表中的位置
     */
 	TAILQ_ENTRY (event) ev_next;
 	TAILQ_ENTRY (event) ev_active_next;
 	TAILQ_ENTRY (event) ev_signal_next;
-    /* libevent 用最小堆来管理超时时间，min_heap_idx 保存堆顶的 index */
-	unsigned int min_heap_idx;	/* for managing timeouts */
+	TAILQ_ENTRY (event) ev_io_next;
+    /* libevent 用最小堆来管理超时时间，min_heap_idx 保存该事件在堆中的 index
+    ** 如果 event_base 使用时间轮，则 ev_timeout_next 保存该事件在时间轮槽链表中的位置 */
+	union {
+		TAILQ_ENTRY (event) ev_timeout_next;
+		unsigned int min_heap_idx;
+	} ev_timeout_pos;		/* for managing timeouts */
 
     /* event_base 是整个事件循环的核心，每个 event 都处在一个 event_base 中，ev_base 保存这个结构体的指针 */
 	struct event_base *ev_base;
@@ -251,6 +263,10 @@ struct event {
 	short *ev_pncalls;	/* Allows deletes in callback */
     /* 事件超时的时间长度 */
 	struct timeval ev_timeout;
+    /* 调用 event_add 时传入的超时时长，周期定时器用它来计算下一次的超时时间 */
+	struct timeval ev_interval;
+    /* 允许超时回调推迟执行的微秒数，-1 表示使用 event_base 的默认值 */
+	int ev_slack;
     /* 优先级 */
 	int ev_pri;		/* smaller numbers are higher priority */
     /* 响应事件时调用的callback函数 */
@@ -301,6 +317,245 @@ TAILQ_HEAD (evkeyvalq, evkeyval);
  */
 struct event_base *event_base_new(void);
 
+/**
+  Flags that may be passed to event_config_set_flag()
+ */
+/*@{*/
+/** Store timeouts in a hierarchical timing wheel instead of a binary heap.
+    Adding and deleting a timeout becomes O(1); timeouts are rounded up to
+    the next millisecond. */
+#define EVENT_BASE_FLAG_TIMER_WHEEL	0x01
+/** Wait for timeouts with microsecond instead of millisecond precision,
+    at the cost of an extra system call per loop iteration.  With epoll
+    this arms a timerfd for the next timeout.  Setting the EVENT_PRECISE_TIMER
+    environment variable has the same effect. */
+#define EVENT_BASE_FLAG_PRECISE_TIMER	0x02
+/** Protect the base with a lock, so that other threads may call
+    event_add(), event_del(), event_active() and event_base_loopbreak() on
+    its events while the loop runs.  Such calls wake up the loop; wakeups
+    are coalesced, so many calls cost at most one write per iteration.
+    Only available with pthreads and with backends that can release the
+    lock while they wait (currently epoll).  Note that event_del() from
+    another thread does not wait for a callback of the event that is
+    running at the same time. */
+#define EVENT_BASE_FLAG_THREADSAFE	0x04
+/** Let several threads run event_base_loop() on the same base at once,
+    leader/follower style.  They all wait on one epoll set that holds its
+    fds with EPOLLONESHOT, so a ready fd wakes up a single thread.  That
+    thread alone runs the callbacks of the wakeup, one after the other, and
+    the fd is armed again once they have run; the callbacks of one ready fd
+    thus never run in two threads at once.  Timeouts and signals are
+    handled by whichever thread sees them first.  Implies
+    EVENT_BASE_FLAG_THREADSAFE and currently requires epoll. */
+#define EVENT_BASE_FLAG_MULTI_DISPATCH	0x08
+/*@}*/
+
+struct event_config;
+
+/**
+  Allocate a new event configuration object.
+
+  The configuration object can be used to change the behavior of an
+  event_base created with event_base_new_with_config().
+
+  @return a new configuration object, or NULL if an error occurred
+  @see event_config_free(), event_base_new_with_config()
+ */
+struct event_config *event_config_new(void);
+
+/**
+  Deallocate all memory associated with an event configuration object.
+
+  @param cfg the event configuration object to be freed
+ */
+void event_config_free(struct event_config *cfg);
+
+/**
+  Set one or more EVENT_BASE_FLAG_* options on an event configuration.
+
+  @param cfg the event configuration object
+  @param flag any combination of EVENT_BASE_FLAG_* values
+  @return 0 if successful, or -1 if an error occurred
+ */
+int event_config_set_flag(struct event_config *cfg, int flag);
+
+/**
+  Enter an event method that should be avoided into the configuration.
+
+  This can be used to avoid event mechanisms that do not support certain
+  file descriptor types, or to test a particular one.  It has the same
+  effect as setting the matching EVENT_NO* environment variable, but only
+  for bases created from this configuration.
+
+  @param cfg the event configuration object
+  @param method the name of the event method to avoid, e.g. "epoll"
+  @return 0 on success, -1 on failure
+ */
+int event_config_avoid_method(struct event_config *cfg, const char *method);
+
+/**
+  Require the kernel event notification mechanism to have some features.
+
+  event_base_new_with_config() skips mechanisms that lack any of them, and
+  returns NULL if none is left.
+
+  @param cfg the event configuration object
+  @param features any combination of EV_FEATURE_* values
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_get_features()
+ */
+int event_config_require_features(struct event_config *cfg, int features);
+
+/**
+  Set the default timer slack for an event configuration.
+
+  A timeout never fires before its deadline, but with a slack of s it may
+  fire up to s later.  Timeouts whose windows overlap are then handled in
+  a single wakeup of the event loop, which saves wakeups on bases with
+  many staggered timers.  Individual events can override the default with
+  event_set_timer_slack().  The default is no slack at all.
+
+  @param cfg the event configuration object
+  @param slack the default slack, or NULL for none
+  @return 0 if successful, or -1 if the slack is negative or too large
+  @see event_set_timer_slack()
+ */
+int event_config_set_timer_slack(struct event_config *cfg,
+    const struct timeval *slack);
+
+/**
+  Clock sources that may be passed to event_config_set_clock()
+ */
+/*@{*/
+/** CLOCK_MONOTONIC if the system has it, gettimeofday() otherwise. */
+#define EVENT_CLOCK_DEFAULT		0
+/** CLOCK_MONOTONIC. */
+#define EVENT_CLOCK_MONOTONIC		1
+/** CLOCK_MONOTONIC_COARSE: much cheaper to read, but only updated every
+    few milliseconds, so timeouts can fire that much later. */
+#define EVENT_CLOCK_MONOTONIC_COARSE	2
+/*@}*/
+
+/**
+  Choose the clock that an event_base uses to schedule timeouts.
+
+  @param cfg the event configuration object
+  @param clock one of the EVENT_CLOCK_* values
+  @return 0 if successful, or -1 if the clock is not available
+  @see event_config_set_clock_fn()
+ */
+int event_config_set_clock(struct event_config *cfg, int clock);
+
+/**
+  Make an event_base read the time from a user-supplied function.
+
+  The function stores the current time in its first argument and returns
+  0, or -1 on error.  It must never go backwards; the base does not check
+  for that.
+
+  @param cfg the event configuration object
+  @param fn the clock function, or NULL to go back to EVENT_CLOCK_DEFAULT
+  @param arg an argument to pass to fn
+  @return 0 if successful, or -1 if an error occurred
+  @see event_config_set_clock()
+ */
+int event_config_set_clock_fn(struct event_config *cfg,
+    int (*fn)(struct timeval *, void *), void *arg);
+
+/**
+  Limit the work that one iteration of the event loop does.
+
+  Normally the loop runs every active event of the chosen priorities
+  before it polls for I/O again, which can take a long time after a burst.
+  With these limits, an iteration stops running callbacks once it has run
+  max_callbacks of them or once max_interval has passed.  It then polls
+  for new events without blocking and handles expired timeouts.  The
+  remaining active events stay queued for the following iterations.
+
+  At least one callback runs per iteration.  Checking max_interval reads
+  the clock after each event.
+
+  @param cfg the event configuration object
+  @param max_interval the longest time to run callbacks, or NULL for no
+         limit
+  @param max_callbacks the most callbacks to run, or -1 for no limit
+  @param min_priority only priorities from min_priority on count against
+         the limits; events with a higher priority (a lower number) always
+         run.  Use 0 to limit every event.
+  @return 0 if successful, or -1 if an error occurred
+ */
+int event_config_set_max_dispatch_interval(struct event_config *cfg,
+    const struct timeval *max_interval, int max_callbacks, int min_priority);
+
+/**
+  Flags for event_config_set_busy_poll()
+ */
+/*@{*/
+/** Also set SO_BUSY_POLL on the sockets that the backend registers, so
+    that the kernel polls the device queue of the socket for data. */
+#define EVENT_BUSY_POLL_SOCKETS	0x01
+/*@}*/
+
+/**
+  Make an event_base poll for events in a busy loop before it sleeps.
+
+  Going to sleep in the kernel and waking up again can take longer than
+  handling the event that ended the sleep.  With busy polling, the base
+  polls for events without blocking until some arrive or until its spin
+  budget runs out, and only then blocks.  This burns CPU to cut latency;
+  use it only for bases that must react quickly.
+
+  The spin budget adapts to how long the base waited for events recently.
+  It stays below max_spin and drops to a small fraction of it when events
+  come too far apart for spinning to catch them.  Only the epoll backend
+  busy polls; other backends ignore the setting.
+
+  @param cfg the event configuration object
+  @param max_spin the longest time to spin in one iteration of the loop,
+         below one second, or NULL to block right away
+  @param flags any combination of EVENT_BUSY_POLL_* values
+  @return 0 if successful, or -1 if max_spin is out of range
+  @see event_base_get_busy_poll_stats()
+ */
+int event_config_set_busy_poll(struct event_config *cfg,
+    const struct timeval *max_spin, int flags);
+
+/**
+  Bound the number of events that an event_base fetches per wakeup.
+
+  The backend keeps an array for the events that one wait returns.  It
+  doubles the array when a wait fills it and halves it again once the
+  waits have used no more than a quarter of it for a while, but never
+  leaves [min_events, max_events].  A base with many busy connections
+  wants a large max_events so that it drains them in few waits; an idle
+  base gives its memory back.  The default is 32 to 4096.  Only the epoll
+  backend sizes its array this way.
+
+  @param cfg the event configuration object
+  @param min_events the smallest array, at least 1
+  @param max_events the largest array, between min_events and
+         EVENT_MAX_BATCH_SIZE
+  @return 0 if successful, or -1 if the bounds are out of range
+  @see event_base_get_batch_stats()
+ */
+int event_config_set_batch_size(struct event_config *cfg,
+    int min_events, int max_events);
+
+/** The largest max_events for event_config_set_batch_size() */
+#define EVENT_MAX_BATCH_SIZE	(1 << 20)
+
+/**
+  Initialize a new event base, taking the specified configuration into
+  account.
+
+  Like event_base_new(), this does not set the current_base global.
+
+  @param cfg the event configuration object, or NULL for the defaults
+  @return an initialized event_base
+  @see event_base_new(), event_config_new()
+ */
+struct event_base *event_base_new_with_config(const struct event_config *cfg);
+
 /**
   Initialize the event API.
 
@@ -352,6 +607,109 @@ int event_base_dispatch(struct event_base *);
  @return a string identifying the kernel event mechanism (kqueue, epoll, etc.)
  */
 const char *event_base_get_method(struct event_base *);
+
+
+/**
+  Features that the kernel event notification mechanism of a base may have
+ */
+/*@{*/
+/** Supports edge-triggered events with EV_ET */
+#define EV_FEATURE_ET		0x01
+/** Adding, deleting or activating an event takes O(1) time */
+#define EV_FEATURE_O1		0x02
+/** Reports with EV_CLOSED that the peer closed a connection, without
+    waking up for the data before it */
+#define EV_FEATURE_EARLY_CLOSE	0x08
+/** Honours EV_EXCLUSIVE: when several bases wait for the same fd, for
+    example a listening socket, an event wakes up only one of them instead
+    of all.  The woken base should handle everything that is ready, e.g.
+    accept until EAGAIN.  Without this feature, EV_EXCLUSIVE is ignored.
+    An exclusive event cannot use EV_CLOSED. */
+#define EV_FEATURE_EXCLUSIVE	0x10
+/*@}*/
+
+/**
+ Get the features of the kernel event notification mechanism of a base.
+
+ @param eb the event_base structure returned by event_base_new()
+ @return a combination of EV_FEATURE_* flags
+ */
+int event_base_get_features(struct event_base *);
+
+/**
+  What busy polling did on an event_base
+ */
+struct event_busy_poll_stats {
+	/** iterations of the loop that found events while spinning */
+	unsigned long spins;
+	/** iterations that spun for the whole budget and then blocked */
+	unsigned long blocks;
+	/** polls without a timeout that the spinning made */
+	unsigned long polls;
+	/** the spin budget for the next iteration, in microseconds */
+	long budget_usec;
+	/** the average wait for events, in microseconds */
+	long avg_wait_usec;
+};
+
+/**
+  Get the busy polling counters of an event_base.
+
+  @param base the event_base
+  @param stats filled in with the counters
+  @return 0 if successful, or -1 if the base does not busy poll
+  @see event_config_set_busy_poll()
+ */
+int event_base_get_busy_poll_stats(struct event_base *base,
+    struct event_busy_poll_stats *stats);
+
+/**
+  How many events an event_base fetched per wakeup
+ */
+struct event_batch_stats {
+	/** waits for events that the backend made */
+	unsigned long dispatches;
+	/** events that they returned in total */
+	unsigned long events;
+	/** events that the last wait returned */
+	int last;
+	/** the most events that a single wait returned */
+	int peak;
+	/** how many events the next wait can return */
+	int size;
+	/** times that the array grew and shrank */
+	unsigned long grows;
+	unsigned long shrinks;
+};
+
+/**
+  Get the batch counters of an event_base.
+
+  Backends other than epoll leave the counters at zero.
+
+  @param base the event_base
+  @param stats filled in with the counters
+  @return 0 if successful, or -1 on error
+  @see event_config_set_batch_size()
+ */
+int event_base_get_batch_stats(struct event_base *base,
+    struct event_batch_stats *stats);
+
+
+/**
+  Get the time at which the current iteration of the event loop started.
+
+  Callbacks that need the current time can use this instead of calling
+  gettimeofday() again and again.  The time is read from the clock of the
+  base, which is monotonic by default: it is good for measuring intervals,
+  not for telling the time of day.  Outside of the event loop the clock is
+  read directly.
+
+  @param base the event_base, or NULL for the current base
+  @param tv where to store the time
+  @return 0 if successful, or -1 if an error occurred
+ */
+int event_base_gettime_cached(struct event_base *base, struct timeval *tv);
         
         
 /**
@@ -393,6 +751,9 @@ int event_base_set(struct event_base *, struct event *);
 /*@{*/
 #define EVLOOP_ONCE	0x01	/**< Block at most once. */
 #define EVLOOP_NONBLOCK	0x02	/**< Do not block. */
+/** Keep running even if no events are registered, until
+    event_base_loopbreak() or event_base_loopexit() is called. */
+#define EVLOOP_NO_EXIT_ON_EMPTY	0x04
 /*@}*/
 
 /**
@@ -400,7 +761,8 @@ int event_base_set(struct event_base *, struct event *);
 
   This is a more flexible version of event_dispatch().
 
-  @param flags any combination of EVLOOP_ONCE | EVLOOP_NONBLOCK
+  @param flags any combination of EVLOOP_ONCE | EVLOOP_NONBLOCK |
+    EVLOOP_NO_EXIT_ON_EMPTY
   @return 0 if successful, -1 if an error occurred, or 1 if no events were
     registered.
   @see event_loopexit(), event_base_loop()
@@ -413,7 +775,8 @@ int event_loop(int);
   This is a more flexible version of event_base_dispatch().
 
   @param eb the event_base structure returned by event_init()
-  @param flags any combination of EVLOOP_ONCE | EVLOOP_NONBLOCK
+  @param flags any combination of EVLOOP_ONCE | EVLOOP_NONBLOCK |
+    EVLOOP_NO_EXIT_ON_EMPTY
   @return 0 if successful, -1 if an error occurred, or 1 if no events were
     registered.
   @see event_loopexit(), event_base_loop()
@@ -500,6 +863,18 @@ int event_base_loopbreak(struct event_base *);
  */
 #define evtimer_set(ev, cb, arg)	event_set(ev, -1, 0, cb, arg)
 
+/**
+  Define a periodic timer event.
+
+  Once added with event_add(), the callback is invoked every tv until
+  the event is removed with event_del().
+
+  @param ev event struct to be modified
+  @param cb callback function
+  @param arg argument that will be passed to the callback function
+ */
+#define evperiodic_set(ev, cb, arg)	event_set(ev, -1, EV_PERSIST, cb, arg)
+
 
 /**
  * Delete a timer event.
@@ -563,6 +938,12 @@ int event_base_loopbreak(struct event_base *);
   EV_READ, or EV_WRITE.  The additional flag EV_PERSIST makes an event_add()
   persistent until event_del() has been called.
 
+  A timer event (no EV_READ, EV_WRITE or EV_SIGNAL) with EV_PERSIST is
+  periodic: once it expires, it is rescheduled one interval after its
+  previous deadline rather than after the time its callback ran, so it does
+  not drift.  If the loop falls behind by several intervals, the missed
+  expirations are skipped.
+
   @param ev an event struct to be modified
   @param fd the file descriptor to be monitored
   @param event desired events to monitor; can be EV_READ and/or EV_WRITE
@@ -619,6 +1000,146 @@ int event_base_once(struct event_base *base, int fd, short events,
     const struct timeval *timeout);
 
 
+/**
+  Run a callback in the loop of an event base, from any thread.
+
+  The callback is queued without taking a lock.  The loop runs everything
+  that was posted once per iteration, in the order it was posted, after
+  the timeouts and before the active events.  Only the post that finds the
+  queue empty wakes up the loop.  Callbacks still queued when the base is
+  freed are dropped without being run.
+
+  @param base an event_base created with EVENT_BASE_FLAG_THREADSAFE
+  @param callback the function to run in the loop of the base
+  @param arg an argument to be passed to the callback function
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_once()
+ */
+int event_base_post(struct event_base *base, void (*callback)(void *),
+    void *arg);
+
+
+/**
+  @name Multi-loop runtime
+
+  A runtime runs one thread-safe event base per thread, with every thread
+  pinned to a CPU.  Set up each base, for example with
+  evhttp_new(event_runtime_get_base(rt, i)) and evhttp_accept_socket() on
+  event_runtime_get_socket(rt, i), then call event_runtime_start().  Once
+  the loops run, a base should only be used from callbacks of its own loop
+  or through event_base_post().
+ */
+/*@{*/
+struct event_runtime;
+
+/**
+  Create a runtime with nloops event bases.
+
+  @param nloops the number of loops, or 0 for one per online CPU
+  @param cfg the configuration of the bases, or NULL; the runtime adds
+         EVENT_BASE_FLAG_THREADSAFE
+  @return a new runtime, or NULL if an error occurred
+ */
+struct event_runtime *event_runtime_new(int nloops,
+    const struct event_config *cfg);
+
+/** Return the number of loops of a runtime. */
+int event_runtime_nloops(struct event_runtime *rt);
+
+/** Return the event base of loop i, or NULL if there is no such loop. */
+struct event_base *event_runtime_get_base(struct event_runtime *rt, int i);
+
+/**
+  Open a listening socket for every loop of a runtime.
+
+  All sockets are bound to the same address with SO_REUSEPORT, so that the
+  kernel spreads incoming connections over the loops and no accept queue is
+  shared.  Where SO_REUSEPORT is missing, all loops share one socket.  A
+  runtime can be bound once, before it is started.  The caller owns the
+  sockets: it closes them, or hands them to evhttp_accept_socket(), after
+  which evhttp_free() closes them.
+
+  @param rt the runtime
+  @param address the address to listen on, or NULL for any address
+  @param port the port to listen on; with 0, all loops use the same
+         ephemeral port
+  @return 0 on success, -1 on failure
+  @see event_runtime_get_socket()
+ */
+int event_runtime_bind_socket(struct event_runtime *rt, const char *address,
+    u_short port);
+
+/** Return the listening socket of loop i, or -1 if there is none. */
+int event_runtime_get_socket(struct event_runtime *rt, int i);
+
+/**
+  Start a thread for every loop of a runtime.
+
+  The loops keep running when they have no events, until
+  event_runtime_stop() is called.
+
+  @return 0 on success, -1 on failure
+ */
+int event_runtime_start(struct event_runtime *rt);
+
+struct sockaddr;
+
+/**
+  Set the function that takes over connections handed to a loop.
+
+  Once set, event_runtime_handoff() may pass connections to the loop of
+  base, where cb runs with the base, the socket and the peer address.  A
+  loop without a callback never receives connections.  Set the callbacks
+  before the runtime starts, or clear them after it stopped.
+
+  @param rt the runtime
+  @param base the event base of one of the loops of rt
+  @param cb the function that registers a connection with base, or NULL
+  @param arg an argument to be passed to cb
+  @return 0 on success, -1 if base is not part of rt
+ */
+int event_runtime_set_conncb(struct event_runtime *rt,
+    struct event_base *base,
+    void (*cb)(struct event_base *, int, struct sockaddr *, int, void *),
+    void *arg);
+
+/**
+  Hand a newly accepted connection to the least loaded loop of a runtime.
+
+  The load of a loop is the number of its registered and active events
+  plus the connections queued for it.  The connection goes into a
+  lock-free queue of the chosen loop, which runs its connection callback
+  on it.  If that loop is still busy with its earlier connections, an idle
+  loop is woken up to steal them.
+
+  @param rt the runtime
+  @param from the base that accepted the connection
+  @param fd the accepted socket
+  @param sa the address of the peer
+  @param salen the length of sa
+  @return 0 if another loop takes the connection, 1 if the loop of from
+          is the least loaded and should keep it, or -1 if an error
+          occurred
+  @see event_runtime_set_conncb()
+ */
+int event_runtime_handoff(struct event_runtime *rt, struct event_base *from,
+    int fd, const struct sockaddr *sa, int salen);
+
+/** Return the load of loop i, as used by event_runtime_handoff(). */
+int event_runtime_get_load(struct event_runtime *rt, int i);
+
+/** Break all loops of a runtime and wait for their threads to exit. */
+int event_runtime_stop(struct event_runtime *rt);
+
+/**
+  Stop a runtime and free its event bases.
+
+  Objects that use the bases, such as evhttp servers, must be freed first.
+ */
+void event_runtime_free(struct event_runtime *rt);
+/*@}*/
+
+
 /**
   Add an event to the set of monitored events.
 
@@ -656,6 +1177,27 @@ int event_del(struct event *);
 void event_active(struct event *, int, short);
 
 
+/**
+  Prepare an event_base to use a large number of timeouts with the same
+  duration.
+
+  Timeouts are normally kept in a binary heap, so adding or removing one
+  takes O(log n) time.  If many events share the same duration, they can
+  instead be kept in a FIFO queue that is already sorted, and only the
+  head of the queue has to be stored in the heap.
+
+  The returned timeval is a magic value that can be passed to event_add()
+  in place of the duration.  Calling this function twice with the same
+  duration returns the same pointer.
+
+  @param base the event_base that the timeouts will be used with
+  @param duration the duration of the timeouts
+  @return a pointer to pass to event_add(), or NULL if an error occurred
+  @see event_add()
+ */
+const struct timeval *event_base_init_common_timeout(struct event_base *base,
+    const struct timeval *duration);
+
 /**
   Checks if a specific event is pending or scheduled.
 
@@ -750,6 +1292,58 @@ int	event_base_priority_init(struct event_base *, int);
 int	event_priority_set(struct event *, int);
 
 
+/**
+  Policies that may be passed to event_base_priority_set_policy()
+ */
+/*@{*/
+/** Each loop iteration only runs the events of the highest priority that
+    has active events.  This is the default. */
+#define EVENT_PRIORITY_STRICT	0
+/** Each loop iteration runs the active events of all priorities in a
+    deficit round robin, starting with the highest priority. */
+#define EVENT_PRIORITY_DRR	1
+/*@}*/
+
+/**
+  Choose how an event_base shares its loop iterations between priorities.
+
+  With EVENT_PRIORITY_STRICT, a busy high priority can starve lower ones
+  indefinitely.  With EVENT_PRIORITY_DRR, every priority with active events
+  may run as many callbacks as its weight in each iteration; a priority
+  that runs over, for instance because a signal was delivered several times,
+  makes up for it in the next iteration.  No priority waits for more than
+  one iteration, and an iteration runs at most as many callbacks as the
+  weights add up to.
+
+  event_base_priority_init() resets the weights, so call this function
+  after it.
+
+  @param base the event_base
+  @param policy EVENT_PRIORITY_STRICT or EVENT_PRIORITY_DRR
+  @param weights an array with a positive weight for each priority, or NULL
+         for the default, which gives priority i a weight of
+         npriorities - i
+  @return 0 if successful, or -1 if an error occurred
+  @see event_base_priority_init()
+ */
+int	event_base_priority_set_policy(struct event_base *base, int policy,
+    const int *weights);
+
+
+/**
+  Set the timer slack of an event.
+
+  The slack applies at once: a pending timeout is rescheduled with it.
+  See event_config_set_timer_slack() for details.
+
+  @param ev an event struct
+  @param slack the slack of the event, or NULL for the default of its base
+  @return 0 if successful, or -1 if the slack is negative or too large
+  @see event_config_set_timer_slack()
+ */
+int	event_set_timer_slack(struct event *ev, const struct timeval *slack);
+
+
 /* These functions deal with buffering input and output */
 
 struct evbuffer {
@@ -772,6 +1366,7 @@ struct evbuffer {
 #define EVBUFFER_TIMEOUT	0x40
 
 struct bufferevent;
+struct bufferevent_uring;
 typedef void (*evbuffercb)(struct bufferevent *, void *);
 typedef void (*everrorcb)(struct bufferevent *, short what, void *);
 
@@ -810,6 +1405,9 @@ struct bufferevent {
 	int timeout_write;	/* in seconds */
 
 	short enabled;	/* events that are currently enabled */
+
+    /* 通过 io_uring 完成读写时的状态，见 bufferevent_uring_new() */
+	struct bufferevent_uring *uring;
 };
 #endif
 
@@ -851,6 +1449,41 @@ struct bufferevent *bufferevent_new(int fd,
     evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg);
 
 
+/**
+  Create a new bufferevent that does its I/O through io_uring.
+
+  Instead of waiting for the file descriptor to become readable and then
+  calling read(), the bufferevent keeps a recv posted on the io_uring of
+  the base and gets the data along with the completion; writes are posted
+  as sends.  This saves a system call per read.  The callbacks, watermarks
+  and timeouts work as for bufferevent_new().
+
+  While a send is in flight the data stays in memory that the kernel reads
+  from, so the bufferevent cannot move to another base, and
+  bufferevent_free() may have to wait for the kernel before it releases
+  the memory.
+
+  If the base does not use the io_uring backend, the kernel cannot provide
+  buffers for recv, or libevent was built against io_uring headers that
+  lack them (older than Linux 6.0), this returns an ordinary bufferevent
+  on base.
+
+  @param base the event_base that the bufferevent uses
+  @param fd the socket from which data is read and written to
+  @param readcb callback to invoke when there is data to be read, or NULL if
+         no callback is desired
+  @param writecb callback to invoke when the output buffer was sent, or
+         NULL if no callback is desired
+  @param errorcb callback to invoke when there is an error on the socket
+  @param cbarg an argument that will be supplied to each of the callbacks
+  @return a pointer to a newly allocated bufferevent struct, or NULL if an
+          error occurred
+  @see bufferevent_new(), bufferevent_free()
+  */
+struct bufferevent *bufferevent_uring_new(struct event_base *base, int fd,
+    evbuffercb readcb, evbuffercb writecb, everrorcb errorcb, void *cbarg);
+
+
 /**
   Assign a bufferevent to a specific event_base.
 
@@ -0,0 +1,673 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A runtime of N event bases, each running its loop in a thread of its own
+ * that is pinned to a CPU.  Every loop gets its own listening socket for
+ * the same address; with SO_REUSEPORT the kernel spreads the incoming
+ * connections over them, so the loops never contend for an accept queue.
+ *
+ * The kernel does not know how busy the loops are, though.  A loop may
+ * therefore hand a connection that it accepted to the least loaded loop,
+ * through a lock-free queue of the receiving loop.  If that loop does not
+ * get around to its queue, an idle loop steals the queue from it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#define _GNU_SOURCE
+#endif
+
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <windows.h>
+#undef WIN32_LEAN_AND_MEAN
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_libevent_time.h>
+#endif
+#include <sys/queue.h>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "event.h"
+#include "event-internal.h"
+#include "evutil.h"
+#include "evthread-internal.h"
+#include "log.h"
+
+#ifdef EVTHREAD_AVAILABLE
+
+/* A connection that waits in the queue of a loop */
+struct event_runtime_conn {
+	struct event_runtime_conn *next;
+	int fd;
+	int salen;
+	struct sockaddr_storage ss;
+};
+
+struct event_runtime_loop {
+	struct event_runtime *rt;
+	struct event_base *base;
+	int fd;			/* listening socket, or -1 */
+	int cpu;		/* CPU to pin the thread to */
+	pthread_t thread;
+
+	/* takes over the connections handed to this loop */
+	void (*conncb)(struct event_base *, int, struct sockaddr *, int,
+	    void *);
+	void *connarg;
+	/* connections handed to this loop, newest first */
+	struct event_runtime_conn *volatile pending;
+	volatile int npending;
+	/* set while a steal request for this loop is posted */
+	volatile int stealing;
+};
+
+struct event_runtime {
+	struct event_runtime_loop *loops;
+	int nloops;
+	int running;
+};
+
+/* Returns the number of online CPUs, or 1 if we cannot tell */
+static int
+runtime_ncpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return ((int)n);
+#endif
+	return (1);
+}
+
+struct event_runtime *
+event_runtime_new(int nloops, const struct event_config *cfg)
+{
+	struct event_runtime *rt;
+	struct event_config loopcfg;
+	int i, ncpus = runtime_ncpus();
+
+	if (nloops <= 0)
+		nloops = ncpus;
+
+	/* the loops must be thread-safe so that we can stop them */
+	if (cfg != NULL) {
+		loopcfg = *cfg;
+	} else {
+		memset(&loopcfg, 0, sizeof(loopcfg));
+		loopcfg.max_dispatch_callbacks = -1;
+	}
+	loopcfg.flags |= EVENT_BASE_FLAG_THREADSAFE;
+
+	if ((rt = calloc(1, sizeof(struct event_runtime))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		return (NULL);
+	}
+	if ((rt->loops = calloc(nloops, sizeof(*rt->loops))) == NULL) {
+		event_warn("%s: calloc", __func__);
+		free(rt);
+		return (NULL);
+	}
+	rt->nloops = nloops;
+
+	for (i = 0; i < nloops; ++i) {
+		rt->loops[i].rt = rt;
+		rt->loops[i].fd = -1;
+		rt->loops[i].cpu = i % ncpus;
+	}
+	for (i = 0; i < nloops; ++i) {
+		rt->loops[i].base = event_base_new_with_config(&loopcfg);
+		if (rt->loops[i].base == NULL) {
+			event_runtime_free(rt);
+			return (NULL);
+		}
+	}
+
+	return (rt);
+}
+
+int
+event_runtime_nloops(struct event_runtime *rt)
+{
+	return (rt->nloops);
+}
+
+struct event_base *
+event_runtime_get_base(struct event_runtime *rt, int i)
+{
+	if (i < 0 || i >= rt->nloops)
+		return (NULL);
+	return (rt->loops[i].base);
+}
+
+int
+event_runtime_get_socket(struct event_runtime *rt, int i)
+{
+	if (i < 0 || i >= rt->nloops)
+		return (-1);
+	return (rt->loops[i].fd);
+}
+
+static struct event_runtime_loop *
+runtime_find_loop(struct event_runtime *rt, struct event_base *base)
+{
+	int i;
+
+	for (i = 0; i < rt->nloops; ++i) {
+		if (rt->loops[i].base == base)
+			return (&rt->loops[i]);
+	}
+	return (NULL);
+}
+
+int
+event_runtime_set_conncb(struct event_runtime *rt, struct event_base *base,
+    void (*cb)(struct event_base *, int, struct sockaddr *, int, void *),
+    void *arg)
+{
+	struct event_runtime_loop *loop = runtime_find_loop(rt, base);
+
+	if (loop == NULL)
+		return (-1);
+	loop->conncb = cb;
+	loop->connarg = arg;
+	return (0);
+}
+
+/*
+ * Reads the counters of a base without its lock; the result is only a hint,
+ * but a stale one costs no more than a connection on a busier loop.
+ */
+static int
+runtime_loop_load(struct event_runtime_loop *loop)
+{
+	return (loop->base->event_count + loop->base->event_count_active +
+	    loop->npending);
+}
+
+int
+event_runtime_get_load(struct event_runtime *rt, int i)
+{
+	if (i < 0 || i >= rt->nloops)
+		return (-1);
+	return (runtime_loop_load(&rt->loops[i]));
+}
+
+#ifdef EVTHREAD_HAVE_ATOMICS
+/*
+ * Takes all connections from the queue of a loop, oldest first.  Both the
+ * owner and thieves take the whole queue at once, so that pushing with a
+ * compare-and-swap cannot suffer from ABA.
+ */
+static struct event_runtime_conn *
+runtime_take(struct event_runtime_loop *loop)
+{
+	struct event_runtime_conn *conn, *next, *fifo = NULL;
+	int n = 0;
+
+	conn = EVTHREAD_ATOMIC_XCHG_PTR(&loop->pending, NULL);
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+		conn->next = fifo;
+		fifo = conn;
+		++n;
+	}
+	if (n)
+		EVTHREAD_ATOMIC_ADD(&loop->npending, -n);
+	return (fifo);
+}
+
+/* Passes connections to the callback of the loop that runs this */
+static void
+runtime_run_conns(struct event_runtime_loop *loop,
+    struct event_runtime_conn *conn)
+{
+	struct event_runtime_conn *next;
+
+	for (; conn != NULL; conn = next) {
+		next = conn->next;
+		if (loop->conncb != NULL)
+			(*loop->conncb)(loop->base, conn->fd,
+			    (struct sockaddr *)&conn->ss, conn->salen,
+			    loop->connarg);
+		else
+			EVUTIL_CLOSESOCKET(conn->fd);
+		free(conn);
+	}
+}
+
+/* Runs in the loop that connections were handed to */
+static void
+runtime_drain(void *arg)
+{
+	struct event_runtime_loop *loop = arg;
+
+	runtime_run_conns(loop, runtime_take(loop));
+}
+
+/* Runs in an idle loop; takes the longest queue of another loop */
+static void
+runtime_steal(void *arg)
+{
+	struct event_runtime_loop *loop = arg, *victim = NULL;
+	struct event_runtime *rt = loop->rt;
+	int i;
+
+	loop->stealing = 0;
+	runtime_drain(loop);
+
+	for (i = 0; i < rt->nloops; ++i) {
+		struct event_runtime_loop *peer = &rt->loops[i];
+		if (peer == loop || peer->pending == NULL)
+			continue;
+		if (victim == NULL || peer->npending > victim->npending)
+			victim = peer;
+	}
+	if (victim != NULL) {
+		event_debug(("%s: loop %d steals %d connections",
+			__func__, (int)(loop - rt->loops), victim->npending));
+		runtime_run_conns(loop, runtime_take(victim));
+	}
+}
+
+/* Wakes up the least loaded idle loop other than busy to steal its queue */
+static void
+runtime_wake_thief(struct event_runtime *rt, struct event_runtime_loop *busy)
+{
+	struct event_runtime_loop *thief = NULL;
+	int i, load, best = runtime_loop_load(busy);
+
+	for (i = 0; i < rt->nloops; ++i) {
+		struct event_runtime_loop *peer = &rt->loops[i];
+		if (peer == busy || peer->conncb == NULL ||
+		    peer->pending != NULL)
+			continue;
+		if ((load = runtime_loop_load(peer)) < best) {
+			best = load;
+			thief = peer;
+		}
+	}
+	if (thief == NULL ||
+	    !EVTHREAD_ATOMIC_CAS_INT(&thief->stealing, 0, 1))
+		return;
+	if (event_base_post(thief->base, runtime_steal, thief) == -1)
+		thief->stealing = 0;
+}
+#endif
+
+int
+event_runtime_handoff(struct event_runtime *rt, struct event_base *from,
+    int fd, const struct sockaddr *sa, int salen)
+{
+#ifdef EVTHREAD_HAVE_ATOMICS
+	struct event_runtime_loop *self = runtime_find_loop(rt, from);
+	struct event_runtime_loop *target = NULL;
+	struct event_runtime_conn *conn, *head;
+	int i, load, best = 0;
+
+	if (salen < 0 || salen > (int)sizeof(conn->ss))
+		return (-1);
+
+	for (i = 0; i < rt->nloops; ++i) {
+		struct event_runtime_loop *peer = &rt->loops[i];
+		if (peer->conncb == NULL)
+			continue;
+		load = runtime_loop_load(peer);
+		/* on a tie, the connection stays where it is */
+		if (target == NULL || load < best ||
+		    (load == best && peer == self)) {
+			best = load;
+			target = peer;
+		}
+	}
+	if (target == NULL)
+		return (-1);
+	if (target == self)
+		return (1);
+
+	if ((conn = malloc(sizeof(struct event_runtime_conn))) == NULL) {
+		event_warn("%s: malloc", __func__);
+		return (-1);
+	}
+	conn->fd = fd;
+	conn->salen = salen;
+	memcpy(&conn->ss, sa, salen);
+
+	EVTHREAD_ATOMIC_ADD(&target->npending, 1);
+	do {
+		head = target->pending;
+		conn->next = head;
+	} while (!EVTHREAD_ATOMIC_CAS_PTR(&target->pending, head, conn));
+
+	if (head == NULL) {
+		/* the first connection in the queue wakes up the loop */
+		if (event_base_post(target->base, runtime_drain, target) == -1)
+			runtime_wake_thief(rt, target);
+	} else {
+		/* the loop has not drained its queue yet */
+		runtime_wake_thief(rt, target);
+	}
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+/* Creates a non-blocking listening socket that shares its address */
+static int
+runtime_listen(const struct sockaddr *sa, socklen_t salen, int share)
+{
+	int fd, on = 1;
+
+	if ((fd = socket(sa->sa_family, SOCK_STREAM, 0)) == -1) {
+		event_warn("%s: socket", __func__);
+		return (-1);
+	}
+	if (evutil_make_socket_nonblocking(fd) < 0)
+		goto out;
+#ifdef HAVE_SETFD
+	if (fcntl(fd, F_SETFD, 1) == -1) {
+		event_warn("%s: fcntl(F_SETFD)", __func__);
+		goto out;
+	}
+#endif
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void *)&on, sizeof(on));
+#ifdef SO_REUSEPORT
+	if (share && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+		(void *)&on, sizeof(on)) == -1) {
+		event_warn("%s: setsockopt(SO_REUSEPORT)", __func__);
+		goto out;
+	}
+#endif
+
+	if (bind(fd, sa, salen) == -1) {
+		event_warn("%s: bind", __func__);
+		goto out;
+	}
+	if (listen(fd, 128) == -1) {
+		event_warn("%s: listen", __func__);
+		goto out;
+	}
+	return (fd);
+
+ out:
+	EVUTIL_CLOSESOCKET(fd);
+	return (-1);
+}
+
+int
+event_runtime_bind_socket(struct event_runtime *rt, const char *address,
+    u_short port)
+{
+#ifdef HAVE_GETADDRINFO
+	struct addrinfo hints, *ai = NULL;
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	char strport[NI_MAXSERV];
+	int i, res;
+
+	if (rt->running || rt->loops[0].fd != -1)
+		return (-1);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;  /* turn NULL host name into INADDR_ANY */
+	evutil_snprintf(strport, sizeof(strport), "%d", port);
+	if ((res = getaddrinfo(address, strport, &hints, &ai)) != 0) {
+		event_warnx("%s: getaddrinfo: %s", __func__,
+		    gai_strerror(res));
+		return (-1);
+	}
+	memcpy(&ss, ai->ai_addr, ai->ai_addrlen);
+	sslen = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	for (i = 0; i < rt->nloops; ++i) {
+#ifdef SO_REUSEPORT
+		rt->loops[i].fd = runtime_listen((struct sockaddr *)&ss,
+		    sslen, 1);
+#else
+		/* without SO_REUSEPORT, all loops accept from one socket */
+		rt->loops[i].fd = i == 0 ?
+		    runtime_listen((struct sockaddr *)&ss, sslen, 0) :
+		    dup(rt->loops[0].fd);
+#endif
+		if (rt->loops[i].fd == -1)
+			goto err;
+
+		/* with port 0 the others have to use the port we got */
+		if (i == 0 && port == 0 &&
+		    getsockname(rt->loops[0].fd, (struct sockaddr *)&ss,
+			&sslen) == -1) {
+			event_warn("%s: getsockname", __func__);
+			goto err;
+		}
+	}
+	return (0);
+
+ err:
+	for (i = 0; i < rt->nloops; ++i) {
+		if (rt->loops[i].fd != -1) {
+			EVUTIL_CLOSESOCKET(rt->loops[i].fd);
+			rt->loops[i].fd = -1;
+		}
+	}
+	return (-1);
+#else
+	event_warnx("%s: getaddrinfo is not available", __func__);
+	return (-1);
+#endif
+}
+
+static void *
+runtime_loop_thread(void *arg)
+{
+	struct event_runtime_loop *loop = arg;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	{
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(loop->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+			&cpus) != 0)
+			event_warnx("%s: cannot pin loop to CPU %d",
+			    __func__, loop->cpu);
+	}
+#endif
+
+	event_base_loop(loop->base, EVLOOP_NO_EXIT_ON_EMPTY);
+	return (NULL);
+}
+
+int
+event_runtime_start(struct event_runtime *rt)
+{
+	int i;
+
+	if (rt->running)
+		return (-1);
+
+	for (i = 0; i < rt->nloops; ++i) {
+		if (pthread_create(&rt->loops[i].thread, NULL,
+			runtime_loop_thread, &rt->loops[i]) != 0) {
+			event_warnx("%s: pthread_create failed", __func__);
+			if (rt->running)
+				event_runtime_stop(rt);
+			return (-1);
+		}
+		rt->running = i + 1;
+	}
+	return (0);
+}
+
+int
+event_runtime_stop(struct event_runtime *rt)
+{
+	int i;
+
+	if (!rt->running)
+		return (-1);
+
+	for (i = 0; i < rt->running; ++i)
+		event_base_loopbreak(rt->loops[i].base);
+	for (i = 0; i < rt->running; ++i)
+		pthread_join(rt->loops[i].thread, NULL);
+	rt->running = 0;
+	return (0);
+}
+
+void
+event_runtime_free(struct event_runtime *rt)
+{
+	int i;
+
+	if (rt->running)
+		event_runtime_stop(rt);
+
+	/* the sockets belong to the caller */
+	for (i = 0; i < rt->nloops; ++i) {
+#ifdef EVTHREAD_HAVE_ATOMICS
+		struct event_runtime_conn *conn, *next;
+
+		/* nobody took these connections over */
+		for (conn = runtime_take(&rt->loops[i]); conn; conn = next) {
+			next = conn->next;
+			EVUTIL_CLOSESOCKET(conn->fd);
+			free(conn);
+		}
+#endif
+		if (rt->loops[i].base != NULL)
+			event_base_free(rt->loops[i].base);
+	}
+	free(rt->loops);
+	free(rt);
+}
+
+#else /* !EVTHREAD_AVAILABLE */
+
+struct event_runtime *
+event_runtime_new(int nloops, const struct event_config *cfg)
+{
+	event_warnx("%s: libevent was built without thread support",
+	    __func__);
+	return (NULL);
+}
+
+int
+event_runtime_nloops(struct event_runtime *rt)
+{
+	return (0);
+}
+
+struct event_base *
+event_runtime_get_base(struct event_runtime *rt, int i)
+{
+	return (NULL);
+}
+
+int
+event_runtime_get_socket(struct event_runtime *rt, int i)
+{
+	return (-1);
+}
+
+int
+event_runtime_bind_socket(struct event_runtime *rt, const char *address,
+    u_short port)
+{
+	return (-1);
+}
+
+int
+event_runtime_set_conncb(struct event_runtime *rt, struct event_base *base,
+    void (*cb)(struct event_base *, int, struct sockaddr *, int, void *),
+    void *arg)
+{
+	return (-1);
+}
+
+int
+event_runtime_handoff(struct event_runtime *rt, struct event_base *from,
+    int fd, const struct sockaddr *sa, int salen)
+{
+	return (-1);
+}
+
+int
+event_runtime_get_load(struct event_runtime *rt, int i)
+{
+	return (-1);
+}
+
+int
+event_runtime_start(struct event_runtime *rt)
+{
+	return (-1);
+}
+
+int
+event_runtime_stop(struct event_runtime *rt)
+{
+	return (-1);
+}
+
+void
+event_runtime_free(struct event_runtime *rt)
+{
+}
+
+#endif /* EVTHREAD_AVAILABLE */
@@ -97,6 +97,11 @@ int evhttp_bind_socket(struct evhttp *http, const char *address, u_short port);
  * Can be called multiple times to have the http server listen to
  * multiple different sockets.
  *
+ * The servers of several event bases, e.g. one per thread, may accept on
+ * the same socket; see evhttp_set_accept_exclusive().  A server that
+ * wakes up accepts the connections that are waiting; see
+ * evhttp_set_accept_batch().  The socket is made nonblocking.
+ *
  * @param http a pointer to an evhttp object
  * @param fd a socket fd that is ready for accepting connections
  * @return 0 on success, -1 on failure.
@@ -104,6 +109,21 @@ int evhttp_bind_socket(struct evhttp *http, const char *address, u_short port);
  */
 int evhttp_accept_socket(struct evhttp *http, int fd);
 
+/**
+ * Balances the connections of an HTTP server over the loops of a runtime.
+ *
+ * The server must use one of the bases of the runtime; every loop that
+ * should take part needs a server of its own.  A connection accepted by
+ * any of them is then served by the loop with the lowest load, and idle
+ * loops steal connections that busy loops have not picked up yet.
+ *
+ * @param http a pointer to an evhttp object
+ * @param rt the runtime, or NULL to stop balancing
+ * @return 0 on success, -1 if the base of http is not part of rt
+ * @see event_runtime_handoff()
+ */
+int evhttp_set_runtime(struct evhttp *http, struct event_runtime *rt);
+
 /**
  * Free the previously created HTTP server.
  *
@@ -134,6 +154,65 @@ void evhttp_set_gencb(struct evhttp *,
  */
 void evhttp_set_timeout(struct evhttp *, int timeout_in_secs);
 
+/**
+ * Set how many connections a listener accepts when it wakes up.
+ *
+ * Accepting a batch saves a trip through the event loop per connection
+ * during a burst; a limit keeps the other events of the loop from
+ * waiting for the whole burst.  Connections beyond the limit are
+ * accepted in the next iteration of the loop.  The default is 64.
+ *
+ * @param http an evhttp object
+ * @param batch the most connections per wakeup, or 0 to accept until
+ *        no more are waiting
+ * @see evhttp_get_accept_stats()
+ */
+void evhttp_set_accept_batch(struct evhttp *http, int batch);
+
+/**
+ * Set whether a new connection wakes up only one of the servers that
+ * accept on the same socket.
+ *
+ * Where the base supports EV_FEATURE_EXCLUSIVE, the listener is added
+ * with EV_EXCLUSIVE, so that the servers of several bases, e.g. one per
+ * thread, do not all wake up for every connection.  All events on the
+ * socket must then be exclusive, so the application cannot watch it
+ * with an event of its own.  This is off by default, and applies to the
+ * sockets that evhttp_accept_socket() and evhttp_bind_socket() take
+ * afterwards.
+ *
+ * @param http an evhttp object
+ * @param exclusive 1 to wake up one server per connection, 0 to wake up
+ *        all of them
+ * @see evhttp_accept_socket()
+ */
+void evhttp_set_accept_exclusive(struct evhttp *http, int exclusive);
+
+/** What the listeners of an HTTP server accepted */
+struct evhttp_accept_stats {
+	/** times that a listener woke up */
+	unsigned long wakeups;
+	/** connections accepted in total */
+	unsigned long accepted;
+	/** wakeups that stopped at the batch limit */
+	unsigned long full;
+	/** connections accepted by the last wakeup */
+	int last;
+	/** the most connections that a single wakeup accepted */
+	int peak;
+};
+
+/**
+ * Get the accept counters of an HTTP server.
+ *
+ * @param http an evhttp object
+ * @param stats filled in with the counters
+ * @return 0 on success, -1 on failure
+ * @see evhttp_set_accept_batch()
+ */
+int evhttp_get_accept_stats(struct evhttp *http,
+    struct evhttp_accept_stats *stats);
+
 /* Request/Response functionality */
 
 /**
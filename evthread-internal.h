@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _EVTHREAD_INTERNAL_H_
+#define _EVTHREAD_INTERNAL_H_
+
+/*
+ * Locking for event bases created with EVENT_BASE_FLAG_THREADSAFE.
+ *
+ * A base without a lock (base->th_base_lock == NULL) pays for nothing but
+ * a pointer test.  The lock is recursive, since callbacks that run with it
+ * held, such as the signal and timeout processing, call back into
+ * event_add() and event_del().
+ */
+
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EVTHREAD_AVAILABLE 1
+
+/* Returns an id for the calling thread; pthread_t may be a struct */
+static inline unsigned long
+evthread_get_id(void)
+{
+	union {
+		pthread_t thr;
+		unsigned long id;
+	} r;
+
+	memset(&r, 0, sizeof(r));
+	r.thr = pthread_self();
+	return (r.id);
+}
+
+static inline void *
+evthread_lock_alloc(void)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutex_t *lock;
+
+	if ((lock = malloc(sizeof(pthread_mutex_t))) == NULL)
+		return (NULL);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(lock, &attr) != 0) {
+		free(lock);
+		lock = NULL;
+	}
+	pthread_mutexattr_destroy(&attr);
+	return (lock);
+}
+
+static inline void
+evthread_lock_free(void *lock)
+{
+	pthread_mutex_destroy(lock);
+	free(lock);
+}
+
+#define EVTHREAD_GET_ID()	evthread_get_id()
+#define EVTHREAD_ALLOC_LOCK()	evthread_lock_alloc()
+#define EVTHREAD_FREE_LOCK(lock) do {					\
+		if ((lock) != NULL)					\
+			evthread_lock_free(lock);			\
+	} while (0)
+
+/* Locks and unlocks a lock of the base if it has one */
+#define EVBASE_ACQUIRE_LOCK(base, lockvar) do {				\
+		if ((base)->lockvar != NULL)				\
+			pthread_mutex_lock((base)->lockvar);		\
+	} while (0)
+#define EVBASE_RELEASE_LOCK(base, lockvar) do {				\
+		if ((base)->lockvar != NULL)				\
+			pthread_mutex_unlock((base)->lockvar);		\
+	} while (0)
+
+/* True if a change to the base has to wake up the thread in its loop */
+#define EVBASE_NEED_NOTIFY(base)					\
+	((base)->th_base_lock != NULL && (base)->running_loop &&	\
+	    (base)->th_owner_id != evthread_get_id())
+
+/* Atomic operations for the lock-free queues of event_base_post() and of
+ * the runtime */
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+#define EVTHREAD_HAVE_ATOMICS 1
+#define EVTHREAD_ATOMIC_ADD(p, n)	__sync_add_and_fetch((p), (n))
+#define EVTHREAD_ATOMIC_CAS_INT(p, old, new)				\
+	__sync_bool_compare_and_swap((p), (old), (new))
+#define EVTHREAD_ATOMIC_CAS_PTR(p, old, new)				\
+	__sync_bool_compare_and_swap((p), (old), (new))
+#define EVTHREAD_ATOMIC_XCHG_PTR(p, new)				\
+	__sync_lock_test_and_set((p), (new))
+#endif
+
+#else /* !HAVE_PTHREADS */
+
+#define EVTHREAD_GET_ID()	0UL
+#define EVTHREAD_ALLOC_LOCK()	NULL
+#define EVTHREAD_FREE_LOCK(lock) do { } while (0)
+#define EVBASE_ACQUIRE_LOCK(base, lockvar) do { (void)(base); } while (0)
+#define EVBASE_RELEASE_LOCK(base, lockvar) do { (void)(base); } while (0)
+#define EVBASE_NEED_NOTIFY(base)	0
+
+#endif /* HAVE_PTHREADS */
+
+#endif /* _EVTHREAD_INTERNAL_H_ */
@@ -122,6 +122,19 @@ struct evhttp {
 	void *gencbarg;
 
 	struct event_base *base;
+	/* hands accepted connections to the least loaded loop, or NULL */
+	struct event_runtime *runtime;
+
+	/* connections to accept per wakeup of a listener, 0 for all, and
+	 * what evhttp_get_accept_stats() reports */
+	int accept_batch;
+	unsigned long accept_wakeups;
+	unsigned long accepted;
+	unsigned long accept_full;
+	int accept_last;
+	int accept_peak;
+	/* listeners bound from now on wake up one base per connection */
+	int accept_exclusive;
 };
 
 /* resets the connection; can be reused for more requests */
@@ -29,6 +29,11 @@
 #include "config.h"
 #endif
 
+#ifdef HAVE_ACCEPT4
+/* for accept4() */
+#define _GNU_SOURCE
+#endif
+
 #ifdef HAVE_SYS_PARAM_H
 #include <sys/param.h>
 #endif
@@ -197,6 +202,9 @@ fake_freeaddrinfo(struct addrinfo *ai)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+/* how many connections a listener accepts per wakeup by default */
+#define EVHTTP_ACCEPT_BATCH 64
+
 /* wrapper for setting the base from the http server */
 #define EVHTTP_BASE_SET(x, y) do { \
 	if ((x)->base != NULL) event_base_set((x)->base, y);	\
@@ -1130,11 +1138,18 @@ evhttp_detect_close_cb(int fd, short what, void *arg)
 static void
 evhttp_connection_start_detectclose(struct evhttp_connection *evcon)
 {
+	short what = EV_READ;
+
 	evcon->flags |= EVHTTP_CON_CLOSEDETECT;
 
+	/* if we can, wait for the close itself instead of any data */
+	if (evcon->base != NULL &&
+	    (event_base_get_features(evcon->base) & EV_FEATURE_EARLY_CLOSE))
+		what = EV_CLOSED;
+
 	if (event_initialized(&evcon->close_ev))
 		event_del(&evcon->close_ev);
-	event_set(&evcon->close_ev, evcon->fd, EV_READ,
+	event_set(&evcon->close_ev, evcon->fd, what,
 	    evhttp_detect_close_cb, evcon);
 	EVHTTP_BASE_SET(evcon, &evcon->close_ev);
 	event_add(&evcon->close_ev, NULL);
@@ -2292,18 +2307,78 @@ accept_socket(int fd, short what, void *arg)
 {
 	struct evhttp *http = arg;
 	struct sockaddr_storage ss;
-	socklen_t addrlen = sizeof(ss);
-	int nfd;
+	socklen_t addrlen;
+	int nfd, n = 0;
+
+	/* with an exclusive listener, the other bases were not woken up
+	 * for these connections; take them, but leave the rest of the
+	 * loop a chance after accept_batch of them */
+	while (http->accept_batch <= 0 || n < http->accept_batch) {
+		addrlen = sizeof(ss);
+#ifdef HAVE_ACCEPT4
+		nfd = accept4(fd, (struct sockaddr *)&ss, &addrlen,
+		    SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		nfd = accept(fd, (struct sockaddr *)&ss, &addrlen);
+#endif
+		if (nfd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				event_warn("%s: bad accept", __func__);
+			break;
+		}
+#ifndef HAVE_ACCEPT4
+		if (evutil_make_socket_nonblocking(nfd) < 0) {
+			EVUTIL_CLOSESOCKET(nfd);
+			continue;
+		}
+#endif
+		++n;
 
-	if ((nfd = accept(fd, (struct sockaddr *)&ss, &addrlen)) == -1) {
-		if (errno != EAGAIN && errno != EINTR)
-			event_warn("%s: bad accept", __func__);
-		return;
+		/* a less loaded loop may take the connection over */
+		if (http->runtime != NULL &&
+		    event_runtime_handoff(http->runtime, http->base, nfd,
+			(struct sockaddr *)&ss, addrlen) == 0)
+			continue;
+
+		evhttp_get_request(http, nfd, (struct sockaddr *)&ss, addrlen);
 	}
-	if (evutil_make_socket_nonblocking(nfd) < 0)
-		return;
 
-	evhttp_get_request(http, nfd, (struct sockaddr *)&ss, addrlen);
+	/* the listener is level-triggered; what we left fires again */
+	http->accept_wakeups++;
+	http->accepted += n;
+	http->accept_last = n;
+	if (n > http->accept_peak)
+		http->accept_peak = n;
+	if (http->accept_batch > 0 && n == http->accept_batch)
+		http->accept_full++;
+}
+
+/* Takes over a connection that another loop of the runtime accepted */
+static void
+evhttp_runtime_conncb(struct event_base *base, int fd, struct sockaddr *sa,
+    int salen, void *arg)
+{
+	struct evhttp *http = arg;
+
+	evhttp_get_request(http, fd, sa, salen);
+}
+
+int
+evhttp_set_runtime(struct evhttp *http, struct event_runtime *rt)
+{
+	if (http->runtime != NULL)
+		event_runtime_set_conncb(http->runtime, http->base,
+		    NULL, NULL);
+	http->runtime = NULL;
+	if (rt == NULL)
+		return (0);
+	if (event_runtime_set_conncb(rt, http->base,
+		evhttp_runtime_conncb, http) == -1)
+		return (-1);
+	http->runtime = rt;
+	return (0);
 }
 
 int
@@ -2343,8 +2418,17 @@ evhttp_accept_socket(struct evhttp *http, int fd)
 
 	ev = &bound->bind_ev;
 
-	/* Schedule the socket for accepting */
-	event_set(ev, fd, EV_READ | EV_PERSIST, accept_socket, http);
+	/* accept_socket() drains the listener until it would block */
+	if (evutil_make_socket_nonblocking(fd) < 0) {
+		free(bound);
+		return (-1);
+	}
+
+	/* Schedule the socket for accepting; if asked to, only one of the
+	 * bases that accept on the same socket wakes up per connection */
+	event_set(ev, fd, EV_READ | EV_PERSIST |
+	    (http->accept_exclusive ? EV_EXCLUSIVE : 0),
+	    accept_socket, http);
 	EVHTTP_BASE_SET(http, ev);
 
 	res = event_add(ev, NULL);
@@ -2370,6 +2454,7 @@ evhttp_new_object(void)
 	}
 
 	http->timeout = -1;
+	http->accept_batch = EVHTTP_ACCEPT_BATCH;
 
 	TAILQ_INIT(&http->sockets);
 	TAILQ_INIT(&http->callbacks);
@@ -2413,6 +2498,8 @@ evhttp_free(struct evhttp* http)
 	struct evhttp_bound_socket *bound;
 	int fd;
 
+	evhttp_set_runtime(http, NULL);
+
 	/* Remove the accepting part */
 	while ((bound = TAILQ_FIRST(&http->sockets)) != NULL) {
 		TAILQ_REMOVE(&http->sockets, bound, next);
@@ -2444,6 +2531,32 @@ evhttp_set_timeout(struct evhttp* http, int timeout_in_secs)
 	http->timeout = timeout_in_secs;
 }
 
+void
+evhttp_set_accept_batch(struct evhttp *http, int batch)
+{
+	http->accept_batch = batch > 0 ? batch : 0;
+}
+
+void
+evhttp_set_accept_exclusive(struct evhttp *http, int exclusive)
+{
+	http->accept_exclusive = exclusive != 0;
+}
+
+int
+evhttp_get_accept_stats(struct evhttp *http,
+    struct evhttp_accept_stats *stats)
+{
+	if (http == NULL || stats == NULL)
+		return (-1);
+	stats->wakeups = http->accept_wakeups;
+	stats->accepted = http->accepted;
+	stats->full = http->accept_full;
+	stats->last = http->accept_last;
+	stats->peak = http->accept_peak;
+	return (0);
+}
+
 void
 evhttp_set_cb(struct evhttp *http, const char *uri,
     void (*cb)(struct evhttp_request *, void *), void *cbarg)
@@ -0,0 +1,927 @@
+/*
+ * Copyright 2000-2003 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A backend on top of io_uring.  Every fd gets a one-shot poll request
+ * that we arm again after each completion, once the callbacks have run;
+ * if they left data behind, the new request completes at once.  Our
+ * events are level triggered, so we cannot use multishot polls: they
+ * only report new readiness, and the kernel refuses them in level mode.
+ * Changes to the events of an fd only go to the submission queue;
+ * dispatch submits all of them with the base locked, and then waits for
+ * completions without the lock, so that other threads can queue
+ * requests meanwhile.
+ *
+ * We need IORING_FEAT_EXT_ARG (Linux 5.11) to wait with a timeout.  On
+ * older kernels, or where io_uring is disabled, init fails and the next
+ * backend takes over.
+ *
+ * Completion mode bufferevents skip the readiness step: they post recv
+ * and send requests (struct evuring_req) on the same ring.  Reads pick
+ * their memory from a ring of provided buffers that we register on first
+ * use; this needs Linux 5.19, and headers with multishot recv
+ * (HAVE_IO_URING_BUF_RING) to build at all.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#else
+#include <sys/_libevent_time.h>
+#endif
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "event.h"
+#include "event-internal.h"
+#include "evsignal.h"
+#include "evthread-internal.h"
+#include "log.h"
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0x2000
+#endif
+
+/* what we know about an fd */
+struct evuring {
+	struct event *evread;
+	struct event *evwrite;
+	struct event *evclosed;
+	/* poll events of the request in the kernel; 0 if there is none */
+	unsigned armed;
+	/* tells completions of an old request from the current one; wraps
+	 * at URING_GEN_MASK */
+	unsigned gen;
+	/* set while the fd is on the changelist */
+	int changed;
+	/* set if the fd lost all its events since the last flush; it may
+	 * have been closed and reopened behind our back */
+	int dropped;
+};
+
+struct uringop {
+	struct event_base *base;
+	int ringfd;
+
+	/* submission queue */
+	void *sq_ring;
+	size_t sq_ring_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail;	/* includes entries not submitted yet */
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	/* completion queue */
+	void *cq_ring;
+	size_t cq_ring_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct evuring *fds;
+	int nfds;
+
+	/* fds whose events changed since the last io_uring_enter() */
+	int *changes;
+	int nchanges;
+	int changes_size;
+
+#ifdef HAVE_IO_URING_BUF_RING
+	/* requests of completion mode bufferevents in flight */
+	TAILQ_HEAD(evuring_reqq, evuring_req) reqs;
+	/* cleared if the kernel rejects IORING_RECV_MULTISHOT */
+	int recv_multishot;
+
+	/* provided buffers for recv; bufring is 1 once registered and -1
+	 * if the kernel cannot do it */
+	int bufring;
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned short br_tail;
+	char *bufs;
+#endif
+};
+
+static void *uring_init	(struct event_base *);
+static int uring_add	(void *, struct event *);
+static int uring_del	(void *, struct event *);
+static int uring_dispatch	(struct event_base *, void *, struct timeval *);
+static void uring_dealloc	(struct event_base *, void *);
+
+const struct eventop iouringops = {
+	"io_uring",
+	uring_init,
+	uring_add,
+	uring_del,
+	uring_dispatch,
+	uring_dealloc,
+	1, /* need reinit */
+	1, /* thread safe */
+	NULL,
+	EV_FEATURE_O1|EV_FEATURE_EARLY_CLOSE
+};
+
+#define URING_ENTRIES 256
+#define INITIAL_NFILES 32
+
+#ifdef HAVE_IO_URING_BUF_RING
+/* the provided buffers; a power of two in number */
+#define URING_NBUFS	64
+#define URING_BUFSIZE	4096
+#define URING_BGID	0
+#endif
+
+/*
+ * The low two bits of the user data tell what completed.  Poll requests
+ * carry the fd and its generation; other requests carry a pointer to
+ * their struct evuring_req.  Completions that we do not care about, such
+ * as those of removals, are ignored.
+ */
+#define URING_TAG_POLL		0
+#define URING_TAG_IGNORE	1
+#define URING_TAG_REQ		2
+#define URING_TAG(data)		((data) & 3)
+#define URING_REQ_DATA(req)	((uint64_t)(uintptr_t)(req) | URING_TAG_REQ)
+#define URING_REQ(data)							\
+	((struct evuring_req *)(uintptr_t)((data) & ~(uint64_t)3))
+#define URING_POLL_DATA(fd, gen)					\
+	(((uint64_t)(gen) << 34) | ((uint64_t)(fd) << 2) | URING_TAG_POLL)
+#define URING_POLL_FD(data)	((int)(((data) >> 2) & 0xffffffff))
+#define URING_POLL_GEN(data)	((unsigned)((data) >> 34))
+/* the generation gets the 30 bits above the fd */
+#define URING_GEN_MASK		0x3fffffff
+
+/* the kernel reads our tail and writes our head, and vice versa */
+#define URING_LOAD_ACQUIRE(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+	return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, arg, argsz));
+}
+
+static void
+uring_unmap(struct uringop *uring)
+{
+	if (uring->sqes != NULL && uring->sqes != MAP_FAILED)
+		munmap(uring->sqes, uring->sqes_len);
+	if (uring->cq_ring != NULL && uring->cq_ring != MAP_FAILED &&
+	    uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_len);
+	if (uring->sq_ring != NULL && uring->sq_ring != MAP_FAILED)
+		munmap(uring->sq_ring, uring->sq_ring_len);
+}
+
+static void *
+uring_init(struct event_base *base)
+{
+	struct io_uring_params p;
+	struct uringop *uring;
+	char *sq, *cq;
+	int fd;
+
+	/* Disable io_uring when this environment variable is set */
+	if (evutil_getenv("EVENT_NOIOURING"))
+		return (NULL);
+
+	memset(&p, 0, sizeof(p));
+	if ((fd = sys_io_uring_setup(URING_ENTRIES, &p)) == -1) {
+		/* no kernel support, or turned off by seccomp or sysctl */
+		if (errno != ENOSYS && errno != EPERM)
+			event_warn("io_uring_setup");
+		return (NULL);
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		close(fd);
+		return (NULL);
+	}
+	if (fcntl(fd, F_SETFD, 1) == -1)
+		event_warn("fcntl(%d, F_SETFD)", fd);
+
+	if (!(uring = calloc(1, sizeof(struct uringop)))) {
+		close(fd);
+		return (NULL);
+	}
+	uring->base = base;
+	uring->ringfd = fd;
+#ifdef HAVE_IO_URING_BUF_RING
+	uring->recv_multishot = 1;
+	TAILQ_INIT(&uring->reqs);
+#endif
+
+	uring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	uring->cq_ring_len = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_ring_len > uring->sq_ring_len)
+			uring->sq_ring_len = uring->cq_ring_len;
+		uring->cq_ring_len = uring->sq_ring_len;
+	}
+	uring->sq_ring = mmap(NULL, uring->sq_ring_len,
+	    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+	    IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED)
+		goto err;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ring = uring->sq_ring;
+	else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_len,
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd,
+		    IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED)
+			goto err;
+	}
+	uring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED)
+		goto err;
+
+	sq = uring->sq_ring;
+	uring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	uring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	uring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	uring->sq_entries = p.sq_entries;
+	uring->sq_local_tail = *uring->sq_tail;
+
+	cq = uring->cq_ring;
+	uring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	uring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	uring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	uring->fds = calloc(INITIAL_NFILES, sizeof(struct evuring));
+	if (uring->fds == NULL)
+		goto err;
+	uring->nfds = INITIAL_NFILES;
+
+	evsignal_init(base);
+
+	return (uring);
+
+ err:
+	uring_unmap(uring);
+	close(fd);
+	free(uring);
+	return (NULL);
+}
+
+static int
+uring_recalc(struct uringop *uring, int max)
+{
+	if (max >= uring->nfds) {
+		struct evuring *fds;
+		int nfds;
+
+		nfds = uring->nfds;
+		while (nfds <= max)
+			nfds <<= 1;
+
+		fds = realloc(uring->fds, nfds * sizeof(struct evuring));
+		if (fds == NULL) {
+			event_warn("realloc");
+			return (-1);
+		}
+		uring->fds = fds;
+		memset(fds + uring->nfds, 0,
+		    (nfds - uring->nfds) * sizeof(struct evuring));
+		uring->nfds = nfds;
+	}
+
+	return (0);
+}
+
+/*
+ * Hands the queued entries to the kernel, including any that it did not
+ * take last time.  The base must be locked: other threads fill in entries
+ * under the lock.  Returns -1 with errno set if io_uring_enter() failed.
+ */
+static int
+uring_submit(struct uringop *uring)
+{
+	unsigned to_submit =
+	    uring->sq_local_tail - URING_LOAD_ACQUIRE(uring->sq_head);
+
+	URING_STORE_RELEASE(uring->sq_tail, uring->sq_local_tail);
+	if (!to_submit)
+		return (0);
+	return (sys_io_uring_enter(uring->ringfd, to_submit, 0, 0, NULL, 0));
+}
+
+/*
+ * Waits for min_complete completions, or until ts passes if it is not
+ * NULL, without submitting anything; safe without the lock.
+ */
+static int
+uring_wait(struct uringop *uring, unsigned min_complete,
+    struct timespec *ts)
+{
+	struct io_uring_getevents_arg arg;
+	int res;
+
+	if (!min_complete)
+		return (0);
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)ts;
+	res = sys_io_uring_enter(uring->ringfd, 0, min_complete,
+	    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	/* running out of time is not an error for us */
+	if (res == -1 && errno == ETIME)
+		res = 0;
+	return (res);
+}
+
+/* Returns a cleared submission queue entry; submits if the queue is full */
+static struct io_uring_sqe *
+uring_get_sqe(struct uringop *uring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned idx;
+
+	if (uring->sq_local_tail - URING_LOAD_ACQUIRE(uring->sq_head) >=
+	    uring->sq_entries) {
+		if (uring_submit(uring) == -1 && errno != EBUSY)
+			event_warn("io_uring_enter");
+		if (uring->sq_local_tail - URING_LOAD_ACQUIRE(uring->sq_head) >=
+		    uring->sq_entries)
+			return (NULL);
+	}
+	idx = uring->sq_local_tail & *uring->sq_mask;
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[idx] = idx;
+	uring->sq_local_tail++;
+	return (sqe);
+}
+
+/*
+ * Replaces the poll request of fd with one for the events that it has now.
+ * The kernel matches the removal by the user data of the old request.
+ */
+static int
+uring_apply(struct uringop *uring, int fd)
+{
+	struct evuring *evu = &uring->fds[fd];
+	struct io_uring_sqe *sqe;
+	unsigned want = 0;
+	int dropped = evu->dropped;
+
+	evu->dropped = 0;
+	if (evu->evread != NULL)
+		want |= POLLIN;
+	if (evu->evwrite != NULL)
+		want |= POLLOUT;
+	if (evu->evclosed != NULL)
+		want |= POLLRDHUP;
+
+	if (want == evu->armed && !dropped)
+		return (0);
+
+	if (evu->armed) {
+		if ((sqe = uring_get_sqe(uring)) == NULL)
+			return (-1);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = URING_POLL_DATA(fd, evu->gen);
+		sqe->user_data = URING_TAG_IGNORE;
+		evu->armed = 0;
+	}
+	if (want) {
+		if ((sqe = uring_get_sqe(uring)) == NULL)
+			return (-1);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = want;
+		evu->gen = (evu->gen + 1) & URING_GEN_MASK;
+		sqe->user_data = URING_POLL_DATA(fd, evu->gen);
+		evu->armed = want;
+	}
+	return (0);
+}
+
+static int
+uring_queue_change(struct uringop *uring, int fd)
+{
+	struct evuring *evu = &uring->fds[fd];
+
+	if (evu->changed)
+		return (0);
+	if (uring->nchanges == uring->changes_size) {
+		int size = uring->changes_size ? uring->changes_size * 2 :
+		    INITIAL_NFILES;
+		int *changes = realloc(uring->changes, size * sizeof(int));
+		if (changes == NULL) {
+			event_warn("realloc");
+			return (-1);
+		}
+		uring->changes = changes;
+		uring->changes_size = size;
+	}
+	uring->changes[uring->nchanges++] = fd;
+	evu->changed = 1;
+	return (0);
+}
+
+static void
+uring_flush_changes(struct uringop *uring)
+{
+	int i, fd;
+
+	for (i = 0; i < uring->nchanges; ++i) {
+		fd = uring->changes[i];
+		uring->fds[fd].changed = 0;
+		if (uring_apply(uring, fd) == -1)
+			event_warnx("%s: submission queue full for fd %d",
+			    __func__, fd);
+	}
+	uring->nchanges = 0;
+}
+
+/* Activates the events of a poll completion */
+static void
+uring_poll_complete(struct uringop *uring, struct io_uring_cqe *cqe)
+{
+	int fd = URING_POLL_FD(cqe->user_data);
+	struct event *evread = NULL, *evwrite = NULL, *evclosed = NULL;
+	struct evuring *evu;
+	int what = cqe->res;
+
+	if (fd >= uring->nfds)
+		return;
+	evu = &uring->fds[fd];
+	/* a request that we replaced or removed */
+	if (!evu->armed || URING_POLL_GEN(cqe->user_data) != evu->gen)
+		return;
+
+	evu->armed = 0;
+	if (what < 0) {
+		if (what != -ECANCELED)
+			event_warnx("%s: poll on fd %d: %s", __func__, fd,
+			    strerror(-what));
+		return;
+	}
+
+	/* arm a new one before we wait, after the callbacks ran; if they
+	 * left data behind, it completes right away */
+	uring_queue_change(uring, fd);
+
+	if (what & (POLLHUP|POLLERR|POLLNVAL)) {
+		evread = evu->evread;
+		evwrite = evu->evwrite;
+		evclosed = evu->evclosed;
+	} else {
+		if (what & POLLIN)
+			evread = evu->evread;
+		if (what & POLLOUT)
+			evwrite = evu->evwrite;
+		if (what & POLLRDHUP)
+			evclosed = evu->evclosed;
+	}
+
+	if (evread != NULL)
+		event_active(evread, EV_READ, 1);
+	if (evwrite != NULL)
+		event_active(evwrite, EV_WRITE, 1);
+	if (evclosed != NULL)
+		event_active(evclosed, EV_CLOSED, 1);
+}
+
+#ifdef HAVE_IO_URING_BUF_RING
+/* Hands buffer bid back to the kernel */
+static void
+uring_put_buf(struct uringop *uring, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &uring->br->bufs[uring->br_tail & (URING_NBUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(uring->bufs + bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	uring->br_tail++;
+	URING_STORE_RELEASE(&uring->br->tail, uring->br_tail);
+}
+
+/* Registers the provided buffers for recv the first time we need them */
+static int
+uring_setup_bufring(struct uringop *uring)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+
+	if (uring->bufring)
+		return (uring->bufring == 1 ? 0 : -1);
+	uring->bufring = -1;
+
+	/* the kernel wants the ring page aligned */
+	uring->br_len = URING_NBUFS * sizeof(struct io_uring_buf);
+	uring->br = mmap(NULL, uring->br_len, PROT_READ|PROT_WRITE,
+	    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (uring->br == MAP_FAILED) {
+		uring->br = NULL;
+		return (-1);
+	}
+	if ((uring->bufs = malloc(URING_NBUFS * URING_BUFSIZE)) == NULL)
+		goto err;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)uring->br;
+	reg.ring_entries = URING_NBUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, uring->ringfd,
+		IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		goto err;
+
+	for (i = 0; i < URING_NBUFS; ++i)
+		uring_put_buf(uring, i);
+	uring->bufring = 1;
+	return (0);
+
+ err:
+	munmap(uring->br, uring->br_len);
+	uring->br = NULL;
+	if (uring->bufs != NULL) {
+		free(uring->bufs);
+		uring->bufs = NULL;
+	}
+	return (-1);
+}
+
+static struct uringop *
+uring_from_base(struct event_base *base)
+{
+	if (base == NULL || base->evsel != &iouringops)
+		return (NULL);
+	return (base->evbase);
+}
+
+/* Gets a submission queue entry for req and tracks req until it is done */
+static struct io_uring_sqe *
+uring_get_req_sqe(struct uringop *uring, struct evuring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_sqe(uring)) == NULL)
+		return (NULL);
+	sqe->user_data = URING_REQ_DATA(req);
+	if (!req->inflight) {
+		TAILQ_INSERT_TAIL(&uring->reqs, req, next);
+		req->inflight = 1;
+		/* the loop has to wait for it even without events */
+		event_base_add_virtual(uring->base);
+	}
+	return (sqe);
+}
+
+static int
+uring_submit_recv(struct uringop *uring, struct evuring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_get_req_sqe(uring, req)) == NULL)
+		return (-1);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = req->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	req->multishot = uring->recv_multishot;
+	if (req->multishot)
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	return (0);
+}
+
+/* Passes the result of a request to its owner */
+static void
+uring_req_complete(struct uringop *uring, struct io_uring_cqe *cqe)
+{
+	struct evuring_req *req = URING_REQ(cqe->user_data);
+	const char *data = NULL;
+	int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	int bid = -1;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		data = uring->bufs + bid * URING_BUFSIZE;
+	}
+
+	if (cqe->res == -EINVAL && req->multishot) {
+		/* an old kernel; recv once at a time */
+		uring->recv_multishot = 0;
+		if (uring_submit_recv(uring, req) == 0)
+			return;
+	}
+
+	if (!more) {
+		TAILQ_REMOVE(&uring->reqs, req, next);
+		req->inflight = 0;
+		event_base_del_virtual(uring->base);
+	}
+	/* the callback may free req */
+	(*req->cb)(req, cqe->res, data, more);
+	if (bid != -1)
+		uring_put_buf(uring, bid);
+}
+
+int
+evuring_available(struct event_base *base)
+{
+	struct uringop *uring;
+	int res = 0;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if ((uring = uring_from_base(base)) != NULL)
+		res = uring_setup_bufring(uring) == 0;
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (res);
+}
+
+/*
+ * Posts a recv on req->fd.  It stays in flight and completes once for
+ * every read, unless the kernel cannot do multishot recv.
+ */
+int
+evuring_recv(struct event_base *base, struct evuring_req *req)
+{
+	struct uringop *uring;
+	int res = -1;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if ((uring = uring_from_base(base)) != NULL &&
+	    uring_setup_bufring(uring) == 0)
+		res = uring_submit_recv(uring, req);
+	/* the loop submits it */
+	if (res == 0)
+		event_base_notify_loop(base);
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (res);
+}
+
+/* Posts a send of data on req->fd; data has to stay put until it is done */
+int
+evuring_send(struct event_base *base, struct evuring_req *req,
+    const void *data, size_t len)
+{
+	struct io_uring_sqe *sqe;
+	struct uringop *uring;
+	int res = -1;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if ((uring = uring_from_base(base)) != NULL &&
+	    (sqe = uring_get_req_sqe(uring, req)) != NULL) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t)(uintptr_t)data;
+		sqe->len = len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		req->multishot = 0;
+		res = 0;
+		event_base_notify_loop(base);
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+	return (res);
+}
+
+/* Asks the kernel to finish req early; it completes with -ECANCELED */
+void
+evuring_cancel(struct event_base *base, struct evuring_req *req)
+{
+	struct io_uring_sqe *sqe;
+	struct uringop *uring;
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+	if (req->inflight && (uring = uring_from_base(base)) != NULL) {
+		if ((sqe = uring_get_sqe(uring)) != NULL) {
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = URING_REQ_DATA(req);
+			sqe->user_data = URING_TAG_IGNORE;
+			event_base_notify_loop(base);
+		} else
+			event_warnx("%s: submission queue full", __func__);
+	}
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+}
+#endif /* HAVE_IO_URING_BUF_RING */
+
+static int
+uring_dispatch(struct event_base *base, void *arg, struct timeval *tv)
+{
+	struct uringop *uring = arg;
+	struct io_uring_cqe *cqe;
+	struct timespec ts, *ts_p = NULL;
+	unsigned head, tail, min_complete = 1;
+	int res;
+
+	uring_flush_changes(uring);
+
+	if (tv != NULL) {
+		if (!evutil_timerisset(tv))
+			min_complete = 0;
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		ts_p = &ts;
+	}
+	/* completions that are already there need no waiting */
+	if (*uring->cq_head != URING_LOAD_ACQUIRE(uring->cq_tail))
+		min_complete = 0;
+
+	/* other threads may queue entries while we wait; submit ours
+	 * while they cannot */
+	res = uring_submit(uring);
+	if (res == -1 && (errno == EBUSY || errno == EAGAIN)) {
+		/* the completion queue is full; drain it first */
+		min_complete = 0;
+		res = 0;
+	}
+
+	EVBASE_RELEASE_LOCK(base, th_base_lock);
+
+	if (res != -1)
+		res = uring_wait(uring, min_complete, ts_p);
+
+	EVBASE_ACQUIRE_LOCK(base, th_base_lock);
+
+	if (res == -1) {
+		if (errno == EINTR) {
+			evsignal_process(base);
+			return (0);
+		}
+		/* EBUSY: the completion queue is full; we drain it below */
+		if (errno != EBUSY && errno != EAGAIN) {
+			event_warn("io_uring_enter");
+			return (-1);
+		}
+	}
+	if (base->sig.evsignal_caught)
+		evsignal_process(base);
+
+	head = *uring->cq_head;
+	tail = URING_LOAD_ACQUIRE(uring->cq_tail);
+	event_debug(("%s: io_uring reports %u", __func__, tail - head));
+	for (; head != tail; ++head) {
+		cqe = &uring->cqes[head & *uring->cq_mask];
+		if (URING_TAG(cqe->user_data) == URING_TAG_POLL)
+			uring_poll_complete(uring, cqe);
+#ifdef HAVE_IO_URING_BUF_RING
+		else if (URING_TAG(cqe->user_data) == URING_TAG_REQ)
+			uring_req_complete(uring, cqe);
+#endif
+	}
+	URING_STORE_RELEASE(uring->cq_head, head);
+
+	return (0);
+}
+
+/* Makes ev responsible for the events that it waits for */
+static void
+uring_set_events(struct evuring *evu, struct event *ev)
+{
+	if (ev->ev_events & EV_READ)
+		evu->evread = ev;
+	if (ev->ev_events & EV_WRITE)
+		evu->evwrite = ev;
+	if (ev->ev_events & EV_CLOSED)
+		evu->evclosed = ev;
+}
+
+static int
+uring_add(void *arg, struct event *ev)
+{
+	struct uringop *uring = arg;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_add(ev));
+
+	fd = ev->ev_fd;
+	if (fd < 0)
+		return (-1);
+	if (fd >= uring->nfds && uring_recalc(uring, fd) == -1)
+		return (-1);
+
+	/* the kernel learns about it when we next enter */
+	if (uring_queue_change(uring, fd) == -1)
+		return (-1);
+	uring_set_events(&uring->fds[fd], ev);
+
+	return (0);
+}
+
+static int
+uring_del(void *arg, struct event *ev)
+{
+	struct uringop *uring = arg;
+	struct evuring *evu;
+	int fd;
+
+	if (ev->ev_events & EV_SIGNAL)
+		return (evsignal_del(ev));
+
+	fd = ev->ev_fd;
+	if (fd < 0 || fd >= uring->nfds)
+		return (0);
+	evu = &uring->fds[fd];
+
+	if (ev->ev_events & EV_READ)
+		evu->evread = NULL;
+	if (ev->ev_events & EV_WRITE)
+		evu->evwrite = NULL;
+	if (ev->ev_events & EV_CLOSED)
+		evu->evclosed = NULL;
+
+	if (evu->evread == NULL && evu->evwrite == NULL &&
+	    evu->evclosed == NULL)
+		evu->dropped = 1;
+	return (uring_queue_change(uring, fd));
+}
+
+static void
+uring_dealloc(struct event_base *base, void *arg)
+{
+	struct uringop *uring = arg;
+#ifdef HAVE_IO_URING_BUF_RING
+	struct evuring_req *req;
+#endif
+
+	evsignal_dealloc(base);
+	/* closing the ring cancels all requests */
+	uring_unmap(uring);
+	if (uring->ringfd >= 0)
+		close(uring->ringfd);
+#ifdef HAVE_IO_URING_BUF_RING
+	/* their owners may be waiting for them to go away */
+	while ((req = TAILQ_FIRST(&uring->reqs)) != NULL) {
+		TAILQ_REMOVE(&uring->reqs, req, next);
+		req->inflight = 0;
+		(*req->drop)(req);
+	}
+	if (uring->br != NULL)
+		munmap(uring->br, uring->br_len);
+	if (uring->bufs)
+		free(uring->bufs);
+#endif
+	if (uring->fds)
+		free(uring->fds);
+	if (uring->changes)
+		free(uring->changes);
+
+	memset(uring, 0, sizeof(struct uringop));
+	free(uring);
+}
@@ -27,6 +27,8 @@
 #ifndef _MIN_HEAP_H_
 #define _MIN_HEAP_H_
 
+#include <stdlib.h>
+
 #include "event.h"
 #include "evutil.h"
 
@@ -57,7 +59,7 @@ int min_heap_elem_greater(struct event *a, struct event *b)
 
 void min_heap_ctor(min_heap_t* s) { s->p = 0; s->n = 0; s->a = 0; }
 void min_heap_dtor(min_heap_t* s) { if(s->p) free(s->p); }
-void min_heap_elem_init(struct event* e) { e->min_heap_idx = -1; }
+void min_heap_elem_init(struct event* e) { e->ev_timeout_pos.min_heap_idx = -1; }
 int min_heap_empty(min_heap_t* s) { return 0u == s->n; }
 unsigned min_heap_size(min_heap_t* s) { return s->n; }
 struct event* min_heap_top(min_heap_t* s) { return s->n ? *s->p : 0; }
@@ -76,7 +78,7 @@ struct event* min_heap_pop(min_heap_t* s)
     {
         struct event* e = *s->p;
         min_heap_shift_down_(s, 0u, s->p[--s->n]);
-        e->min_heap_idx = -1;
+        e->ev_timeout_pos.min_heap_idx = -1;
         return e;
     }
     return 0;
@@ -84,20 +86,20 @@ struct event* min_heap_pop(min_heap_t* s)
 
 int min_heap_erase(min_heap_t* s, struct event* e)
 {
-    if(((unsigned int)-1) != e->min_heap_idx)
+    if(((unsigned int)-1) != e->ev_timeout_pos.min_heap_idx)
     {
         struct event *last = s->p[--s->n];
-        unsigned parent = (e->min_heap_idx - 1) / 2;
+        unsigned parent = (e->ev_timeout_pos.min_heap_idx - 1) / 2;
 	/* we replace e with the last element in the heap.  We might need to
 	   shift it upward if it is less than its parent, or downward if it is
 	   greater than one or both its children. Since the children are known
 	   to be less than the parent, it can't need to shift both up and
 	   down. */
-        if (e->min_heap_idx > 0 && min_heap_elem_greater(s->p[parent], last))
-             min_heap_shift_up_(s, e->min_heap_idx, last);
+        if (e->ev_timeout_pos.min_heap_idx > 0 && min_heap_elem_greater(s->p[parent], last))
+             min_heap_shift_up_(s, e->ev_timeout_pos.min_heap_idx, last);
         else
-             min_heap_shift_down_(s, e->min_heap_idx, last);
-        e->min_heap_idx = -1;
+             min_heap_shift_down_(s, e->ev_timeout_pos.min_heap_idx, last);
+        e->ev_timeout_pos.min_heap_idx = -1;
         return 0;
     }
     return -1;
@@ -124,11 +126,11 @@ void min_heap_shift_up_(min_heap_t* s, unsigned hole_index, struct event* e)
     unsigned parent = (hole_index - 1) / 2;
     while(hole_index && min_heap_elem_greater(s->p[parent], e))
     {
-        (s->p[hole_index] = s->p[parent])->min_heap_idx = hole_index;
+        (s->p[hole_index] = s->p[parent])->ev_timeout_pos.min_heap_idx = hole_index;
         hole_index = parent;
         parent = (hole_index - 1) / 2;
     }
-    (s->p[hole_index] = e)->min_heap_idx = hole_index;
+    (s->p[hole_index] = e)->ev_timeout_pos.min_heap_idx = hole_index;
 }
 
 void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e)
@@ -139,11 +141,173 @@ void min_heap_shift_down_(min_heap_t* s, unsigned hole_index, struct event* e)
         min_child -= min_child == s->n || min_heap_elem_greater(s->p[min_child], s->p[min_child - 1]);
         if(!(min_heap_elem_greater(e, s->p[min_child])))
             break;
-        (s->p[hole_index] = s->p[min_child])->min_heap_idx = hole_index;
+        (s->p[hole_index] = s->p[min_child])->ev_timeout_pos.min_heap_idx = hole_index;
         hole_index = min_child;
         min_child = 2 * (hole_index + 1);
 	}
     min_heap_shift_up_(s, hole_index,  e);
 }
 
+/*
+ * A d-ary min-heap that keeps each expiry as a 64-bit nanosecond key next
+ * to its event pointer.  The caller computes the key, normally with
+ * min_dheap_key() from the event's ev_timeout.  Sifting only compares keys stored in the heap
+ * array itself, so it never has to follow a pointer into a struct event
+ * just to read ev_timeout.  With the default arity of 4 all children of
+ * a node fit into one cache line, and the heap is half as deep as the
+ * binary one above.
+ */
+#ifndef MIN_DHEAP_ARITY
+#define MIN_DHEAP_ARITY 4
+#endif
+
+struct min_dheap_entry
+{
+    ev_uint64_t key;
+    struct event* e;
+};
+
+typedef struct min_dheap
+{
+    struct min_dheap_entry* p;
+    unsigned n, a;
+} min_dheap_t;
+
+static inline ev_uint64_t    min_dheap_key(const struct timeval* tv);
+static inline void           min_dheap_ctor(min_dheap_t* s);
+static inline void           min_dheap_dtor(min_dheap_t* s);
+static inline int            min_dheap_empty(min_dheap_t* s);
+static inline unsigned       min_dheap_size(min_dheap_t* s);
+static inline struct event*  min_dheap_top(min_dheap_t* s);
+static inline int            min_dheap_reserve(min_dheap_t* s, unsigned n);
+static inline int            min_dheap_push(min_dheap_t* s, struct event* e, ev_uint64_t key);
+static inline struct event*  min_dheap_pop(min_dheap_t* s);
+static inline int            min_dheap_erase(min_dheap_t* s, struct event* e);
+static inline int            min_dheap_adjust(min_dheap_t* s, struct event* e, ev_uint64_t key);
+static inline void           min_dheap_shift_up_(min_dheap_t* s, unsigned hole_index, struct min_dheap_entry x);
+static inline void           min_dheap_shift_down_(min_dheap_t* s, unsigned hole_index, struct min_dheap_entry x);
+
+ev_uint64_t min_dheap_key(const struct timeval* tv)
+{
+    return (ev_uint64_t)tv->tv_sec * 1000000000 + (ev_uint64_t)tv->tv_usec * 1000;
+}
+
+void min_dheap_ctor(min_dheap_t* s) { s->p = 0; s->n = 0; s->a = 0; }
+void min_dheap_dtor(min_dheap_t* s) { if(s->p) free(s->p); }
+int min_dheap_empty(min_dheap_t* s) { return 0u == s->n; }
+unsigned min_dheap_size(min_dheap_t* s) { return s->n; }
+struct event* min_dheap_top(min_dheap_t* s) { return s->n ? s->p->e : 0; }
+
+int min_dheap_push(min_dheap_t* s, struct event* e, ev_uint64_t key)
+{
+    struct min_dheap_entry x;
+    if(min_dheap_reserve(s, s->n + 1))
+        return -1;
+    x.key = key;
+    x.e = e;
+    min_dheap_shift_up_(s, s->n++, x);
+    return 0;
+}
+
+struct event* min_dheap_pop(min_dheap_t* s)
+{
+    if(s->n)
+    {
+        struct event* e = s->p->e;
+        min_dheap_shift_down_(s, 0u, s->p[--s->n]);
+        e->ev_timeout_pos.min_heap_idx = -1;
+        return e;
+    }
+    return 0;
+}
+
+int min_dheap_erase(min_dheap_t* s, struct event* e)
+{
+    unsigned idx = e->ev_timeout_pos.min_heap_idx;
+    if(((unsigned int)-1) != idx)
+    {
+        struct min_dheap_entry last = s->p[--s->n];
+        unsigned parent = (idx - 1) / MIN_DHEAP_ARITY;
+        /* as in min_heap_erase(), the last entry takes the place of e and
+           needs to move either up or down, but never both. */
+        if (idx > 0 && s->p[parent].key > last.key)
+            min_dheap_shift_up_(s, idx, last);
+        else
+            min_dheap_shift_down_(s, idx, last);
+        e->ev_timeout_pos.min_heap_idx = -1;
+        return 0;
+    }
+    return -1;
+}
+
+/* moves e to its place for a new key, restoring the heap order */
+int min_dheap_adjust(min_dheap_t* s, struct event* e, ev_uint64_t key)
+{
+    unsigned idx = e->ev_timeout_pos.min_heap_idx;
+    if(((unsigned int)-1) != idx)
+    {
+        struct min_dheap_entry x;
+        x.key = key;
+        x.e = e;
+        if (idx > 0 && s->p[(idx - 1) / MIN_DHEAP_ARITY].key > x.key)
+            min_dheap_shift_up_(s, idx, x);
+        else
+            min_dheap_shift_down_(s, idx, x);
+        return 0;
+    }
+    return -1;
+}
+
+int min_dheap_reserve(min_dheap_t* s, unsigned n)
+{
+    if(s->a < n)
+    {
+        struct min_dheap_entry* p;
+        unsigned a = s->a ? s->a * 2 : 8;
+        if(a < n)
+            a = n;
+        if(!(p = (struct min_dheap_entry*)realloc(s->p, a * sizeof *p)))
+            return -1;
+        s->p = p;
+        s->a = a;
+    }
+    return 0;
+}
+
+void min_dheap_shift_up_(min_dheap_t* s, unsigned hole_index, struct min_dheap_entry x)
+{
+    unsigned parent = (hole_index - 1) / MIN_DHEAP_ARITY;
+    while(hole_index && s->p[parent].key > x.key)
+    {
+        s->p[hole_index] = s->p[parent];
+        s->p[hole_index].e->ev_timeout_pos.min_heap_idx = hole_index;
+        hole_index = parent;
+        parent = (hole_index - 1) / MIN_DHEAP_ARITY;
+    }
+    s->p[hole_index] = x;
+    x.e->ev_timeout_pos.min_heap_idx = hole_index;
+}
+
+void min_dheap_shift_down_(min_dheap_t* s, unsigned hole_index, struct min_dheap_entry x)
+{
+    unsigned child, end, i, min_child;
+    while((child = hole_index * MIN_DHEAP_ARITY + 1) < s->n)
+    {
+        end = child + MIN_DHEAP_ARITY;
+        if(end > s->n)
+            end = s->n;
+        min_child = child;
+        for(i = child + 1; i < end; ++i)
+            if(s->p[i].key < s->p[min_child].key)
+                min_child = i;
+        if(!(x.key > s->p[min_child].key))
+            break;
+        s->p[hole_index] = s->p[min_child];
+        s->p[hole_index].e->ev_timeout_pos.min_heap_idx = hole_index;
+        hole_index = min_child;
+    }
+    s->p[hole_index] = x;
+    x.e->ev_timeout_pos.min_heap_idx = hole_index;
+}
+
 #endif /* _MIN_HEAP_H_ */
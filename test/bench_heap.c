@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compares the binary timer heap (min_heap_t) against the d-ary heap with
+ * inline keys (min_dheap_t) that event_base uses for its timeouts.
+ *
+ * For each heap size, all timers are inserted, a random half of them is
+ * erased, and the rest is popped in order.  Every struct event is
+ * allocated separately, as it would be in a real program.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event.h>
+#include <evutil.h>
+#include "min_heap.h"
+
+static struct event **events;
+static unsigned *order;
+
+static double
+elapsed_ns(struct timeval *start, unsigned nops)
+{
+	struct timeval end, diff;
+
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, start, &diff);
+	return ((diff.tv_sec * 1000000.0 + diff.tv_usec) * 1000.0 / nops);
+}
+
+static void
+setup(unsigned n)
+{
+	unsigned i, j, tmp;
+
+	for (i = 0; i < n; ++i) {
+		struct event *ev = events[i];
+		memset(ev, 0, sizeof(*ev));
+		ev->ev_timeout.tv_sec = random() % 3600;
+		ev->ev_timeout.tv_usec = random() % 1000000;
+		ev->ev_timeout_pos.min_heap_idx = -1;
+		order[i] = i;
+	}
+	/* erase in random order */
+	for (i = n - 1; i > 0; --i) {
+		j = random() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+}
+
+static void
+run_binary(unsigned n)
+{
+	min_heap_t heap;
+	struct timeval start;
+	double push, erase, pop;
+	unsigned i;
+
+	setup(n);
+	min_heap_ctor(&heap);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i)
+		min_heap_push(&heap, events[i]);
+	push = elapsed_ns(&start, n);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n / 2; ++i)
+		min_heap_erase(&heap, events[order[i]]);
+	erase = elapsed_ns(&start, n / 2);
+
+	evutil_gettimeofday(&start, NULL);
+	while (min_heap_pop(&heap) != NULL)
+		;
+	pop = elapsed_ns(&start, n - n / 2);
+
+	min_heap_dtor(&heap);
+	printf("%8u  %-10s %10.1f %10.1f %10.1f\n",
+	    n, "binary", push, erase, pop);
+}
+
+static void
+run_dary(unsigned n)
+{
+	min_dheap_t heap;
+	struct timeval start;
+	double push, erase, pop;
+	unsigned i;
+
+	setup(n);
+	min_dheap_ctor(&heap);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n; ++i)
+		min_dheap_push(&heap, events[i],
+		    min_dheap_key(&events[i]->ev_timeout));
+	push = elapsed_ns(&start, n);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < n / 2; ++i)
+		min_dheap_erase(&heap, events[order[i]]);
+	erase = elapsed_ns(&start, n / 2);
+
+	evutil_gettimeofday(&start, NULL);
+	while (min_dheap_pop(&heap) != NULL)
+		;
+	pop = elapsed_ns(&start, n - n / 2);
+
+	min_dheap_dtor(&heap);
+	printf("%8u  %-10s %10.1f %10.1f %10.1f\n",
+	    n, MIN_DHEAP_ARITY == 4 ? "4-ary" : "d-ary", push, erase, pop);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const unsigned sizes[] = { 10000, 100000, 1000000 };
+	unsigned i, max = sizes[sizeof(sizes)/sizeof(sizes[0]) - 1];
+
+	srandom(0);
+
+	events = calloc(max, sizeof(struct event *));
+	order = calloc(max, sizeof(unsigned));
+	if (events == NULL || order == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (i = 0; i < max; ++i) {
+		if ((events[i] = malloc(sizeof(struct event))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+	}
+
+	printf("%8s  %-10s %10s %10s %10s\n",
+	    "timers", "heap", "insert/ns", "erase/ns", "pop/ns");
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+		run_binary(sizes[i]);
+		run_dary(sizes[i]);
+	}
+
+	for (i = 0; i < max; ++i)
+		free(events[i]);
+	free(events);
+	free(order);
+
+	exit(0);
+}
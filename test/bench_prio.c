@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measures the cost of one event loop iteration that runs a single active
+ * event, as the number of priorities grows.  The event has the lowest
+ * priority, which is the worst case for finding the first non-empty
+ * active queue.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <event.h>
+#include <evutil.h>
+
+#define ITERATIONS	200000
+
+static int called;
+
+static void
+active_cb(int fd, short event, void *arg)
+{
+	++called;
+}
+
+static void
+run(int npriorities)
+{
+	struct event_base *base;
+	struct event ev;
+	struct timeval start, end, diff;
+	int i;
+
+	if ((base = event_base_new()) == NULL ||
+	    event_base_priority_init(base, npriorities) == -1) {
+		fprintf(stderr, "cannot set up a base with %d priorities\n",
+		    npriorities);
+		exit(1);
+	}
+	event_set(&ev, -1, 0, active_cb, NULL);
+	event_base_set(base, &ev);
+	event_priority_set(&ev, npriorities - 1);
+
+	called = 0;
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < ITERATIONS; ++i) {
+		event_active(&ev, EV_TIMEOUT, 1);
+		event_base_loop(base, EVLOOP_NONBLOCK);
+	}
+	evutil_gettimeofday(&end, NULL);
+	evutil_timersub(&end, &start, &diff);
+
+	if (called != ITERATIONS) {
+		fprintf(stderr, "callback ran %d times, expected %d\n",
+		    called, ITERATIONS);
+		exit(1);
+	}
+	printf("%10d %14.1f\n", npriorities,
+	    (diff.tv_sec * 1000000.0 + diff.tv_usec) * 1000.0 / ITERATIONS);
+
+	event_base_free(base);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int npriorities[] = { 1, 4, 32, 256, 1024, 4096 };
+	unsigned i;
+
+	printf("%10s %14s\n", "priorities", "iteration/ns");
+	for (i = 0; i < sizeof(npriorities)/sizeof(npriorities[0]); ++i)
+		run(npriorities[i]);
+
+	exit(0);
+}
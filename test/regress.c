@@ -42,6 +42,9 @@
 #ifdef EVENT__HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
+#ifdef EVENT__HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
 #include <sys/queue.h>
 #ifndef _WIN32
 #include <sys/socket.h>
@@ -640,6 +643,48 @@ end:
 	event_del(&ev);
 }
 
+struct periodic_aligned_info {
+	struct event ev;
+	struct timeval called_at[4];
+	int n;
+};
+
+static void
+periodic_aligned_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct periodic_aligned_info *info = arg;
+	struct timeval msec30 = { 0, 30 * 1000 };
+
+	evutil_gettimeofday(&info->called_at[info->n], NULL);
+	if (++info->n == 4)
+		event_del(&info->ev);
+	/* a slow callback must not delay the next expiration */
+	evutil_usleep_(&msec30);
+}
+
+static void
+test_periodic_timer_aligned(void *ptr)
+{
+	struct basic_test_data *data = ptr;
+	struct periodic_aligned_info info;
+	struct timeval msec100 = { 0, 100 * 1000 };
+	struct timeval start;
+	int i;
+
+	memset(&info, 0, sizeof(info));
+	evperiodic_set(&info.ev, periodic_aligned_cb, &info);
+	event_base_set(data->base, &info.ev);
+	evutil_gettimeofday(&start, NULL);
+	event_add(&info.ev, &msec100);
+	event_base_dispatch(data->base);
+
+	tt_int_op(info.n, ==, 4);
+	for (i = 0; i < 4; ++i)
+		test_timeval_diff_eq(&start, &info.called_at[i], (i + 1) * 100);
+end:
+	;
+}
+
 struct persist_active_timeout_called {
 	int n;
 	short events[16];
@@ -817,6 +862,317 @@ end:
 	data->base = NULL;
 }
 
+static void
+timer_wheel_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct common_timeout_info *ti = arg;
+	++ti->count;
+	evutil_gettimeofday(&ti->called_at, NULL);
+}
+
+/* The tests of base options build a base of their own: config_setup
+ * hands them an event_config to fill in, config_base_new() builds the
+ * base from it, and both are freed after the test. */
+struct config_test_data {
+	struct event_config *cfg;
+	struct event_base *base;
+};
+
+static void *
+config_test_setup(const struct testcase_t *testcase)
+{
+	struct config_test_data *data = calloc(1, sizeof(*data));
+
+	if (data == NULL)
+		return (NULL);
+	if ((data->cfg = event_config_new()) == NULL) {
+		free(data);
+		return (NULL);
+	}
+	return (data);
+}
+
+static int
+config_test_cleanup(const struct testcase_t *testcase, void *ptr)
+{
+	struct config_test_data *data = ptr;
+
+	if (data->base)
+		event_base_free(data->base);
+	event_config_free(data->cfg);
+	free(data);
+	return (1);
+}
+
+static const struct testcase_setup_t config_setup = {
+	config_test_setup, config_test_cleanup
+};
+
+static struct event_base *
+config_base_new(struct config_test_data *data)
+{
+	data->base = event_base_new_with_config(data->cfg);
+	return (data->base);
+}
+
+static void
+test_timer_wheel(void *ptr)
+{
+	struct config_test_data *data = ptr;
+	struct event_base *base;
+	struct common_timeout_info info[64];
+	struct timeval start, tv;
+	int i;
+
+	tt_int_op(event_config_set_flag(data->cfg,
+		EVENT_BASE_FLAG_TIMER_WHEEL), ==, 0);
+	base = config_base_new(data);
+	tt_assert(base);
+
+	memset(info, 0, sizeof(info));
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 64; ++i) {
+		event_assign(&info[i].ev, base, -1, 0, timer_wheel_cb,
+		    &info[i]);
+		/* spread the timeouts over more than one level 0 rotation */
+		tv.tv_sec = 0;
+		tv.tv_usec = (i % 4 + 1) * 100 * 1000;
+		event_add(&info[i].ev, &tv);
+	}
+	/* deleted and rescheduled timeouts must leave the wheel intact */
+	for (i = 0; i < 64; i += 8)
+		event_del(&info[i].ev);
+	tv.tv_sec = 0;
+	tv.tv_usec = 50 * 1000;
+	event_add(&info[1].ev, &tv);
+
+	event_base_dispatch(base);
+
+	for (i = 0; i < 64; ++i) {
+		if (i % 8 == 0) {
+			tt_int_op(info[i].count, ==, 0);
+			continue;
+		}
+		tt_int_op(info[i].count, ==, 1);
+		test_timeval_diff_eq(&start, &info[i].called_at,
+		    i == 1 ? 50 : (i % 4 + 1) * 100);
+	}
+
+end:
+	;
+}
+
+/* one of the timers of test_timer_slack */
+struct slack_timer {
+	struct event ev;
+	struct timeval deadline;
+	int count;
+	int early;	/* fired before its deadline */
+	int *fired;
+};
+
+static void
+slack_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct slack_timer *t = arg;
+	struct timeval now;
+
+	evutil_gettimeofday(&now, NULL);
+	if (evutil_timercmp(&now, &t->deadline, <))
+		t->early = 1;
+	++t->count;
+	++*t->fired;
+}
+
+static void
+test_timer_slack(void *ptr)
+{
+	struct config_test_data *data = ptr;
+	struct event_base *base;
+	struct slack_timer timers[10];
+	struct timeval start, tv;
+	int i, fired = 0, wakeups;
+
+	memset(timers, 0, sizeof(timers));
+	tv.tv_sec = 0;
+	tv.tv_usec = -1;
+	tt_int_op(event_config_set_timer_slack(data->cfg, &tv), ==, -1);
+	tv.tv_usec = 50 * 1000;
+	tt_int_op(event_config_set_timer_slack(data->cfg, &tv), ==, 0);
+	base = config_base_new(data);
+	tt_assert(base);
+
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 10; ++i) {
+		event_assign(&timers[i].ev, base, -1, 0, slack_timer_cb,
+		    &timers[i]);
+		timers[i].fired = &fired;
+		tv.tv_sec = 0;
+		tv.tv_usec = (20 + 2 * i) * 1000;
+		evutil_timeradd(&start, &tv, &timers[i].deadline);
+		event_add(&timers[i].ev, &tv);
+	}
+
+	/* the slack rounds deadlines up to a grain of 2^25ns; the 18ms
+	 * between the first and the last one span at most two of them */
+	for (wakeups = 0; wakeups < 10 && fired < 10; ++wakeups)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(fired, ==, 10);
+	tt_int_op(wakeups, <=, 2);
+
+	for (i = 0; i < 10; ++i) {
+		tt_int_op(timers[i].count, ==, 1);
+		tt_assert(!timers[i].early);
+	}
+
+end:
+	/* the base is freed after timers went out of scope */
+	for (i = 0; i < 10; ++i)
+		event_del(&timers[i].ev);
+}
+
+/* one of the timers of test_precise_timer */
+struct precise_timer {
+	struct event ev;
+	struct timeval deadline;
+	struct timeval late;	/* how long after the deadline it fired */
+	int count;
+	int early;
+};
+
+static void
+precise_timer_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct precise_timer *t = arg;
+	struct timeval now;
+
+	evutil_gettimeofday(&now, NULL);
+	if (evutil_timercmp(&now, &t->deadline, <))
+		t->early = 1;
+	else
+		evutil_timersub(&now, &t->deadline, &t->late);
+	++t->count;
+}
+
+static void
+test_precise_timer(void *ptr)
+{
+	struct config_test_data *data = ptr;
+	struct event_base *base;
+	struct precise_timer timers[4];
+	struct timeval start, tv;
+	int i;
+
+	tt_int_op(event_config_set_flag(data->cfg,
+		EVENT_BASE_FLAG_PRECISE_TIMER), ==, 0);
+	base = config_base_new(data);
+	tt_assert(base);
+	/* only epoll sleeps on a timerfd, if the kernel gives it one; the
+	 * others round to the precision of their wait */
+#ifdef EVENT__HAVE_SYS_TIMERFD_H
+	{
+		int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (fd == -1)
+			tt_skip();
+		close(fd);
+	}
+#else
+	tt_skip();
+#endif
+	if (strcmp(event_base_get_method(base), "epoll"))
+		tt_skip();
+
+	memset(timers, 0, sizeof(timers));
+	evutil_gettimeofday(&start, NULL);
+	for (i = 0; i < 4; ++i) {
+		event_assign(&timers[i].ev, base, -1, 0, precise_timer_cb,
+		    &timers[i]);
+		/* sub-millisecond timeouts, and one that is due right away */
+		tv.tv_sec = 0;
+		tv.tv_usec = i * 250;
+		evutil_timeradd(&start, &tv, &timers[i].deadline);
+		event_add(&timers[i].ev, &tv);
+	}
+
+	event_base_dispatch(base);
+
+	for (i = 0; i < 4; ++i) {
+		tt_int_op(timers[i].count, ==, 1);
+		tt_assert(!timers[i].early);
+		/* rounding to milliseconds would make them a lot later */
+		tt_int_op(timers[i].late.tv_sec, ==, 0);
+		tt_int_op(timers[i].late.tv_usec, <, 500);
+	}
+
+end:
+	;
+}
+
+static struct timeval fake_clock_now;
+
+static int
+fake_clock(struct timeval *tv, void *arg)
+{
+	++*(int *)arg;
+	*tv = fake_clock_now;
+	return (0);
+}
+
+/* the timer of test_clock_fn, and the cached time it fired at */
+struct clock_fn_timer {
+	struct event ev;
+	struct timeval called_at;
+	int count;
+};
+
+static void
+clock_fn_cb(evutil_socket_t fd, short event, void *arg)
+{
+	struct clock_fn_timer *t = arg;
+
+	++t->count;
+	event_base_gettime_cached(event_get_base(&t->ev), &t->called_at);
+}
+
+static void
+test_clock_fn(void *ptr)
+{
+	struct config_test_data *data = ptr;
+	struct event_base *base;
+	struct clock_fn_timer timer;
+	struct timeval tv;
+	int calls = 0;
+
+	memset(&timer, 0, sizeof(timer));
+	tt_int_op(event_config_set_clock(data->cfg, -1), ==, -1);
+	tt_int_op(event_config_set_clock(data->cfg, EVENT_CLOCK_MONOTONIC),
+	    ==, 0);
+	fake_clock_now.tv_sec = 1000;
+	fake_clock_now.tv_usec = 0;
+	tt_int_op(event_config_set_clock_fn(data->cfg, fake_clock, &calls),
+	    ==, 0);
+	base = config_base_new(data);
+	tt_assert(base);
+	tt_int_op(calls, >, 0);
+
+	event_assign(&timer.ev, base, -1, 0, clock_fn_cb, &timer);
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	event_add(&timer.ev, &tv);
+
+	/* the timeout only depends on what the clock says */
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(timer.count, ==, 0);
+	fake_clock_now.tv_sec += 5;
+	event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(timer.count, ==, 1);
+	tt_int_op(timer.called_at.tv_sec, ==, 1005);
+	tt_int_op(timer.called_at.tv_usec, ==, 0);
+
+end:
+	event_del(&timer.ev);
+}
+
 #ifndef _WIN32
 
 #define current_base event_global_current_base_
@@ -2285,106 +2641,1131 @@ end:
 }
 
 
+/* priority-drr: a busy high priority must not starve the lower ones. */
+static struct event drr_events[3];
+static int drr_calls[3];
+static int drr_order[32];
+static int n_drr_calls = 0;
+
 static void
-test_multiple_cb(evutil_socket_t fd, short event, void *arg)
+priority_drr_cb(evutil_socket_t fd, short what, void *arg)
 {
-	if (event & EV_READ)
-		test_ok |= 1;
-	else if (event & EV_WRITE)
-		test_ok |= 2;
+	int pri = *(int *)arg;
+
+	++drr_calls[pri];
+	drr_order[n_drr_calls++] = pri;
+	if (n_drr_calls == 32)
+		event_base_loopbreak(event_get_base(&drr_events[pri]));
+	else
+		event_active(&drr_events[pri], EV_READ, 1);
 }
 
 static void
-test_multiple_events_for_same_fd(void)
+test_priority_drr(void *data_)
 {
-   struct event e1, e2;
-
-   setup_test("Multiple events for same fd: ");
-
-   event_set(&e1, pair[0], EV_READ, test_multiple_cb, NULL);
-   event_add(&e1, NULL);
-   event_set(&e2, pair[0], EV_WRITE, test_multiple_cb, NULL);
-   event_add(&e2, NULL);
-   event_loop(EVLOOP_ONCE);
-   event_del(&e2);
-
-   if (write(pair[1], TEST1, strlen(TEST1)+1) < 0) {
-	   tt_fail_perror("write");
-   }
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	static int pris[3] = { 0, 1, 2 };
+	int weights[3] = { 4, 2, 1 };
+	int bad[3] = { 4, 0, 1 };
+	int i;
 
-   event_loop(EVLOOP_ONCE);
-   event_del(&e1);
+	tt_int_op(event_base_priority_init(base, 3), ==, 0);
+	tt_int_op(event_base_priority_set_policy(base, EVENT_PRIORITY_DRR,
+		bad), ==, -1);
+	tt_int_op(event_base_priority_set_policy(base, EVENT_PRIORITY_DRR,
+		weights), ==, 0);
+
+	n_drr_calls = 0;
+	memset(drr_calls, 0, sizeof(drr_calls));
+	for (i = 0; i < 3; ++i) {
+		event_assign(&drr_events[i], base, -1, 0, priority_drr_cb,
+		    &pris[i]);
+		event_priority_set(&drr_events[i], i);
+		event_active(&drr_events[i], EV_READ, 1);
+	}
 
-   if (test_ok != 3)
-	   test_ok = 0;
+	event_base_dispatch(base);
 
-   cleanup_test();
+	/* every iteration runs 4, 2 and 1 callbacks, in priority order */
+	for (i = 0; i < 28; ++i) {
+		int expect = i % 7 < 4 ? 0 : i % 7 < 6 ? 1 : 2;
+		tt_int_op(drr_order[i], ==, expect);
+	}
+	tt_int_op(drr_calls[0], ==, 4 * 4 + 4);
+	tt_int_op(drr_calls[1], ==, 4 * 2);
+	tt_int_op(drr_calls[2], ==, 4 * 1);
+end:
+	;
 }
 
-int evtag_decode_int(ev_uint32_t *pnumber, struct evbuffer *evbuf);
-int evtag_decode_int64(ev_uint64_t *pnumber, struct evbuffer *evbuf);
-int evtag_encode_tag(struct evbuffer *evbuf, ev_uint32_t number);
-int evtag_decode_tag(ev_uint32_t *pnumber, struct evbuffer *evbuf);
+/* The changelist delays epoll_ctl() until the loop waits; an fd that is
+ * closed and reopened with the same number meanwhile must still work. */
+static int n_reopen_writes = 0;
+static int n_reopen_reads = 0;
 
 static void
-read_once_cb(evutil_socket_t fd, short event, void *arg)
+changelist_write_cb(evutil_socket_t fd, short what, void *arg)
 {
-	char buf[256];
-	int len;
-
-	len = read(fd, buf, sizeof(buf));
-
-	if (called) {
-		test_ok = 0;
-	} else if (len) {
-		/* Assumes global pair[0] can be used for writing */
-		if (write(pair[0], TEST1, strlen(TEST1)+1) < 0) {
-			tt_fail_perror("write");
-			test_ok = 0;
-		} else {
-			test_ok = 1;
-		}
-	}
+	struct event *ev = arg;
 
-	called++;
+	/* delete and add again, the way bufferevents do */
+	event_del(ev);
+	event_add(ev, NULL);
+	if (++n_reopen_writes == 10)
+		event_del(ev);
 }
 
 static void
-test_want_only_once(void)
+changelist_read_cb(evutil_socket_t fd, short what, void *arg)
 {
-	struct event ev;
-	struct timeval tv;
-
-	/* Very simple read test */
-	setup_test("Want read only once: ");
+	char buf[16];
 
-	if (write(pair[0], TEST1, strlen(TEST1)+1) < 0) {
-		tt_fail_perror("write");
-	}
+	if (read(fd, buf, sizeof(buf)) > 0)
+		++n_reopen_reads;
+}
 
-	/* Setup the loop termination */
-	evutil_timerclear(&tv);
-	tv.tv_usec = 300*1000;
-	event_loopexit(&tv);
+static void
+test_changelist_reopen(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event wev, rev;
+	evutil_socket_t fd = data->pair[0];
 
-	event_set(&ev, pair[1], EV_READ, read_once_cb, &ev);
-	if (event_add(&ev, NULL) == -1)
-		exit(1);
-	event_dispatch();
+	event_assign(&wev, base, fd, EV_WRITE|EV_PERSIST, changelist_write_cb,
+	    &wev);
+	event_add(&wev, NULL);
+	event_base_dispatch(base);
+	tt_int_op(n_reopen_writes, ==, 10);
 
-	cleanup_test();
+	/* the same fd number, but a new socket that the kernel has not seen */
+	event_assign(&rev, base, fd, EV_READ|EV_PERSIST, changelist_read_cb,
+	    NULL);
+	event_add(&rev, NULL);
+	event_del(&rev);
+	evutil_closesocket(data->pair[0]);
+	evutil_closesocket(data->pair[1]);
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, data->pair), ==,
+	    0);
+	tt_int_op(data->pair[0], ==, fd);
+	event_add(&rev, NULL);
+
+	tt_int_op(write(data->pair[1], "x", 1), ==, 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_reopen_reads, ==, 1);
+	event_del(&rev);
+end:
+	;
 }
 
-#define TEST_MAX_INT	6
+/* An EV_ET event fires once per edge; a level-triggered one on every loop
+ * while data is left unread. */
+static void
+edge_triggered_cb(evutil_socket_t fd, short what, void *arg)
+{
+	++*(int *)arg;
+}
 
 static void
-evtag_int_test(void *ptr)
+test_edge_triggered(void *data_)
 {
-	struct evbuffer *tmp = evbuffer_new();
-	ev_uint32_t integers[TEST_MAX_INT] = {
-		0xaf0, 0x1000, 0x1, 0xdeadbeef, 0x00, 0xbef000
-	};
-	ev_uint32_t integer;
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event et, lt, wev;
+	evutil_socket_t pair2[2] = { -1, -1 };
+	int n_et = 0, n_lt = 0, i;
+
+	if (!(event_base_get_features(base) & EV_FEATURE_ET)) {
+		event_assign(&et, base, data->pair[0], EV_READ|EV_ET,
+		    edge_triggered_cb, &n_et);
+		tt_int_op(event_add(&et, NULL), ==, -1);
+		tt_skip();
+	}
+
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair2), ==, 0);
+	event_assign(&et, base, data->pair[0], EV_READ|EV_PERSIST|EV_ET,
+	    edge_triggered_cb, &n_et);
+	event_assign(&lt, base, pair2[0], EV_READ|EV_PERSIST,
+	    edge_triggered_cb, &n_lt);
+	tt_int_op(event_add(&et, NULL), ==, 0);
+	tt_int_op(event_add(&lt, NULL), ==, 0);
+
+	tt_int_op(write(data->pair[1], "xx", 2), ==, 2);
+	tt_int_op(write(pair2[1], "xx", 2), ==, 2);
+	for (i = 0; i < 5; ++i)
+		event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n_et, ==, 1);
+	tt_int_op(n_lt, ==, 5);
+
+	/* more data is a new edge */
+	tt_int_op(write(data->pair[1], "x", 1), ==, 1);
+	for (i = 0; i < 5; ++i)
+		event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n_et, ==, 2);
+
+	/* one fd cannot be both */
+	event_assign(&wev, base, data->pair[0], EV_WRITE,
+	    edge_triggered_cb, &n_et);
+	tt_int_op(event_add(&wev, NULL), ==, -1);
+
+	event_del(&et);
+	event_del(&lt);
+end:
+	if (pair2[0] != -1)
+		evutil_closesocket(pair2[0]);
+	if (pair2[1] != -1)
+		evutil_closesocket(pair2[1]);
+}
+
+/* A level-triggered event fires again while a callback leaves data
+ * unread, without the peer sending more. */
+static void
+level_triggered_cb(evutil_socket_t fd, short what, void *arg)
+{
+	char c;
+
+	if ((what & EV_READ) && read(fd, &c, 1) == 1)
+		++*(int *)arg;
+}
+
+static void
+test_level_triggered(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event ev;
+	struct timeval tv = { 1, 0 };
+	int n_reads = 0, i;
+
+	tt_int_op(write(data->pair[1], "12345678", 8), ==, 8);
+	/* on a stall the timeout ends the loop without a read */
+	event_assign(&ev, base, data->pair[0], EV_READ|EV_PERSIST,
+	    level_triggered_cb, &n_reads);
+	tt_int_op(event_add(&ev, &tv), ==, 0);
+	for (i = 0; i < 8 && n_reads == i; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_reads, ==, 8);
+
+	event_del(&ev);
+end:
+	;
+}
+
+/* EV_CLOSED ignores data and fires once the peer shuts its side down. */
+static int closed_res = 0;
+
+static void
+closed_event_cb(evutil_socket_t fd, short what, void *arg)
+{
+	++*(int *)arg;
+	closed_res = what;
+}
+
+static void
+test_closed_event(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event ev;
+	int n_calls = 0, i;
+
+	event_assign(&ev, base, data->pair[0], EV_CLOSED|EV_PERSIST,
+	    closed_event_cb, &n_calls);
+	if (!(event_base_get_features(base) & EV_FEATURE_EARLY_CLOSE)) {
+		tt_int_op(event_add(&ev, NULL), ==, -1);
+		tt_skip();
+	}
+	tt_int_op(event_add(&ev, NULL), ==, 0);
+	tt_int_op(event_pending(&ev, EV_CLOSED, NULL), ==, EV_CLOSED);
+
+	tt_int_op(write(data->pair[1], "xx", 2), ==, 2);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n_calls, ==, 0);
+
+	shutdown(data->pair[1], EVUTIL_SHUT_WR);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_calls, ==, 1);
+	tt_int_op(closed_res, ==, EV_CLOSED);
+
+	event_del(&ev);
+end:
+	;
+}
+
+/* bufferevent_uring_new: the callbacks run as for bufferevent_new(),
+ * whether the base uses io_uring or not.  The peer sends bytes that count
+ * up modulo 251, so that reordered data shows. */
+struct uring_bev_info {
+	size_t nread;
+	int nreadcb;
+	int nwrite;
+	short what;
+	int hold;	/* leave the input alone to stay above the watermark */
+	int bad;
+};
+
+static void
+uring_bev_readcb(struct bufferevent *bev, void *arg)
+{
+	struct uring_bev_info *info = arg;
+	unsigned char buf[1024];
+	size_t i, n;
+
+	++info->nreadcb;
+	if (info->hold)
+		return;
+	while ((n = bufferevent_read(bev, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; ++i) {
+			if (buf[i] != (info->nread + i) % 251)
+				info->bad = 1;
+		}
+		info->nread += n;
+	}
+}
+
+static void
+uring_bev_writecb(struct bufferevent *bev, void *arg)
+{
+	struct uring_bev_info *info = arg;
+
+	++info->nwrite;
+}
+
+static void
+uring_bev_errorcb(struct bufferevent *bev, short what, void *arg)
+{
+	struct uring_bev_info *info = arg;
+
+	info->what = what;
+}
+
+/* Sends up to len bytes of the pattern, starting at *sent */
+static size_t
+uring_bev_send(evutil_socket_t fd, size_t *sent, size_t len)
+{
+	unsigned char buf[4096];
+	size_t i, n, total = 0;
+	ssize_t res;
+
+	while (total < len) {
+		n = len - total < sizeof(buf) ? len - total : sizeof(buf);
+		for (i = 0; i < n; ++i)
+			buf[i] = (*sent + i) % 251;
+		if ((res = write(fd, buf, n)) <= 0)
+			break;
+		*sent += res;
+		total += res;
+	}
+	return (total);
+}
+
+static void
+test_uring_bufferevent(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = NULL;
+	struct event_config *cfg = NULL;
+	struct bufferevent *bev = NULL;
+	struct uring_bev_info info;
+	size_t sent = 0, len;
+	char buf[64];
+	int i, n = 0;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_avoid_method(cfg, "epoll"), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	if (strcmp(event_base_get_method(base), "io_uring"))
+		tt_skip();
+	/* headers without buffer rings leave it in readiness mode */
+#ifndef EVENT__HAVE_IO_URING_BUF_RING
+	tt_skip();
+#endif
+
+	memset(&info, 0, sizeof(info));
+	bev = bufferevent_uring_new(base, data->pair[0], uring_bev_readcb,
+	    uring_bev_writecb, uring_bev_errorcb, &info);
+	tt_assert(bev);
+	tt_assert(bev->uring != NULL);
+	tt_int_op(bufferevent_enable(bev, EV_READ), ==, 0);
+
+	tt_int_op(uring_bev_send(data->pair[1], &sent, 5), ==, 5);
+	for (i = 0; i < 10 && info.nread < 5; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.nread, ==, 5);
+
+	tt_int_op(bufferevent_write(bev, "world", 5), ==, 0);
+	for (i = 0; i < 10 && !info.nwrite; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.nwrite, ==, 1);
+	while (n < 5) {
+		i = read(data->pair[1], buf + n, sizeof(buf) - n);
+		tt_int_op(i, >, 0);
+		n += i;
+	}
+	tt_int_op(memcmp(buf, "world", 5), ==, 0);
+
+	/* the posted recv fills the provided buffers while the loop is not
+	 * running; once they are gone it ends with -ENOBUFS, and a new one
+	 * has to pick up the rest */
+	len = uring_bev_send(data->pair[1], &sent, 1024 * 1024);
+	TT_BLATHER(("sent %lu bytes without dispatching", (unsigned long)len));
+	for (i = 0; i < 1000 && info.nread < sent; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.nread, ==, sent);
+	tt_assert(!info.bad);
+
+	/* reading stops at the high watermark, with more data waiting in
+	 * the socket, and goes on once the input was drained */
+	bufferevent_setwatermark(bev, EV_READ, 0, 16);
+	info.hold = 1;
+	info.nreadcb = 0;
+	tt_int_op(uring_bev_send(data->pair[1], &sent, 32), ==, 32);
+	for (i = 0; i < 10 && !info.nreadcb; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.nreadcb, ==, 1);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	len = EVBUFFER_LENGTH(bev->input);
+	tt_int_op(len, >=, 16);
+	tt_int_op(uring_bev_send(data->pair[1], &sent, 32), ==, 32);
+	for (i = 0; i < 3; ++i)
+		event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(info.nreadcb, ==, 1);
+	tt_int_op(EVBUFFER_LENGTH(bev->input), ==, len);
+
+	info.hold = 0;
+	uring_bev_readcb(bev, &info);
+	for (i = 0; i < 10 && info.nread < sent; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.nread, ==, sent);
+	tt_assert(!info.bad);
+	bufferevent_setwatermark(bev, EV_READ, 0, 0);
+
+	shutdown(data->pair[1], EVUTIL_SHUT_WR);
+	for (i = 0; i < 10 && !info.what; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(info.what, ==, EVBUFFER_READ|EVBUFFER_EOF);
+
+end:
+	/* the recv may still be in flight */
+	if (bev)
+		bufferevent_free(bev);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* several events may wait for the same kind of event on one fd */
+static void
+count_cb(evutil_socket_t fd, short what, void *arg)
+{
+	++*(int *)arg;
+}
+
+static void
+test_shared_fd(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event r1, r2, w;
+	int n1 = 0, n2 = 0, nw = 0;
+
+	/* the other backends keep one event per fd and kind */
+	if (strcmp(event_base_get_method(base), "epoll"))
+		tt_skip();
+
+	event_assign(&r1, base, data->pair[0], EV_READ|EV_PERSIST,
+	    count_cb, &n1);
+	event_assign(&r2, base, data->pair[0], EV_READ|EV_PERSIST,
+	    count_cb, &n2);
+	event_assign(&w, base, data->pair[0], EV_WRITE, count_cb, &nw);
+	tt_int_op(event_add(&r1, NULL), ==, 0);
+	tt_int_op(event_add(&r2, NULL), ==, 0);
+	tt_int_op(event_add(&w, NULL), ==, 0);
+
+	tt_int_op(write(data->pair[1], "x", 1), ==, 1);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n1, ==, 1);
+	tt_int_op(n2, ==, 1);
+	tt_int_op(nw, ==, 1);
+
+	/* the other reader keeps the fd registered */
+	event_del(&r1);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n1, ==, 1);
+	tt_int_op(n2, ==, 2);
+
+	event_del(&r2);
+end:
+	;
+}
+
+/* EV_EXCLUSIVE events fire as usual; the events of an fd must agree on
+ * it, and it does not go with EV_CLOSED. */
+static void
+test_exclusive_event(void *data_)
+{
+	struct basic_test_data *data = data_;
+	struct event_base *base = data->base;
+	struct event rev, wev, ev;
+	int n_read = 0, n_write = 0;
+
+	event_assign(&rev, base, data->pair[0],
+	    EV_READ|EV_PERSIST|EV_EXCLUSIVE, count_cb, &n_read);
+	event_assign(&wev, base, data->pair[0],
+	    EV_WRITE|EV_PERSIST|EV_EXCLUSIVE, count_cb, &n_write);
+	event_assign(&ev, base, data->pair[0], EV_READ|EV_PERSIST,
+	    count_cb, &n_read);
+	/* elsewhere the flag is just ignored */
+	if (!(event_base_get_features(base) & EV_FEATURE_EXCLUSIVE)) {
+		tt_int_op(event_add(&rev, NULL), ==, 0);
+		event_del(&rev);
+		tt_skip();
+	}
+
+	event_assign(&ev, base, data->pair[0], EV_CLOSED|EV_EXCLUSIVE,
+	    count_cb, &n_read);
+	tt_int_op(event_add(&ev, NULL), ==, -1);
+	event_assign(&ev, base, data->pair[0], EV_READ|EV_PERSIST,
+	    count_cb, &n_read);
+
+	tt_int_op(event_add(&rev, NULL), ==, 0);
+	event_base_loop(base, EVLOOP_ONCE|EVLOOP_NONBLOCK);
+	tt_int_op(n_read, ==, 0);
+	tt_int_op(write(data->pair[1], "x", 1), ==, 1);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_read, ==, 1);
+
+	/* the registration changes without losing the read */
+	tt_int_op(event_add(&wev, NULL), ==, 0);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_read, ==, 2);
+	tt_int_op(n_write, ==, 1);
+	tt_int_op(event_add(&ev, NULL), ==, -1);
+
+	event_del(&rev);
+	event_del(&wev);
+	/* with the fd back to nothing, a shared event is fine */
+	tt_int_op(event_add(&ev, NULL), ==, 0);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n_read, ==, 3);
+	event_del(&ev);
+end:
+	;
+}
+
+/* max-dispatch-callbacks: a burst of active events must not delay a
+ * higher priority event past the per-iteration limit. */
+static struct event mdc_events[31];
+static int n_mdc_calls = 0;
+static int mdc_urgent_at = -1;
+
+static void
+max_dispatch_cb(evutil_socket_t fd, short what, void *arg)
+{
+	if (arg != NULL) {
+		mdc_urgent_at = n_mdc_calls;
+		return;
+	}
+	if (++n_mdc_calls == 5)
+		event_active(&mdc_events[30], EV_READ, 1);
+}
+
+static void
+test_max_dispatch_callbacks(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event_config *cfg = NULL;
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, NULL, 10, -1),
+	    ==, -1);
+	tt_int_op(event_config_set_max_dispatch_interval(cfg, NULL, 10, 0),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	tt_int_op(event_base_priority_init(base, 2), ==, 0);
+
+	for (i = 0; i < 31; ++i) {
+		event_assign(&mdc_events[i], base, -1, 0, max_dispatch_cb,
+		    i == 30 ? &mdc_events[i] : NULL);
+		event_priority_set(&mdc_events[i], i == 30 ? 0 : 1);
+	}
+	for (i = 0; i < 30; ++i)
+		event_active(&mdc_events[i], EV_READ, 1);
+
+	event_base_dispatch(base);
+
+	/* the urgent event runs as soon as the first iteration ends */
+	tt_int_op(n_mdc_calls, ==, 30);
+	tt_int_op(mdc_urgent_at, ==, 10);
+
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* busy polling: spinning stops at the next timeout instead of adding
+ * the budget to it, and finds events that are there without blocking */
+static void
+test_busy_poll(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event_config *cfg = NULL;
+	struct event_busy_poll_stats stats;
+	struct common_timeout_info info;
+	struct timeval max = { 0, 500 }, toolong = { 1, 0 };
+	struct timeval delay = { 0, 100 }, start, late;
+	evutil_socket_t pair[2] = { -1, -1 };
+	struct event ev;
+	int n = 0;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_busy_poll(cfg, &toolong, 0), ==, -1);
+	tt_int_op(event_config_set_busy_poll(cfg, &max, 0), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	/* the other backends block right away */
+	if (strcmp(event_base_get_method(base), "epoll"))
+		tt_skip();
+
+	/* the budget covers the timeout; blocking after it would round
+	 * the wait up to a millisecond */
+	memset(&info, 0, sizeof(info));
+	event_assign(&info.ev, base, -1, 0, timer_wheel_cb, &info);
+	evutil_gettimeofday(&start, NULL);
+	evtimer_add(&info.ev, &delay);
+	event_base_dispatch(base);
+	tt_int_op(info.count, ==, 1);
+	evutil_timersub(&info.called_at, &start, &late);
+	tt_int_op(late.tv_sec, ==, 0);
+	tt_int_op(late.tv_usec, >=, 100);
+	tt_int_op(late.tv_usec, <, 900);
+
+	tt_int_op(event_base_get_busy_poll_stats(base, &stats), ==, 0);
+	tt_int_op(stats.spins, ==, 0);
+	tt_int_op(stats.blocks, ==, 1);
+	tt_int_op(stats.polls, >=, 1);
+
+	/* data that is already there ends the spinning at once */
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+	tt_int_op(write(pair[1], "x", 1), ==, 1);
+	event_assign(&ev, base, pair[0], EV_READ, count_cb, &n);
+	event_add(&ev, NULL);
+	event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(n, ==, 1);
+
+	tt_int_op(event_base_get_busy_poll_stats(base, &stats), ==, 0);
+	tt_int_op(stats.spins, ==, 1);
+	tt_int_op(stats.blocks, ==, 1);
+	tt_int_op(stats.budget_usec, >, 0);
+	tt_int_op(stats.budget_usec, <=, 500);
+
+end:
+	if (pair[0] != -1)
+		evutil_closesocket(pair[0]);
+	if (pair[1] != -1)
+		evutil_closesocket(pair[1]);
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* the epoll array grows to the cap while all fds are ready, and shrinks
+ * back to the floor once the base goes idle */
+static void
+test_batch_size(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event_config *cfg = NULL;
+	struct event_batch_stats stats;
+	struct event events[80];
+	evutil_socket_t pairs[80][2];
+	int i, n = 0, used = 0;
+	char c;
+
+	memset(pairs, -1, sizeof(pairs));
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_batch_size(cfg, 0, 64), ==, -1);
+	tt_int_op(event_config_set_batch_size(cfg, 64, 4), ==, -1);
+	tt_int_op(event_config_set_batch_size(cfg, 4, 64), ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+	/* the other backends do not count */
+	if (strcmp(event_base_get_method(base), "epoll"))
+		tt_skip();
+
+	for (i = 0; i < 80; ++i) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]),
+		    ==, 0);
+		tt_int_op(write(pairs[i][1], "x", 1), ==, 1);
+		event_assign(&events[i], base, pairs[i][0],
+		    EV_READ|EV_PERSIST, count_cb, &n);
+		event_add(&events[i], NULL);
+	}
+	used = 80;
+
+	for (i = 0; i < 4; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(event_base_get_batch_stats(base, &stats), ==, 0);
+	tt_int_op(stats.size, ==, 64);
+	tt_int_op(stats.last, ==, 64);
+	tt_int_op(stats.peak, ==, 64);
+	tt_int_op(stats.grows, ==, 1);
+	tt_int_op(n, ==, 32 + 3 * 64);
+
+	/* nothing is ready any more */
+	for (i = 0; i < 80; ++i)
+		tt_int_op(read(pairs[i][0], &c, 1), ==, 1);
+	for (i = 0; i < 400; ++i)
+		event_base_loop(base, EVLOOP_NONBLOCK);
+	tt_int_op(event_base_get_batch_stats(base, &stats), ==, 0);
+	tt_int_op(stats.size, ==, 4);
+	tt_int_op(stats.last, ==, 0);
+	tt_int_op(stats.shrinks, ==, 4);
+	tt_int_op(stats.events, ==, 32 + 3 * 64);
+
+end:
+	for (i = 0; i < used; ++i)
+		event_del(&events[i]);
+	for (i = 0; i < 80; ++i) {
+		if (pairs[i][0] != -1)
+			evutil_closesocket(pairs[i][0]);
+		if (pairs[i][1] != -1)
+			evutil_closesocket(pairs[i][1]);
+	}
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+#ifdef EVENT__HAVE_PTHREADS
+/* Another thread activates events and breaks the loop of a thread-safe base
+ * while the loop waits for a timeout that is far away. */
+static struct event tsw_events[100];
+static int n_tsw_calls = 0;
+
+static void
+threadsafe_wakeup_cb(evutil_socket_t fd, short what, void *arg)
+{
+	++n_tsw_calls;
+}
+
+static void *
+threadsafe_wakeup_thread(void *arg)
+{
+	struct event_base *base = arg;
+	struct timeval delay = { 0, 50*1000 };
+	int i;
+
+	evutil_usleep_(&delay);
+	for (i = 0; i < 100; ++i)
+		event_active(&tsw_events[i], EV_READ, 1);
+	evutil_usleep_(&delay);
+	event_base_loopbreak(base);
+	return NULL;
+}
+
+static void
+test_threadsafe_wakeup(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct event_config *cfg = NULL;
+	struct event timeout;
+	struct timeval tv = { 100, 0 }, start, end;
+	pthread_t thread;
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_flag(cfg, EVENT_BASE_FLAG_THREADSAFE),
+	    ==, 0);
+	base = event_base_new_with_config(cfg);
+	tt_assert(base);
+
+	for (i = 0; i < 100; ++i)
+		event_assign(&tsw_events[i], base, -1, 0,
+		    threadsafe_wakeup_cb, NULL);
+	evtimer_assign(&timeout, base, threadsafe_wakeup_cb, NULL);
+	evtimer_add(&timeout, &tv);
+
+	evutil_gettimeofday(&start, NULL);
+	pthread_create(&thread, NULL, threadsafe_wakeup_thread, base);
+	event_base_dispatch(base);
+	evutil_gettimeofday(&end, NULL);
+	pthread_join(thread, NULL);
+
+	tt_int_op(n_tsw_calls, ==, 100);
+	test_timeval_diff_eq(&start, &end, 100);
+
+	event_del(&timeout);
+end:
+	if (base)
+		event_base_free(base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* Callbacks posted from another thread run in the loop, in order. */
+static struct event_base *post_base;
+static int post_order[100];
+static int n_posts = 0;
+
+static void
+post_cb(void *arg)
+{
+	post_order[n_posts++] = (int)(ev_intptr_t)arg;
+	if (n_posts == 100)
+		event_base_loopbreak(post_base);
+}
+
+static void *
+post_thread(void *arg)
+{
+	int i;
+
+	for (i = 0; i < 100; ++i)
+		event_base_post(post_base, post_cb, (void *)(ev_intptr_t)i);
+	return NULL;
+}
+
+static void
+test_event_base_post(void *ptr)
+{
+	struct event_base *base = ptr;
+	struct event_config *cfg = NULL;
+	struct event timeout;
+	struct timeval tv = { 100, 0 };
+	pthread_t thread;
+	int i;
+
+	/* without the notify fd nobody could wake up the loop */
+	tt_int_op(event_base_post(base, post_cb, NULL), ==, -1);
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_flag(cfg, EVENT_BASE_FLAG_THREADSAFE),
+	    ==, 0);
+	post_base = event_base_new_with_config(cfg);
+	tt_assert(post_base);
+
+	evtimer_assign(&timeout, post_base, threadsafe_wakeup_cb, NULL);
+	evtimer_add(&timeout, &tv);
+
+	pthread_create(&thread, NULL, post_thread, NULL);
+	event_base_dispatch(post_base);
+	pthread_join(thread, NULL);
+
+	tt_int_op(n_posts, ==, 100);
+	for (i = 0; i < 100; ++i)
+		tt_int_op(post_order[i], ==, i);
+
+	event_del(&timeout);
+end:
+	if (post_base)
+		event_base_free(post_base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* Several threads run the loop of one base; a ready fd wakes up only one
+ * of them, so a callback never runs twice at once. */
+#define MD_NFDS 16
+#define MD_NTHREADS 4
+#define MD_ROUNDS 50
+static struct event_base *md_base;
+static int md_inside[MD_NFDS];
+static int md_overlaps = 0;
+static int md_bytes = 0;
+static pthread_t md_threads[MD_NTHREADS];
+static int md_calls[MD_NTHREADS];
+
+static void
+multi_dispatch_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval delay = { 0, 100 };
+	int i = (int)(ev_intptr_t)arg;
+	char buf[64];
+	int n;
+
+	if (__sync_fetch_and_add(&md_inside[i], 1) != 0)
+		__sync_fetch_and_add(&md_overlaps, 1);
+	n = read(fd, buf, sizeof(buf));
+	evutil_usleep_(&delay);
+	__sync_fetch_and_sub(&md_inside[i], 1);
+	if (n > 0)
+		__sync_fetch_and_add(&md_bytes, n);
+	for (i = 0; i < MD_NTHREADS; ++i)
+		if (pthread_equal(md_threads[i], pthread_self()))
+			++md_calls[i];
+}
+
+static void *
+multi_dispatch_thread(void *arg)
+{
+	event_base_loop(md_base, EVLOOP_NO_EXIT_ON_EMPTY);
+	return NULL;
+}
+
+static void
+test_multi_dispatch(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event events[MD_NFDS];
+	evutil_socket_t pairs[MD_NFDS][2];
+	struct timeval delay = { 0, 500 };
+	int i, round, used = 0;
+
+	memset(pairs, -1, sizeof(pairs));
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_flag(cfg, EVENT_BASE_FLAG_MULTI_DISPATCH),
+	    ==, 0);
+	md_base = event_base_new_with_config(cfg);
+	if (md_base == NULL)
+		tt_skip();
+
+	for (i = 0; i < MD_NFDS; ++i) {
+		tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]),
+		    ==, 0);
+		evutil_make_socket_nonblocking(pairs[i][1]);
+		event_assign(&events[i], md_base, pairs[i][1],
+		    EV_READ|EV_PERSIST, multi_dispatch_cb,
+		    (void *)(ev_intptr_t)i);
+		event_add(&events[i], NULL);
+	}
+	for (i = 0; i < MD_NTHREADS; ++i)
+		pthread_create(&md_threads[i], NULL, multi_dispatch_thread,
+		    NULL);
+
+	for (round = 0; round < MD_ROUNDS; ++round) {
+		for (i = 0; i < MD_NFDS; ++i)
+			tt_int_op(write(pairs[i][0], "x", 1), ==, 1);
+		evutil_usleep_(&delay);
+	}
+	for (i = 0; i < 1000 && md_bytes < MD_ROUNDS * MD_NFDS; ++i)
+		evutil_usleep_(&delay);
+
+	event_base_loopbreak(md_base);
+	for (i = 0; i < MD_NTHREADS; ++i) {
+		pthread_join(md_threads[i], NULL);
+		used += md_calls[i] != 0;
+	}
+
+	tt_int_op(md_bytes, ==, MD_ROUNDS * MD_NFDS);
+	tt_int_op(md_overlaps, ==, 0);
+	/* the work is spread over the threads */
+	tt_int_op(used, >, 1);
+
+	for (i = 0; i < MD_NFDS; ++i)
+		event_del(&events[i]);
+end:
+	for (i = 0; i < MD_NFDS; ++i) {
+		if (pairs[i][0] != -1)
+			evutil_closesocket(pairs[i][0]);
+		if (pairs[i][1] != -1)
+			evutil_closesocket(pairs[i][1]);
+	}
+	if (md_base)
+		event_base_free(md_base);
+	if (cfg)
+		event_config_free(cfg);
+}
+
+/* The read and the write callback of one fd run in the thread that got
+ * the wakeup, one after the other. */
+static int md_rw_inside = 0;
+static int md_rw_reads = 0;
+static int md_rw_writes = 0;
+
+static void
+multi_dispatch_rw_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct timeval delay = { 0, 200 };
+	char c;
+
+	if (__sync_fetch_and_add(&md_rw_inside, 1) != 0)
+		__sync_fetch_and_add(&md_overlaps, 1);
+	if (what & EV_READ) {
+		if (read(fd, &c, 1) == 1)
+			__sync_fetch_and_add(&md_rw_reads, 1);
+	} else
+		__sync_fetch_and_add(&md_rw_writes, 1);
+	evutil_usleep_(&delay);
+	__sync_fetch_and_sub(&md_rw_inside, 1);
+}
+
+static void
+test_multi_dispatch_rw(void *ptr)
+{
+	struct event_config *cfg = NULL;
+	struct event rev, wev;
+	evutil_socket_t pair[2] = { -1, -1 };
+	struct timeval delay = { 0, 300 };
+	int i;
+
+	cfg = event_config_new();
+	tt_assert(cfg);
+	tt_int_op(event_config_set_flag(cfg, EVENT_BASE_FLAG_MULTI_DISPATCH),
+	    ==, 0);
+	md_base = event_base_new_with_config(cfg);
+	if (md_base == NULL)
+		tt_skip();
+
+	/* the fd stays writable, so most wakeups report both */
+	tt_int_op(evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pair), ==, 0);
+	event_assign(&rev, md_base, pair[1], EV_READ|EV_PERSIST,
+	    multi_dispatch_rw_cb, NULL);
+	event_assign(&wev, md_base, pair[1], EV_WRITE|EV_PERSIST,
+	    multi_dispatch_rw_cb, NULL);
+	event_add(&rev, NULL);
+	event_add(&wev, NULL);
+	for (i = 0; i < MD_NTHREADS; ++i)
+		pthread_create(&md_threads[i], NULL, multi_dispatch_thread,
+		    NULL);
+
+	for (i = 0; i < MD_ROUNDS; ++i) {
+		tt_int_op(write(pair[0], "x", 1), ==, 1);
+		evutil_usleep_(&delay);
+	}
+	for (i = 0; i < 1000 && md_rw_reads < MD_ROUNDS; ++i)
+		evutil_usleep_(&delay);
+
+	event_base_loopbreak(md_base);
+	for (i = 0; i < MD_NTHREADS; ++i)
+		pthread_join(md_threads[i], NULL);
+
+	tt_int_op(md_rw_reads, ==, MD_ROUNDS);
+	tt_int_op(md_rw_writes, >, 0);
+	tt_int_op(md_overlaps, ==, 0);
+
+	event_del(&rev);
+	event_del(&wev);
+end:
+	if (pair[0] != -1)
+		evutil_closesocket(pair[0]);
+	if (pair[1] != -1)
+		evutil_closesocket(pair[1]);
+	if (md_base)
+		event_base_free(md_base);
+	if (cfg)
+		event_config_free(cfg);
+}
+#endif
+
+static void
+test_multiple_cb(evutil_socket_t fd, short event, void *arg)
+{
+	if (event & EV_READ)
+		test_ok |= 1;
+	else if (event & EV_WRITE)
+		test_ok |= 2;
+}
+
+static void
+test_multiple_events_for_same_fd(void)
+{
+   struct event e1, e2;
+
+   setup_test("Multiple events for same fd: ");
+
+   event_set(&e1, pair[0], EV_READ, test_multiple_cb, NULL);
+   event_add(&e1, NULL);
+   event_set(&e2, pair[0], EV_WRITE, test_multiple_cb, NULL);
+   event_add(&e2, NULL);
+   event_loop(EVLOOP_ONCE);
+   event_del(&e2);
+
+   if (write(pair[1], TEST1, strlen(TEST1)+1) < 0) {
+	   tt_fail_perror("write");
+   }
+
+   event_loop(EVLOOP_ONCE);
+   event_del(&e1);
+
+   if (test_ok != 3)
+	   test_ok = 0;
+
+   cleanup_test();
+}
+
+int evtag_decode_int(ev_uint32_t *pnumber, struct evbuffer *evbuf);
+int evtag_decode_int64(ev_uint64_t *pnumber, struct evbuffer *evbuf);
+int evtag_encode_tag(struct evbuffer *evbuf, ev_uint32_t number);
+int evtag_decode_tag(ev_uint32_t *pnumber, struct evbuffer *evbuf);
+
+static void
+read_once_cb(evutil_socket_t fd, short event, void *arg)
+{
+	char buf[256];
+	int len;
+
+	len = read(fd, buf, sizeof(buf));
+
+	if (called) {
+		test_ok = 0;
+	} else if (len) {
+		/* Assumes global pair[0] can be used for writing */
+		if (write(pair[0], TEST1, strlen(TEST1)+1) < 0) {
+			tt_fail_perror("write");
+			test_ok = 0;
+		} else {
+			test_ok = 1;
+		}
+	}
+
+	called++;
+}
+
+static void
+test_want_only_once(void)
+{
+	struct event ev;
+	struct timeval tv;
+
+	/* Very simple read test */
+	setup_test("Want read only once: ");
+
+	if (write(pair[0], TEST1, strlen(TEST1)+1) < 0) {
+		tt_fail_perror("write");
+	}
+
+	/* Setup the loop termination */
+	evutil_timerclear(&tv);
+	tv.tv_usec = 300*1000;
+	event_loopexit(&tv);
+
+	event_set(&ev, pair[1], EV_READ, read_once_cb, &ev);
+	if (event_add(&ev, NULL) == -1)
+		exit(1);
+	event_dispatch();
+
+	cleanup_test();
+}
+
+#define TEST_MAX_INT	6
+
+static void
+evtag_int_test(void *ptr)
+{
+	struct evbuffer *tmp = evbuffer_new();
+	ev_uint32_t integers[TEST_MAX_INT] = {
+		0xaf0, 0x1000, 0x1, 0xdeadbeef, 0x00, 0xbef000
+	};
+	ev_uint32_t integer;
 	ev_uint64_t big_int;
 	int i;
 
@@ -3455,10 +4836,38 @@ struct testcase_t main_testcases[] = {
 	{ "persistent_timeout_jump", test_persistent_timeout_jump, TT_FORK|TT_NEED_BASE, &basic_setup, NULL },
 	{ "persistent_active_timeout", test_persistent_active_timeout,
 	  TT_FORK|TT_NEED_BASE|TT_RETRIABLE, &basic_setup, NULL },
+	BASIC(periodic_timer_aligned, TT_FORK|TT_NEED_BASE|TT_RETRIABLE),
 	LEGACY(priorities, TT_FORK|TT_NEED_BASE),
 	BASIC(priority_active_inversion, TT_FORK|TT_NEED_BASE),
+	BASIC(priority_drr, TT_FORK|TT_NEED_BASE),
+	BASIC(changelist_reopen, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
+	BASIC(edge_triggered, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR|TT_NO_LOGS),
+	BASIC(level_triggered, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
+	BASIC(closed_event, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR|TT_NO_LOGS),
+	BASIC(exclusive_event, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR|TT_NO_LOGS),
+	BASIC(uring_bufferevent, TT_FORK|TT_NEED_SOCKETPAIR),
+	BASIC(shared_fd, TT_FORK|TT_NEED_BASE|TT_NEED_SOCKETPAIR),
+	{ "max_dispatch_callbacks", test_max_dispatch_callbacks, TT_FORK, NULL,
+	  NULL },
+	{ "busy_poll", test_busy_poll, TT_FORK|TT_RETRIABLE, NULL, NULL },
+	{ "batch_size", test_batch_size, TT_FORK, NULL, NULL },
+#ifdef EVENT__HAVE_PTHREADS
+	{ "threadsafe_wakeup", test_threadsafe_wakeup,
+	  TT_FORK|TT_NEED_THREADS, NULL, NULL },
+	{ "event_base_post", test_event_base_post,
+	  TT_FORK|TT_NEED_THREADS|TT_NEED_BASE, &basic_setup, NULL },
+	{ "multi_dispatch", test_multi_dispatch,
+	  TT_FORK|TT_NEED_THREADS, NULL, NULL },
+	{ "multi_dispatch_rw", test_multi_dispatch_rw,
+	  TT_FORK|TT_NEED_THREADS, NULL, NULL },
+#endif
 	{ "common_timeout", test_common_timeout, TT_FORK|TT_NEED_BASE,
 	  &basic_setup, NULL },
+	{ "timer_wheel", test_timer_wheel, TT_FORK, &config_setup, NULL },
+	{ "timer_slack", test_timer_slack, TT_FORK, &config_setup, NULL },
+	{ "precise_timer", test_precise_timer, TT_FORK|TT_RETRIABLE,
+	  &config_setup, NULL },
+	{ "clock_fn", test_clock_fn, TT_FORK, &config_setup, NULL },
 
 	/* These legacy tests may not all need all of these flags. */
 	LEGACY(simpleread, TT_ISOLATED),
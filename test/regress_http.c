@@ -3337,6 +3337,285 @@ end:
 		event_base_free(base);
 }
 
+#ifndef _WIN32
+/* Every loop of a runtime serves the same port with its own evhttp. */
+static int http_runtime_requests[2];
+
+static void
+http_runtime_cb(struct evhttp_request *req, void *arg)
+{
+	int *count = arg;
+	struct evbuffer *evb = evbuffer_new();
+
+	/* each counter is only touched by the thread of its loop */
+	++*count;
+	evbuffer_add_printf(evb, "%s", "hello");
+	evhttp_send_reply(req, HTTP_OK, "OK", evb);
+	evbuffer_free(evb);
+}
+
+/* Sends one request on a fresh connection; 0 if it was answered with 200. */
+static int
+http_runtime_request(struct sockaddr_in *sin)
+{
+	const char *http_request = "GET /test HTTP/1.0\r\n\r\n";
+	char buf[1024];
+	evutil_socket_t fd;
+	int n, len = 0, res = -1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == EVUTIL_INVALID_SOCKET)
+		return (-1);
+	if (connect(fd, (struct sockaddr *)sin, sizeof(*sin)) == -1)
+		goto done;
+	if (write(fd, http_request, strlen(http_request)) !=
+	    (int)strlen(http_request))
+		goto done;
+	while (len < (int)sizeof(buf) - 1 &&
+	    (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	buf[len] = '\0';
+	if (strstr(buf, "200 OK") != NULL)
+		res = 0;
+done:
+	evutil_closesocket(fd);
+	return (res);
+}
+
+static void
+http_runtime_test(void *ptr)
+{
+	struct event_runtime *rt = NULL;
+	struct evhttp *http[2] = { NULL, NULL };
+	struct sockaddr_in sin[2];
+	ev_socklen_t slen;
+	int i;
+
+	rt = event_runtime_new(2, NULL);
+	tt_assert(rt);
+	tt_int_op(event_runtime_nloops(rt), ==, 2);
+	tt_int_op(event_runtime_bind_socket(rt, "127.0.0.1", 0), ==, 0);
+
+	for (i = 0; i < 2; ++i) {
+		slen = sizeof(sin[i]);
+		tt_int_op(getsockname(event_runtime_get_socket(rt, i),
+			(struct sockaddr *)&sin[i], &slen), ==, 0);
+		http[i] = evhttp_new(event_runtime_get_base(rt, i));
+		tt_assert(http[i]);
+		evhttp_set_gencb(http[i], http_runtime_cb,
+		    &http_runtime_requests[i]);
+		tt_int_op(evhttp_accept_socket(http[i],
+			event_runtime_get_socket(rt, i)), ==, 0);
+	}
+	/* port 0 gives both loops the same ephemeral port */
+	tt_int_op(sin[0].sin_port, ==, sin[1].sin_port);
+	tt_assert(event_runtime_get_base(rt, 0) !=
+	    event_runtime_get_base(rt, 1));
+
+	tt_int_op(event_runtime_start(rt), ==, 0);
+
+	for (i = 0; i < 20; ++i)
+		tt_int_op(http_runtime_request(&sin[0]), ==, 0);
+
+	tt_int_op(event_runtime_stop(rt), ==, 0);
+	tt_int_op(http_runtime_requests[0] + http_runtime_requests[1], ==, 20);
+
+end:
+	for (i = 0; i < 2; ++i) {
+		if (http[i])
+			evhttp_free(http[i]);
+	}
+	if (rt)
+		event_runtime_free(rt);
+}
+
+/* A burst of connections is accepted a batch at a time. */
+static int http_accept_batch_requests;
+
+static void
+http_accept_batch_cb(struct evhttp_request *req, void *arg)
+{
+	++http_accept_batch_requests;
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+static void
+http_accept_batch_test(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct evhttp *http = NULL;
+	struct evhttp_accept_stats stats;
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	const char *http_request = "GET /test HTTP/1.0\r\n\r\n";
+	evutil_socket_t fd = -1, fds[10];
+	int i;
+
+	for (i = 0; i < 10; ++i)
+		fds[i] = -1;
+	base = event_base_new();
+	tt_assert(base);
+	http = evhttp_new(base);
+	tt_assert(http);
+	evhttp_set_gencb(http, http_accept_batch_cb, NULL);
+	evhttp_set_accept_batch(http, 4);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	tt_int_op(bind(fd, (struct sockaddr *)&sin, sizeof(sin)), ==, 0);
+	tt_int_op(listen(fd, 128), ==, 0);
+	tt_int_op(getsockname(fd, (struct sockaddr *)&sin, &slen), ==, 0);
+	tt_int_op(evhttp_accept_socket(http, fd), ==, 0);
+
+	/* all of them wait in the backlog before the loop runs */
+	for (i = 0; i < 10; ++i) {
+		fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		tt_assert(fds[i] != EVUTIL_INVALID_SOCKET);
+		tt_int_op(connect(fds[i], (struct sockaddr *)&sin,
+			sizeof(sin)), ==, 0);
+		tt_int_op(write(fds[i], http_request, strlen(http_request)), ==,
+		    (int)strlen(http_request));
+	}
+
+	for (i = 0; i < 10 && http_accept_batch_requests < 10; ++i)
+		event_base_loop(base, EVLOOP_ONCE);
+	tt_int_op(http_accept_batch_requests, ==, 10);
+
+	tt_int_op(evhttp_get_accept_stats(http, &stats), ==, 0);
+	tt_int_op(stats.accepted, ==, 10);
+	tt_int_op(stats.peak, ==, 4);
+	tt_int_op(stats.wakeups, >=, 3);
+	tt_int_op(stats.full, >=, 2);
+
+end:
+	for (i = 0; i < 10; ++i) {
+		if (fds[i] != -1)
+			evutil_closesocket(fds[i]);
+	}
+	if (http)
+		evhttp_free(http);
+	if (base)
+		event_base_free(base);
+}
+
+/* A listener is shared with the other events on its socket, unless the
+ * server asked for exclusive wakeups. */
+static void
+http_accept_exclusive_cb(evutil_socket_t fd, short what, void *arg)
+{
+}
+
+static evutil_socket_t
+http_accept_exclusive_listener(void)
+{
+	struct sockaddr_in sin;
+	evutil_socket_t fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == EVUTIL_INVALID_SOCKET)
+		return (fd);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(0x7f000001);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1 ||
+	    listen(fd, 128) == -1) {
+		evutil_closesocket(fd);
+		return (EVUTIL_INVALID_SOCKET);
+	}
+	return (fd);
+}
+
+static void
+http_accept_exclusive_test(void *ptr)
+{
+	struct event_base *base = NULL;
+	struct evhttp *http = NULL;
+	struct event ev;
+	evutil_socket_t fd;
+
+	base = event_base_new();
+	tt_assert(base);
+	http = evhttp_new(base);
+	tt_assert(http);
+
+	/* evhttp_free() closes the listeners */
+	fd = http_accept_exclusive_listener();
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	tt_int_op(evhttp_accept_socket(http, fd), ==, 0);
+	event_assign(&ev, base, fd, EV_READ|EV_PERSIST,
+	    http_accept_exclusive_cb, NULL);
+	tt_int_op(event_add(&ev, NULL), ==, 0);
+	event_del(&ev);
+
+	evhttp_set_accept_exclusive(http, 1);
+	fd = http_accept_exclusive_listener();
+	tt_assert(fd != EVUTIL_INVALID_SOCKET);
+	tt_int_op(evhttp_accept_socket(http, fd), ==, 0);
+	event_assign(&ev, base, fd, EV_READ|EV_PERSIST,
+	    http_accept_exclusive_cb, NULL);
+	/* the backends without the feature ignore EV_EXCLUSIVE */
+	if (event_base_get_features(base) & EV_FEATURE_EXCLUSIVE)
+		tt_int_op(event_add(&ev, NULL), ==, -1);
+
+end:
+	if (http)
+		evhttp_free(http);
+	if (base)
+		event_base_free(base);
+}
+
+/* Only the first loop accepts; it hands connections to the idle one. */
+static void
+http_runtime_handoff_test(void *ptr)
+{
+	struct event_runtime *rt = NULL;
+	struct evhttp *http[2] = { NULL, NULL };
+	struct sockaddr_in sin;
+	ev_socklen_t slen = sizeof(sin);
+	int i;
+
+	rt = event_runtime_new(2, NULL);
+	tt_assert(rt);
+	tt_int_op(event_runtime_bind_socket(rt, "127.0.0.1", 0), ==, 0);
+	tt_int_op(getsockname(event_runtime_get_socket(rt, 0),
+		(struct sockaddr *)&sin, &slen), ==, 0);
+	evutil_closesocket(event_runtime_get_socket(rt, 1));
+
+	for (i = 0; i < 2; ++i) {
+		http[i] = evhttp_new(event_runtime_get_base(rt, i));
+		tt_assert(http[i]);
+		evhttp_set_gencb(http[i], http_runtime_cb,
+		    &http_runtime_requests[i]);
+		tt_int_op(evhttp_set_runtime(http[i], rt), ==, 0);
+	}
+	tt_int_op(evhttp_accept_socket(http[0],
+		event_runtime_get_socket(rt, 0)), ==, 0);
+	/* the listener counts for the first loop */
+	tt_int_op(event_runtime_get_load(rt, 0), ==, 1);
+	tt_int_op(event_runtime_get_load(rt, 1), ==, 0);
+
+	tt_int_op(event_runtime_start(rt), ==, 0);
+
+	for (i = 0; i < 20; ++i)
+		tt_int_op(http_runtime_request(&sin), ==, 0);
+
+	tt_int_op(event_runtime_stop(rt), ==, 0);
+	tt_int_op(http_runtime_requests[0] + http_runtime_requests[1], ==, 20);
+	tt_int_op(http_runtime_requests[1], >, 0);
+
+end:
+	for (i = 0; i < 2; ++i) {
+		if (http[i])
+			evhttp_free(http[i]);
+	}
+	if (rt)
+		event_runtime_free(rt);
+}
+#endif
+
 /*
  * the server is just going to close the connection if it times out during
  * reading the headers.
@@ -5191,6 +5470,14 @@ static void https_persist_connection_test(void *arg)
 struct testcase_t http_testcases[] = {
 	{ "primitives", http_primitives, 0, NULL, NULL },
 	{ "base", http_base_test, TT_FORK, NULL, NULL },
+#ifndef _WIN32
+	{ "accept_batch", http_accept_batch_test, TT_FORK, NULL, NULL },
+	{ "accept_exclusive", http_accept_exclusive_test, TT_FORK|TT_NO_LOGS,
+	  NULL, NULL },
+	{ "runtime", http_runtime_test, TT_FORK|TT_NEED_THREADS, NULL, NULL },
+	{ "runtime_handoff", http_runtime_handoff_test,
+	  TT_FORK|TT_NEED_THREADS, NULL, NULL },
+#endif
 	{ "bad_headers", http_bad_header_test, 0, NULL, NULL },
 	{ "parse_query", http_parse_query_test, 0, NULL, NULL },
 	{ "parse_query_str", http_parse_query_str_test, 0, NULL, NULL },
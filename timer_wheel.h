@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2000-2004 Niels Provos <provos@citi.umich.edu>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+/*
+ * A hierarchical timing wheel with a resolution of one millisecond.
+ *
+ * Level 0 has 256 slots of one tick each; levels 1 to 4 have 64 slots
+ * each, covering 2^8, 2^14, 2^20 and 2^26 ticks per slot.  An event is
+ * stored on the level given by the highest bit in which its expiry tick
+ * differs from the current tick, so its position is always a function of
+ * (expiry, current tick) and it can be unlinked without remembering where
+ * it was put.  Whenever the current tick crosses a slot boundary the
+ * events of that slot are cascaded down one or more levels.  Expiries more
+ * than 2^32 ticks away wait on an overflow list.
+ *
+ * Insertion and removal are O(1); every event is cascaded at most once
+ * per level, which makes expiry O(1) amortized.  A per-level bitmap of
+ * non-empty slots lets us find the next interesting tick without walking
+ * empty slots.
+ *
+ * An event with a slack of at least one tick is filed under a later tick
+ * instead of its own: its deadline plus the slack, rounded down to a
+ * multiple of the largest power of two not above the slack.  Events with
+ * nearby deadlines thus share a slot and expire in the same wakeup.
+ */
+
+#include <string.h>
+
+#include "event.h"
+#include "evutil.h"
+
+#define TW_L0_BITS	8
+#define TW_L0_SIZE	(1 << TW_L0_BITS)
+#define TW_LN_BITS	6
+#define TW_LN_SIZE	(1 << TW_LN_BITS)
+#define TW_LN_LEVELS	4
+#define TW_SPAN_BITS	(TW_L0_BITS + TW_LN_LEVELS * TW_LN_BITS)
+
+/* bit shift of the slots on upper level n (0-based) */
+#define TW_LN_SHIFT(n)	(TW_L0_BITS + (n) * TW_LN_BITS)
+
+struct timer_wheel {
+	struct event_list l0[TW_L0_SIZE];
+	struct event_list ln[TW_LN_LEVELS][TW_LN_SIZE];
+	struct event_list overflow;
+
+	ev_uint64_t l0_map[TW_L0_SIZE / 64];
+	ev_uint64_t ln_map[TW_LN_LEVELS];
+
+	/* the next tick to be processed; all earlier ticks are done */
+	ev_uint64_t cur;
+	unsigned n;
+
+	/* slack in microseconds for events whose ev_slack is -1 */
+	int slack;
+};
+
+static inline void timer_wheel_ctor(struct timer_wheel *w, ev_uint64_t now);
+static inline unsigned timer_wheel_size(struct timer_wheel *w);
+static inline ev_uint64_t timer_wheel_tick(const struct timeval *tv);
+static inline void timer_wheel_tick_to_tv(ev_uint64_t tick,
+    struct timeval *tv);
+static inline void timer_wheel_insert(struct timer_wheel *w,
+    struct event *ev);
+static inline void timer_wheel_erase(struct timer_wheel *w,
+    struct event *ev);
+static inline int timer_wheel_next(struct timer_wheel *w,
+    ev_uint64_t *tickp);
+static inline struct event_list *timer_wheel_expire(struct timer_wheel *w,
+    ev_uint64_t now);
+static inline struct event *timer_wheel_any(struct timer_wheel *w);
+
+static inline int
+timer_wheel_ffs_(ev_uint64_t x)
+{
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+	return (__builtin_ctzll(x));
+#else
+	int i = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		++i;
+	}
+	return (i);
+#endif
+}
+
+static inline int
+timer_wheel_fls_(ev_uint64_t x)
+{
+#if defined(__GNUC__) && (__GNUC__ >= 4)
+	return (63 - __builtin_clzll(x));
+#else
+	int i = 0;
+	while (x >>= 1)
+		++i;
+	return (i);
+#endif
+}
+
+void
+timer_wheel_ctor(struct timer_wheel *w, ev_uint64_t now)
+{
+	int i, j;
+
+	for (i = 0; i < TW_L0_SIZE; ++i)
+		TAILQ_INIT(&w->l0[i]);
+	for (i = 0; i < TW_LN_LEVELS; ++i)
+		for (j = 0; j < TW_LN_SIZE; ++j)
+			TAILQ_INIT(&w->ln[i][j]);
+	TAILQ_INIT(&w->overflow);
+	memset(w->l0_map, 0, sizeof(w->l0_map));
+	memset(w->ln_map, 0, sizeof(w->ln_map));
+	w->cur = now;
+	w->n = 0;
+	w->slack = 0;
+}
+
+unsigned
+timer_wheel_size(struct timer_wheel *w)
+{
+	return (w->n);
+}
+
+/* Converts an absolute time into a tick, rounding up so that an event
+ * never expires before its ev_timeout. */
+ev_uint64_t
+timer_wheel_tick(const struct timeval *tv)
+{
+	return ((ev_uint64_t)tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+}
+
+void
+timer_wheel_tick_to_tv(ev_uint64_t tick, struct timeval *tv)
+{
+	tv->tv_sec = (long)(tick / 1000);
+	tv->tv_usec = (long)(tick % 1000) * 1000;
+}
+
+/* Returns the tick at which ev expires, taking its slack into account */
+static inline ev_uint64_t
+timer_wheel_event_tick_(struct timer_wheel *w, struct event *ev)
+{
+	ev_uint64_t tick = timer_wheel_tick(&ev->ev_timeout);
+	ev_uint64_t slack, grain;
+	int us = ev->ev_slack >= 0 ? ev->ev_slack : w->slack;
+
+	if (us < 1000)
+		return (tick);
+	slack = grain = (ev_uint64_t)us / 1000;
+	while (grain & (grain - 1))
+		grain &= grain - 1;
+	/* still later than tick, as grain <= slack */
+	return ((tick + slack) / grain * grain);
+}
+
+/*
+ * Returns the slot that ev belongs to given the current tick, and stores
+ * a bit to maintain in the slot map in *mapp and *bitp.  The overflow list has
+ * no map bit; *mapp is set to NULL for it.
+ */
+static inline struct event_list *
+timer_wheel_slot_(struct timer_wheel *w, struct event *ev,
+    ev_uint64_t **mapp, ev_uint64_t *bitp)
+{
+	ev_uint64_t tick = timer_wheel_event_tick_(w, ev);
+	ev_uint64_t diff;
+	int level, idx;
+
+	/* already expired events are due on the next tick we process */
+	if (tick < w->cur)
+		tick = w->cur;
+
+	diff = tick ^ w->cur;
+	if (diff < TW_L0_SIZE) {
+		idx = (int)(tick & (TW_L0_SIZE - 1));
+		*mapp = &w->l0_map[idx / 64];
+		*bitp = (ev_uint64_t)1 << (idx % 64);
+		return (&w->l0[idx]);
+	}
+
+	if (diff >> TW_SPAN_BITS) {
+		*mapp = NULL;
+		*bitp = 0;
+		return (&w->overflow);
+	}
+
+	level = (timer_wheel_fls_(diff) - TW_L0_BITS) / TW_LN_BITS;
+	idx = (int)((tick >> TW_LN_SHIFT(level)) & (TW_LN_SIZE - 1));
+	*mapp = &w->ln_map[level];
+	*bitp = (ev_uint64_t)1 << idx;
+	return (&w->ln[level][idx]);
+}
+
+void
+timer_wheel_insert(struct timer_wheel *w, struct event *ev)
+{
+	ev_uint64_t *map, bit;
+	struct event_list *slot = timer_wheel_slot_(w, ev, &map, &bit);
+
+	TAILQ_INSERT_TAIL(slot, ev, ev_timeout_pos.ev_timeout_next);
+	if (map != NULL)
+		*map |= bit;
+	w->n++;
+}
+
+void
+timer_wheel_erase(struct timer_wheel *w, struct event *ev)
+{
+	ev_uint64_t *map, bit;
+	struct event_list *slot = timer_wheel_slot_(w, ev, &map, &bit);
+
+	TAILQ_REMOVE(slot, ev, ev_timeout_pos.ev_timeout_next);
+	if (map != NULL && TAILQ_EMPTY(slot))
+		*map &= ~bit;
+	w->n--;
+}
+
+/*
+ * Stores the next tick at which the wheel needs attention: either a level
+ * 0 slot expires or an upper level slot has to be cascaded.  Waking up for
+ * a cascade may be early, but never late.  Returns -1 if the wheel is empty.
+ */
+int
+timer_wheel_next(struct timer_wheel *w, ev_uint64_t *tickp)
+{
+	ev_uint64_t best, t, map;
+	int i, idx, shift;
+
+	if (!w->n)
+		return (-1);
+
+	/* nothing is due before the overflow list is cascaded */
+	best = ((w->cur >> TW_SPAN_BITS) + 1) << TW_SPAN_BITS;
+
+	idx = (int)(w->cur & (TW_L0_SIZE - 1));
+	for (i = idx / 64; i < TW_L0_SIZE / 64; ++i) {
+		map = w->l0_map[i];
+		if (i == idx / 64)
+			map &= ~(ev_uint64_t)0 << (idx % 64);
+		if (map) {
+			t = (w->cur & ~(ev_uint64_t)(TW_L0_SIZE - 1)) +
+			    i * 64 + timer_wheel_ffs_(map);
+			/* nothing on level 0 can beat its earliest slot */
+			*tickp = t;
+			return (0);
+		}
+	}
+
+	for (i = 0; i < TW_LN_LEVELS; ++i) {
+		shift = TW_LN_SHIFT(i);
+		idx = (int)((w->cur >> shift) & (TW_LN_SIZE - 1));
+		/* slots at or before idx are empty: they share our prefix */
+		map = w->ln_map[i] & (~(ev_uint64_t)1 << idx);
+		if (!map)
+			continue;
+		t = ((w->cur >> (shift + TW_LN_BITS)) << (shift + TW_LN_BITS)) +
+		    ((ev_uint64_t)timer_wheel_ffs_(map) << shift);
+		if (t < best)
+			best = t;
+		/* slots on higher levels cascade later than this one */
+		break;
+	}
+
+	*tickp = best;
+	return (0);
+}
+
+static inline void
+timer_wheel_cascade_list_(struct timer_wheel *w, struct event_list *slot)
+{
+	struct event_list tmp;
+	struct event *ev;
+
+	TAILQ_INIT(&tmp);
+	while ((ev = TAILQ_FIRST(slot)) != NULL) {
+		TAILQ_REMOVE(slot, ev, ev_timeout_pos.ev_timeout_next);
+		TAILQ_INSERT_TAIL(&tmp, ev, ev_timeout_pos.ev_timeout_next);
+	}
+	while ((ev = TAILQ_FIRST(&tmp)) != NULL) {
+		TAILQ_REMOVE(&tmp, ev, ev_timeout_pos.ev_timeout_next);
+		w->n--;
+		timer_wheel_insert(w, ev);
+	}
+}
+
+/* Moves the events of every slot whose boundary is the current tick one
+ * or more levels down, starting from the top. */
+static inline void
+timer_wheel_cascade_(struct timer_wheel *w)
+{
+	int i, idx, shift;
+
+	if (!(w->cur & (((ev_uint64_t)1 << TW_SPAN_BITS) - 1)))
+		timer_wheel_cascade_list_(w, &w->overflow);
+
+	for (i = TW_LN_LEVELS - 1; i >= 0; --i) {
+		shift = TW_LN_SHIFT(i);
+		if (w->cur & (((ev_uint64_t)1 << shift) - 1))
+			continue;
+		idx = (int)((w->cur >> shift) & (TW_LN_SIZE - 1));
+		if (!(w->ln_map[i] & ((ev_uint64_t)1 << idx)))
+			continue;
+		w->ln_map[i] &= ~((ev_uint64_t)1 << idx);
+		timer_wheel_cascade_list_(w, &w->ln[i][idx]);
+	}
+}
+
+/*
+ * Advances the wheel up to and including tick now.  Returns the next
+ * level 0 slot whose events have expired, or NULL once everything up to
+ * now has been handled.  The caller must remove every event of a returned
+ * slot from the wheel before calling this function again.
+ */
+struct event_list *
+timer_wheel_expire(struct timer_wheel *w, ev_uint64_t now)
+{
+	struct event_list *slot;
+	ev_uint64_t next;
+
+	while (timer_wheel_next(w, &next) == 0 && next <= now) {
+		if (next > w->cur) {
+			/* everything in between is empty */
+			w->cur = next;
+		}
+		timer_wheel_cascade_(w);
+		slot = &w->l0[w->cur & (TW_L0_SIZE - 1)];
+		if (!TAILQ_EMPTY(slot))
+			return (slot);
+		w->cur++;
+	}
+
+	if (w->cur <= now) {
+		/* cur may now start a slot of a higher level */
+		w->cur = now + 1;
+		timer_wheel_cascade_(w);
+	}
+	return (NULL);
+}
+
+/* Returns an arbitrary event stored in the wheel, or NULL if it is empty */
+struct event *
+timer_wheel_any(struct timer_wheel *w)
+{
+	int i;
+
+	if (!w->n)
+		return (NULL);
+	for (i = 0; i < TW_L0_SIZE / 64; ++i)
+		if (w->l0_map[i])
+			return (TAILQ_FIRST(&w->l0[i * 64 +
+			    timer_wheel_ffs_(w->l0_map[i])]));
+	for (i = 0; i < TW_LN_LEVELS; ++i)
+		if (w->ln_map[i])
+			return (TAILQ_FIRST(&w->ln[i][
+			    timer_wheel_ffs_(w->ln_map[i])]));
+	return (TAILQ_FIRST(&w->overflow));
+}
+
+#endif /* _TIMER_WHEEL_H_ */